@@ -5,17 +5,215 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <switch.h>
 
 /* this is a lot easier when you have a real console */
 
+/*! number of lines the ring holds */
+#define LOG_SLOTS 128
+/*! longest line; longer ones are cut */
+#define LOG_LINE_SIZE 192
+/*! how often the flusher drains the ring while lines are coming in, in ns */
+#define LOG_FLUSH_BUSY 10000000ULL
+/*! how often the flusher drains the ring when it is quiet, in ns */
+#define LOG_FLUSH_IDLE 100000000ULL
+#define LOG_STACK_SIZE 0x4000
+/*! below the session and I/O threads */
+#define LOG_PRIORITY 0x3B
+
 int should_log = 0;
 
+/*! log ring slot */
+typedef struct
+{
+  atomic_size_t seq;        /*!< ring position this slot is ready for */
+  char line[LOG_LINE_SIZE]; /*!< formatted line */
+} log_slot_t;
+
+/* session workers log from several threads; they claim slots with a
+ * compare-and-swap and the flusher thread writes them out in order */
+static log_slot_t log_ring[LOG_SLOTS];
+/*! next position to fill */
+static atomic_size_t log_tail;
+/*! next position to write out; only used by the flusher */
+static size_t log_head;
+/*! lines lost because the ring was full */
+static atomic_uint log_dropped;
+/*! whether the flusher should keep running */
+static atomic_bool log_running;
+/*! whether the flusher is up */
+static bool log_started = false;
+/*! flusher thread */
+static Thread log_thread;
+/*! log file, open for the flusher's lifetime */
+static FILE *log_file = NULL;
+/*! stdio buffer for the log file */
+static char log_file_buffer[0x1000];
+
+/*! add a line to the ring, or count it as dropped if the ring is full
+ *
+ *  @param[in] fmt format string
+ *  @param[in] ap  format arguments
+ */
+static void
+log_push(const char *fmt, va_list ap)
+{
+  log_slot_t *slot;
+  size_t pos, seq;
+  int len;
+
+  if (!log_started)
+    return;
+
+  pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+  while (true)
+  {
+    slot = &log_ring[pos % LOG_SLOTS];
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq == pos)
+    {
+      /* the slot is free; claim it */
+      if (atomic_compare_exchange_weak_explicit(&log_tail, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed))
+        break;
+    }
+    else if ((ptrdiff_t)(seq - pos) < 0)
+    {
+      /* the flusher is a whole ring behind; never make the caller wait */
+      atomic_fetch_add_explicit(&log_dropped, 1, memory_order_relaxed);
+      return;
+    }
+    else
+      pos = atomic_load_explicit(&log_tail, memory_order_relaxed);
+  }
+
+  len = vsnprintf(slot->line, sizeof(slot->line), fmt, ap);
+  if (len >= (int)sizeof(slot->line))
+    slot->line[sizeof(slot->line) - 2] = '\n';
+
+  /* hand the slot to the flusher */
+  atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/*! write out every finished line in the ring
+ *
+ *  @returns number of lines written
+ */
+static size_t
+log_drain(void)
+{
+  log_slot_t *slot;
+  size_t count = 0;
+
+  while (true)
+  {
+    slot = &log_ring[log_head % LOG_SLOTS];
+    if (atomic_load_explicit(&slot->seq, memory_order_acquire) != log_head + 1)
+      return count;
+
+    fputs(slot->line, log_file);
+
+    /* free the slot for the next time around the ring */
+    atomic_store_explicit(&slot->seq, log_head + LOG_SLOTS, memory_order_release);
+    ++log_head;
+    ++count;
+  }
+}
+
+/*! flusher thread
+ *
+ *  @param[in] arg unused
+ */
+static void
+log_thread_func(void *arg)
+{
+  unsigned dropped, reported = 0;
+  size_t count;
+  bool running;
+
+  (void)arg;
+
+  do
+  {
+    running = atomic_load(&log_running);
+
+    count = log_drain();
+
+    dropped = atomic_load_explicit(&log_dropped, memory_order_relaxed);
+    if (dropped != reported)
+    {
+      fprintf(log_file, "log: dropped %u lines\n", dropped - reported);
+      reported = dropped;
+      ++count;
+    }
+
+    if (count != 0)
+      fflush(log_file);
+
+    if (running)
+      svcSleepThread(count != 0 ? LOG_FLUSH_BUSY : LOG_FLUSH_IDLE);
+  } while (running);
+}
+
 void
 console_init(void)
 {
+  Result rc;
+  size_t i;
+
+  if (!should_log || log_started)
+    return;
+
+  log_file = fopen(LOG_PATH, "a");
+  if (log_file == NULL)
+    return;
+  setvbuf(log_file, log_file_buffer, _IOFBF, sizeof(log_file_buffer));
+
+  for (i = 0; i < LOG_SLOTS; ++i)
+    atomic_init(&log_ring[i].seq, i);
+  atomic_init(&log_tail, 0);
+  atomic_init(&log_dropped, 0);
+  log_head = 0;
+
+  atomic_store(&log_running, true);
+  rc = threadCreate(&log_thread, log_thread_func, NULL, NULL, LOG_STACK_SIZE, LOG_PRIORITY, -2);
+  if (R_SUCCEEDED(rc))
+  {
+    rc = threadStart(&log_thread);
+    if (R_FAILED(rc))
+      threadClose(&log_thread);
+  }
+
+  if (R_FAILED(rc))
+  {
+    fclose(log_file);
+    log_file = NULL;
+    return;
+  }
+
+  log_started = true;
+}
+
+void
+console_exit(void)
+{
+  if (!log_started)
+    return;
+
+  /* the flusher drains the ring once more before it stops */
+  atomic_store(&log_running, false);
+  threadWaitForExit(&log_thread);
+  threadClose(&log_thread);
+  log_started = false;
+
+  fclose(log_file);
+  log_file = NULL;
 }
 
 void
@@ -28,28 +226,24 @@ void
 console_print(const char *fmt, ...)
 {
   if(should_log) {
-    stdout = stderr = fopen("/config/sys-ftpd/logs/ftpd.log", "a");
     va_list ap;
     va_start(ap, fmt);
-    vprintf(fmt, ap);
+    log_push(fmt, ap);
     va_end(ap);
-    fclose(stdout);
   }
 }
 
 void
 debug_print(const char *fmt, ...)
 {
-  if(should_log) {
-    stdout = stderr = fopen("/config/sys-ftpd/logs/ftpd.log", "a");
 #ifdef ENABLE_LOGGING
+  if(should_log) {
     va_list ap;
     va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
+    log_push(fmt, ap);
     va_end(ap);
-#endif
-    fclose(stdout);
   }
+#endif
 }
 
 void console_render(void)
@@ -27,10 +27,15 @@
 #define WHITE
 #endif
 
+/*! log file, which clients may not read or overwrite */
+#define LOG_PATH "/config/sys-ftpd/logs/ftpd.log"
+
 extern int should_log;
 
 void console_init(void);
 
+void console_exit(void);
+
 __attribute__((format(printf,1,2)))
 void console_set_status(const char *fmt, ...);
 
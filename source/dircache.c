@@ -0,0 +1,778 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#include "dircache.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <switch.h>
+#include "console.h"
+#include "memstat.h"
+#include "minIni.h"
+#include "util.h"
+
+/*! most memory the cache may use */
+#define MAX_CACHE_SIZE 0x40000
+/*! longest time a listing may be kept, in seconds */
+#define MAX_CACHE_TTL 3600
+/*! latest time a render can be valid until */
+#define TIME_MAX ((time_t)((1ULL << (sizeof(time_t) * 8 - 1)) - 1))
+/*! first allocation for a recording's entries */
+#define DIRCACHE_GROW_MIN 0x100
+/*! most a recording grows at a time */
+#define DIRCACHE_GROW_MAX 0x1000
+
+/* the SD card is FAT, so differently cased paths are the same directory */
+#if defined(_3DS) || defined(__SWITCH__)
+#define DIRCACHE_FOLD_CASE
+#endif
+
+struct dircache_render
+{
+  dircache_render_t *next; /*!< next render of the same listing */
+  unsigned key;            /*!< listing format */
+  time_t valid_until;      /*!< when LIST's date column would change */
+  char *data;              /*!< output */
+  size_t size;             /*!< bytes of output */
+  size_t capacity;         /*!< bytes allocated for output */
+};
+
+struct dircache_listing
+{
+  dircache_listing_t *prev; /*!< more recently used listing */
+  dircache_listing_t *next; /*!< less recently used listing */
+  unsigned refs;            /*!< references, including the cache's own */
+  unsigned facts;           /*!< DIRCACHE_* facts of the entries */
+  unsigned generation;      /*!< cache_generation when recording started */
+  uint64_t time;            /*!< when it was read, in ms */
+  uint32_t hash;            /*!< path hash */
+  size_t pathlen;           /*!< path length */
+  char *data;               /*!< packed dircache_dirent_t entries */
+  size_t size;              /*!< bytes of entries */
+  size_t capacity;          /*!< bytes allocated for entries */
+  dircache_render_t *renders; /*!< output already formatted from the entries */
+  char path[];              /*!< directory path */
+};
+
+/* sessions on every worker thread share the cache */
+static Mutex cache_lock;
+/*! most recently used listing */
+static dircache_listing_t *cache_head = NULL;
+/*! least recently used listing */
+static dircache_listing_t *cache_tail = NULL;
+/*! memory budget; 0 disables the cache */
+static size_t cache_budget = 0;
+/*! memory held by listings, cached or being recorded */
+static size_t cache_used = 0;
+/*! how long a listing stays valid, in ms; covers changes made by others */
+static uint64_t cache_ttl = 0;
+/*! bumped on every invalidation */
+static unsigned cache_generation = 0;
+
+/*! get the size of a listing entry
+ *
+ *  @param[in] len name length
+ *
+ *  @returns entry size, keeping the next one aligned
+ */
+static inline size_t
+dirent_size(size_t len)
+{
+  size_t size = offsetof(dircache_dirent_t, name) + len + 1;
+  return (size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+/*! hash a path
+ *
+ *  @param[in] path path
+ *  @param[in] len  path length
+ *
+ *  @returns hash
+ */
+static uint32_t
+path_hash(const char *path, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < len; ++i)
+  {
+#ifdef DIRCACHE_FOLD_CASE
+    hash ^= (uint8_t)tolower((unsigned char)path[i]);
+#else
+    hash ^= (uint8_t)path[i];
+#endif
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+/*! compare the start of two paths
+ *
+ *  @param[in] a   path
+ *  @param[in] b   path
+ *  @param[in] len length to compare
+ *
+ *  @returns whether they match
+ */
+static bool
+path_match(const char *a, const char *b, size_t len)
+{
+#ifdef DIRCACHE_FOLD_CASE
+  return strncasecmp(a, b, len) == 0;
+#else
+  return memcmp(a, b, len) == 0;
+#endif
+}
+
+/*! check that a path has a single spelling
+ *
+ *  Paths with empty, . or .. components could name a directory that is
+ *  also cached under another path, and would miss its invalidation.
+ *
+ *  @param[in] path path
+ *
+ *  @returns whether it can be used as a key
+ */
+static bool
+path_canonical(const char *path)
+{
+  const char *p;
+
+  if (path[0] != '/')
+    return false;
+  if (path[1] == 0)
+    return true;
+
+  for (p = path; *p != 0; ++p)
+  {
+    if (*p != '/')
+      continue;
+
+    if (p[1] == '/' || p[1] == 0)
+      return false;
+    if (p[1] == '.' && (p[2] == '/' || p[2] == 0))
+      return false;
+    if (p[1] == '.' && p[2] == '.' && (p[3] == '/' || p[3] == 0))
+      return false;
+  }
+
+  return true;
+}
+
+/*! free a render
+ *
+ *  @param[in] render render to free
+ */
+static void
+render_free(dircache_render_t *render)
+{
+  size_t bytes = sizeof(*render) + render->capacity;
+
+  cache_used -= bytes;
+  memstat_sub(MEM_CACHE, bytes);
+  free(render->data);
+  free(render);
+}
+
+/*! free a listing with no references left
+ *
+ *  @param[in] listing listing to free
+ */
+static void
+listing_free(dircache_listing_t *listing)
+{
+  size_t bytes = sizeof(*listing) + listing->pathlen + 1 + listing->capacity;
+  dircache_render_t *render;
+
+  while ((render = listing->renders) != NULL)
+  {
+    listing->renders = render->next;
+    render_free(render);
+  }
+
+  cache_used -= bytes;
+  memstat_sub(MEM_CACHE, bytes);
+  free(listing->data);
+  free(listing);
+}
+
+/*! drop a reference to a listing; call with cache_lock held
+ *
+ *  @param[in] listing listing
+ */
+static void
+listing_unref(dircache_listing_t *listing)
+{
+  if (--listing->refs == 0)
+    listing_free(listing);
+}
+
+/*! take a listing out of the cache; call with cache_lock held
+ *
+ *  Sessions still sending it keep it until they are done.
+ *
+ *  @param[in] listing listing
+ */
+static void
+listing_evict(dircache_listing_t *listing)
+{
+  if (listing->prev != NULL)
+    listing->prev->next = listing->next;
+  else
+    cache_head = listing->next;
+
+  if (listing->next != NULL)
+    listing->next->prev = listing->prev;
+  else
+    cache_tail = listing->prev;
+
+  listing->prev = listing->next = NULL;
+  listing_unref(listing);
+}
+
+/*! find a cached listing; call with cache_lock held
+ *
+ *  @param[in] path path
+ *  @param[in] len  path length
+ *
+ *  @returns listing, or NULL
+ */
+static dircache_listing_t *
+listing_find(const char *path, size_t len)
+{
+  dircache_listing_t *listing;
+  uint32_t hash = path_hash(path, len);
+
+  for (listing = cache_head; listing != NULL; listing = listing->next)
+  {
+    if (listing->hash == hash && listing->pathlen == len && path_match(listing->path, path, len))
+      return listing;
+  }
+
+  return NULL;
+}
+
+/*! evict least recently used listings until there is room; call with
+ *  cache_lock held
+ *
+ *  @param[in] bytes bytes needed
+ *
+ *  @returns whether there is room
+ */
+static bool
+make_room(size_t bytes)
+{
+  while (cache_used + bytes > cache_budget && cache_tail != NULL)
+    listing_evict(cache_tail);
+
+  return cache_used + bytes <= cache_budget;
+}
+
+/*! grow a buffer that counts against the cache budget
+ *
+ *  @param[in,out] data     buffer
+ *  @param[in,out] capacity bytes allocated
+ *  @param[in]     size     bytes used
+ *  @param[in]     need     bytes about to be added
+ *
+ *  @returns -1 if there is no room
+ */
+static int
+buffer_reserve(char **data, size_t *capacity, size_t size, size_t need)
+{
+  size_t grow;
+  char *p;
+
+  if (size + need <= *capacity)
+    return 0;
+
+  /* double while small, so small directories stay small */
+  grow = *capacity;
+  if (grow < DIRCACHE_GROW_MIN)
+    grow = DIRCACHE_GROW_MIN;
+  if (grow > DIRCACHE_GROW_MAX)
+    grow = DIRCACHE_GROW_MAX;
+  if (grow < size + need - *capacity)
+    grow = size + need - *capacity;
+
+  mutexLock(&cache_lock);
+
+  if (!make_room(grow))
+  {
+    mutexUnlock(&cache_lock);
+    return -1;
+  }
+
+  p = (char *)realloc(*data, *capacity + grow);
+  if (p == NULL)
+  {
+    memstat_fail(MEM_CACHE);
+    mutexUnlock(&cache_lock);
+    return -1;
+  }
+
+  *data = p;
+  *capacity += grow;
+  cache_used += grow;
+  memstat_add(MEM_CACHE, grow);
+
+  mutexUnlock(&cache_lock);
+  return 0;
+}
+
+/*! give back the unused end of a buffer; call with cache_lock held
+ *
+ *  @param[in,out] data     buffer
+ *  @param[in,out] capacity bytes allocated
+ *  @param[in]     size     bytes used
+ */
+static void
+buffer_trim(char **data, size_t *capacity, size_t size)
+{
+  char *p;
+
+  if (*capacity <= size || size == 0)
+    return;
+
+  p = (char *)realloc(*data, size);
+  if (p == NULL)
+    return;
+
+  cache_used -= *capacity - size;
+  memstat_sub(MEM_CACHE, *capacity - size);
+  *data = p;
+  *capacity = size;
+}
+
+/*! forget the listing of the directory holding a path; call with
+ *  cache_lock held
+ *
+ *  @param[in]     path path
+ *  @param[in,out] len  path length; set to the directory's
+ *
+ *  @returns whether there is a directory above
+ */
+static bool
+invalidate_parent(const char *path, size_t *len)
+{
+  dircache_listing_t *listing;
+  size_t i = *len;
+
+  if (i <= 1)
+    return false;
+
+  /* the directory holding /a is /, and the one holding /a/b is /a */
+  while (i > 0 && path[i - 1] != '/')
+    --i;
+  *len = (i > 1) ? i - 1 : 1;
+
+  listing = listing_find(path, *len);
+  if (listing != NULL)
+    listing_evict(listing);
+
+  return true;
+}
+
+/*! drop every cached listing; call with cache_lock held */
+static void
+flush(void)
+{
+  while (cache_head != NULL)
+    listing_evict(cache_head);
+}
+
+void
+dircache_init(void)
+{
+  char str_value[100];
+  long value;
+
+  mutexInit(&cache_lock);
+
+  ini_gets("Cache", "listings:", "65536", str_value, sizearray(str_value), CONFIGPATH);
+  value = atol(str_value);
+  if (value < 0)
+    value = 0;
+  if (value > MAX_CACHE_SIZE)
+    value = MAX_CACHE_SIZE;
+  cache_budget = value;
+
+  ini_gets("Cache", "listings_ttl:", "10", str_value, sizearray(str_value), CONFIGPATH);
+  value = atol(str_value);
+  if (value < 1)
+    value = 1;
+  if (value > MAX_CACHE_TTL)
+    value = MAX_CACHE_TTL;
+  cache_ttl = value * 1000;
+}
+
+void
+dircache_exit(void)
+{
+  /* the sessions are gone, so nothing else holds a listing */
+  flush();
+  cache_budget = 0;
+}
+
+dircache_listing_t *
+dircache_get(const char *path, unsigned facts, uint64_t now)
+{
+  dircache_listing_t *listing;
+
+  if (cache_budget == 0 || !path_canonical(path))
+    return NULL;
+
+  mutexLock(&cache_lock);
+
+  listing = listing_find(path, strlen(path));
+  if (listing != NULL && now - listing->time >= cache_ttl)
+  {
+    /* too old; it may have been changed behind our back */
+    listing_evict(listing);
+    listing = NULL;
+  }
+
+  if (listing != NULL && (listing->facts & facts) == facts)
+  {
+    /* move to the front */
+    if (listing != cache_head)
+    {
+      listing->prev->next = listing->next;
+      if (listing->next != NULL)
+        listing->next->prev = listing->prev;
+      else
+        cache_tail = listing->prev;
+
+      listing->prev = NULL;
+      listing->next = cache_head;
+      cache_head->prev = listing;
+      cache_head = listing;
+    }
+
+    ++listing->refs;
+  }
+  else
+    listing = NULL;
+
+  mutexUnlock(&cache_lock);
+
+  return listing;
+}
+
+dircache_listing_t *
+dircache_record(const char *path, unsigned facts, uint64_t now)
+{
+  dircache_listing_t *listing;
+  size_t len, bytes;
+
+  if (cache_budget == 0 || !path_canonical(path))
+    return NULL;
+
+  len = strlen(path);
+  bytes = sizeof(*listing) + len + 1;
+
+  mutexLock(&cache_lock);
+
+  if (!make_room(bytes))
+  {
+    mutexUnlock(&cache_lock);
+    return NULL;
+  }
+
+  listing = (dircache_listing_t *)malloc(bytes);
+  if (listing == NULL)
+  {
+    memstat_fail(MEM_CACHE);
+    mutexUnlock(&cache_lock);
+    return NULL;
+  }
+
+  memset(listing, 0, sizeof(*listing));
+  listing->refs = 1;
+  listing->facts = facts;
+  listing->generation = cache_generation;
+  listing->time = now;
+  listing->hash = path_hash(path, len);
+  listing->pathlen = len;
+  memcpy(listing->path, path, len + 1);
+
+  cache_used += bytes;
+  memstat_add(MEM_CACHE, bytes);
+
+  mutexUnlock(&cache_lock);
+
+  return listing;
+}
+
+int
+dircache_add(dircache_listing_t *listing, const char *name, const struct stat *st)
+{
+  dircache_dirent_t *dent;
+  size_t len = strlen(name);
+  size_t size = dirent_size(len);
+
+  if (len > UINT16_MAX)
+    return -1;
+
+  if (buffer_reserve(&listing->data, &listing->capacity, listing->size, size) != 0)
+    return -1;
+
+  dent = (dircache_dirent_t *)(listing->data + listing->size);
+  if (st != NULL)
+  {
+    dent->size = st->st_size;
+    dent->mtime = st->st_mtime;
+    dent->mode = st->st_mode;
+    dent->nlink = st->st_nlink;
+  }
+  else
+  {
+    dent->size = 0;
+    dent->mtime = 0;
+    dent->mode = 0;
+    dent->nlink = 0;
+  }
+  dent->len = len;
+  memcpy(dent->name, name, len + 1);
+
+  listing->size += size;
+  return 0;
+}
+
+void
+dircache_publish(dircache_listing_t *listing)
+{
+  dircache_listing_t *old;
+
+  mutexLock(&cache_lock);
+
+  if (listing->generation != cache_generation || cache_budget == 0)
+  {
+    /* something changed while it was being read */
+    listing_unref(listing);
+    mutexUnlock(&cache_lock);
+    return;
+  }
+
+  buffer_trim(&listing->data, &listing->capacity, listing->size);
+
+  old = listing_find(listing->path, listing->pathlen);
+  if (old != NULL)
+    listing_evict(old);
+
+  /* the caller's reference now belongs to the cache */
+  listing->prev = NULL;
+  listing->next = cache_head;
+  if (cache_head != NULL)
+    cache_head->prev = listing;
+  else
+    cache_tail = listing;
+  cache_head = listing;
+
+  /* it was counted while it grew, but other recordings may have taken
+   * more since; keep the newest listing */
+  while (cache_used > cache_budget && cache_tail != listing)
+    listing_evict(cache_tail);
+
+  mutexUnlock(&cache_lock);
+}
+
+void
+dircache_put(dircache_listing_t *listing)
+{
+  mutexLock(&cache_lock);
+  listing_unref(listing);
+  mutexUnlock(&cache_lock);
+}
+
+const dircache_dirent_t *
+dircache_next(const dircache_listing_t *listing, size_t *pos)
+{
+  const dircache_dirent_t *dent;
+
+  /* entries never change once recorded, so no lock is needed */
+  if (*pos >= listing->size)
+    return NULL;
+
+  dent = (const dircache_dirent_t *)(listing->data + *pos);
+  *pos += dirent_size(dent->len);
+  return dent;
+}
+
+bool
+dircache_render_get(dircache_listing_t *listing, const char *path, unsigned key, time_t now,
+                    const char **data, size_t *size)
+{
+  dircache_render_t *render;
+  bool found = false;
+
+  /* NLST output has the path in it, so it has to be spelled the same */
+  if (strcmp(listing->path, path) != 0)
+    return false;
+
+  mutexLock(&cache_lock);
+
+  for (render = listing->renders; render != NULL; render = render->next)
+  {
+    if (render->key == key && now < render->valid_until)
+    {
+      /* renders never change once published, so no lock is needed to send it */
+      *data = render->size != 0 ? render->data : "";
+      *size = render->size;
+      found = true;
+      break;
+    }
+  }
+
+  mutexUnlock(&cache_lock);
+
+  return found;
+}
+
+dircache_render_t *
+dircache_render_record(dircache_listing_t *listing, const char *path, unsigned key)
+{
+  dircache_render_t *render;
+
+  if (cache_budget == 0 || strcmp(listing->path, path) != 0)
+    return NULL;
+
+  mutexLock(&cache_lock);
+
+  if (!make_room(sizeof(*render)))
+  {
+    mutexUnlock(&cache_lock);
+    return NULL;
+  }
+
+  render = (dircache_render_t *)malloc(sizeof(*render));
+  if (render == NULL)
+  {
+    memstat_fail(MEM_CACHE);
+    mutexUnlock(&cache_lock);
+    return NULL;
+  }
+
+  memset(render, 0, sizeof(*render));
+  render->key = key;
+  render->valid_until = TIME_MAX;
+
+  cache_used += sizeof(*render);
+  memstat_add(MEM_CACHE, sizeof(*render));
+
+  mutexUnlock(&cache_lock);
+
+  return render;
+}
+
+int
+dircache_render_add(dircache_render_t *render, const char *data, size_t size)
+{
+  if (buffer_reserve(&render->data, &render->capacity, render->size, size) != 0)
+    return -1;
+
+  memcpy(render->data + render->size, data, size);
+  render->size += size;
+  return 0;
+}
+
+void
+dircache_render_expire(dircache_render_t *render, time_t when)
+{
+  if (when < render->valid_until)
+    render->valid_until = when;
+}
+
+void
+dircache_render_publish(dircache_listing_t *listing, dircache_render_t *render)
+{
+  dircache_render_t **prev, *old;
+
+  mutexLock(&cache_lock);
+
+  buffer_trim(&render->data, &render->capacity, render->size);
+
+  /* replace an expired render of the same format */
+  for (prev = &listing->renders; (old = *prev) != NULL; prev = &old->next)
+  {
+    if (old->key == render->key)
+    {
+      *prev = old->next;
+      render_free(old);
+      break;
+    }
+  }
+
+  render->next = listing->renders;
+  listing->renders = render;
+
+  mutexUnlock(&cache_lock);
+}
+
+void
+dircache_render_discard(dircache_render_t *render)
+{
+  mutexLock(&cache_lock);
+  render_free(render);
+  mutexUnlock(&cache_lock);
+}
+
+void
+dircache_invalidate(const char *path)
+{
+  size_t len;
+
+  if (cache_budget == 0)
+    return;
+
+  mutexLock(&cache_lock);
+
+  ++cache_generation;
+
+  if (!path_canonical(path))
+    flush();
+  else
+  {
+    len = strlen(path);
+    if (invalidate_parent(path, &len))
+      invalidate_parent(path, &len);
+  }
+
+  mutexUnlock(&cache_lock);
+}
+
+void
+dircache_invalidate_tree(const char *path)
+{
+  dircache_listing_t *listing, *next;
+  size_t len;
+
+  if (cache_budget == 0)
+    return;
+
+  mutexLock(&cache_lock);
+
+  ++cache_generation;
+
+  len = strlen(path);
+  if (!path_canonical(path) || len == 1)
+    flush();
+  else
+  {
+    /* the directory itself and everything under it */
+    for (listing = cache_head; listing != NULL; listing = next)
+    {
+      next = listing->next;
+      if (listing->pathlen >= len && path_match(listing->path, path, len) &&
+          (listing->path[len] == 0 || listing->path[len] == '/'))
+        listing_evict(listing);
+    }
+
+    if (invalidate_parent(path, &len))
+      invalidate_parent(path, &len);
+  }
+
+  mutexUnlock(&cache_lock);
+}
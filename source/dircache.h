@@ -0,0 +1,163 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <time.h>
+
+/*! a cached listing has the type and size of each entry */
+#define DIRCACHE_STAT (1 << 0)
+/*! a cached listing has the modification time of each entry */
+#define DIRCACHE_MTIME (1 << 1)
+
+/*! cached directory entry */
+typedef struct
+{
+  uint64_t size;  /*!< file size */
+  int64_t mtime;  /*!< modification time */
+  uint32_t mode;  /*!< st_mode */
+  uint32_t nlink; /*!< st_nlink */
+  uint16_t len;   /*!< name length */
+  char name[];    /*!< name, nul-terminated */
+} dircache_dirent_t;
+
+/*! snapshot of a directory */
+typedef struct dircache_listing dircache_listing_t;
+
+/*! listing output formatted from a snapshot */
+typedef struct dircache_render dircache_render_t;
+
+/*! read the cache settings */
+void dircache_init(void);
+
+/*! drop every cached listing */
+void dircache_exit(void);
+
+/*! look up a cached listing
+ *
+ *  @param[in] path  directory path
+ *  @param[in] facts DIRCACHE_* facts the listing needs
+ *  @param[in] now   current time in ms
+ *
+ *  @returns listing to release with dircache_put, or NULL on a miss
+ */
+dircache_listing_t *dircache_get(const char *path, unsigned facts, uint64_t now);
+
+/*! start recording a listing read from the filesystem
+ *
+ *  @param[in] path  directory path
+ *  @param[in] facts DIRCACHE_* facts the entries will have
+ *  @param[in] now   current time in ms
+ *
+ *  @returns listing to fill with dircache_add, or NULL if it can't be cached
+ */
+dircache_listing_t *dircache_record(const char *path, unsigned facts, uint64_t now);
+
+/*! add an entry to a listing being recorded
+ *
+ *  @param[in] listing listing from dircache_record
+ *  @param[in] name    entry name
+ *  @param[in] st      entry stat, or NULL if the listing has no facts
+ *
+ *  @returns -1 if the listing outgrew the cache
+ */
+int dircache_add(dircache_listing_t *listing, const char *name, const struct stat *st);
+
+/*! put a recorded listing in the cache
+ *
+ *  It is dropped if something in the cache was invalidated since the
+ *  recording started, since it may have missed that change.
+ *
+ *  @param[in] listing listing from dircache_record; the caller's reference
+ *                     goes with it
+ */
+void dircache_publish(dircache_listing_t *listing);
+
+/*! release a listing
+ *
+ *  @param[in] listing listing to release
+ */
+void dircache_put(dircache_listing_t *listing);
+
+/*! walk the entries of a listing
+ *
+ *  @param[in]     listing listing from dircache_get
+ *  @param[in,out] pos     position, start at 0
+ *
+ *  @returns next entry, or NULL at the end
+ */
+const dircache_dirent_t *dircache_next(const dircache_listing_t *listing, size_t *pos);
+
+/*! look up output already formatted from a listing
+ *
+ *  @param[in]  listing listing from dircache_get
+ *  @param[in]  path    directory path as the client spelled it
+ *  @param[in]  key     listing format
+ *  @param[in]  now     time the output is for
+ *  @param[out] data    output; valid while the listing is held
+ *  @param[out] size    output size
+ *
+ *  @returns whether it was found
+ */
+bool dircache_render_get(dircache_listing_t *listing, const char *path, unsigned key, time_t now,
+                         const char **data, size_t *size);
+
+/*! start recording formatted output of a listing
+ *
+ *  @param[in] listing listing from dircache_get or dircache_record
+ *  @param[in] path    directory path as the client spelled it
+ *  @param[in] key     listing format
+ *
+ *  @returns render to fill with dircache_render_add, or NULL if it can't be
+ *           cached
+ */
+dircache_render_t *dircache_render_record(dircache_listing_t *listing, const char *path,
+                                          unsigned key);
+
+/*! add output to a render being recorded
+ *
+ *  @param[in] render render from dircache_render_record
+ *  @param[in] data   output
+ *  @param[in] size   output size
+ *
+ *  @returns -1 if the render outgrew the cache
+ */
+int dircache_render_add(dircache_render_t *render, const char *data, size_t size);
+
+/*! limit how long a render stays valid
+ *
+ *  @param[in] render render from dircache_render_record
+ *  @param[in] when   time the output would start to look different
+ */
+void dircache_render_expire(dircache_render_t *render, time_t when);
+
+/*! attach a recorded render to its listing
+ *
+ *  @param[in] listing listing it was formatted from
+ *  @param[in] render  render from dircache_render_record
+ */
+void dircache_render_publish(dircache_listing_t *listing, dircache_render_t *render);
+
+/*! throw away a render being recorded
+ *
+ *  @param[in] render render from dircache_render_record
+ */
+void dircache_render_discard(dircache_render_t *render);
+
+/*! forget the listings showing a path that changed
+ *
+ *  Drops the listing of the directory holding the path and of the one
+ *  above it, whose entry for that directory changed too.
+ *
+ *  @param[in] path path that was created, written, or removed
+ */
+void dircache_invalidate(const char *path);
+
+/*! forget the listings of a directory tree that was removed or renamed
+ *
+ *  @param[in] path top of the tree
+ */
+void dircache_invalidate_tree(const char *path);
@@ -6,6 +6,9 @@
  * (https://tools.ietf.org/html/rfc3659) and suggested implementation details
  * from https://cr.yp.to/ftp/filesystem.html
  */
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* splice */
+#endif
 #include "ftp.h"
 #include <arpa/inet.h>
 #include <ctype.h>
@@ -26,6 +29,7 @@
 #include <sys/statvfs.h>
 #include <time.h>
 #include <unistd.h>
+#include <zlib.h>
 #ifdef _3DS
 #include <3ds.h>
 #define lstat stat
@@ -35,17 +39,90 @@
 #else
 #include <stdbool.h>
 #define BIT(x) (1 << (x))
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE
+#define HAVE_SPLICE
+#endif
 #endif
 #include "console.h"
+#include "dircache.h"
+#include "hash.h"
 #include "led.h"
+#include "memstat.h"
+#include "tar.h"
 #include "util.h"
 
 #define POLL_UNKNOWN (~(POLLIN | POLLPRI | POLLOUT))
 
+/*! longest time to block in poll; the pause poller only samples every 100ms */
+#define POLL_TIMEOUT 100
+
+/*! how long an adjusted free space estimate goes without a statvfs, in ms */
+#define FREE_SPACE_INTERVAL 10000
+
+/*! how often memory usage is logged, in ms */
+#define MEMSTAT_INTERVAL 60000
+
+/*! how long a client gets to make the data connection, in ms */
+#define DATA_CONNECT_TIMEOUT 30000
+
 #define XFER_BUFFERSIZE 0x4000
 #define SOCK_BUFFERSIZE 0x4000
-#define FILE_BUFFERSIZE 0x8000
+#define MAX_SOCK_BUFFERSIZE 0x25000 /* tcp_tx_buf_max_size in main.c */
 #define CMD_BUFFERSIZE 0x1000
+/*! list working directory size */
+#define LWD_BUFFERSIZE 0x1000
+/*! room for the longest listing entry: an NLST path, or facts and a name */
+#define LIST_ENTRY_RESERVE (LWD_BUFFERSIZE + sizeof(((struct dirent *)0)->d_name) + 0x100)
+/*! LIST shows the time instead of the year for files this recent, in seconds */
+#define LIST_RECENT (60 * 60 * 24 * 365 / 2)
+
+/*! maximum RETR read-ahead depth in transfer buffers */
+#define MAX_READ_AHEAD 8
+/*! most directory entries stat'd ahead of a listing */
+#define MAX_LIST_PREFETCH 16
+/*! room for the names and paths of the entries stat'd ahead */
+#define LIST_PREFETCH_PATHS 0x1000
+/*! deepest a recursive listing goes below the directory it was asked for */
+#define MAX_LIST_DEPTH 16
+/*! largest MODE B block */
+#define BLOCK_SIZE 0xFFFF
+/*! MODE B descriptor bits */
+#define BLOCK_EOF 0x40
+#define BLOCK_MARK 0x10
+/*! MODE B RETR data between restart markers */
+#define BLOCK_MARK_INTERVAL 0x100000
+/*! MODE Z compression window limits, in bits */
+#define MIN_DEFLATE_WINDOW 9
+#define MAX_DEFLATE_WINDOW 15
+/*! transfer buffer size limits */
+#define MIN_CHUNK_SIZE 0x1000
+#define MAX_CHUNK_SIZE 0x20000
+/*! most bytes handed to a single sendfile call */
+#define SENDFILE_SIZE 0x100000
+/*! most bytes moved through the STOR pipe at once; the default pipe capacity */
+#define SPLICE_SIZE 0x10000
+
+/*! maximum number of session workers */
+#define MAX_WORKERS 4
+/*! most session slots that can be configured */
+#define MAX_SESSIONS 32
+/*! pooled path string size; longer strings come from the heap */
+#define PATH_BLOCK_SIZE 256
+/*! number of pooled path strings; each session's cwd holds one */
+#define PATH_BLOCKS 64
+/*! stack size for worker threads; same as the main thread */
+#define WORKER_STACK_SIZE 0x4000
+/*! worker thread priority; same as the main thread */
+#define WORKER_PRIORITY 0x31
+
+/*! maximum number of file I/O threads */
+#define MAX_IO_THREADS 4
+/*! stack size for file I/O threads */
+#define IO_STACK_SIZE 0x4000
+/*! file I/O thread priority; just above the workers so the disk stays busy */
+#define IO_PRIORITY 0x30
 
 int LISTEN_PORT;
 //#define LISTEN_PORT 5000
@@ -66,15 +143,18 @@ int Callback(const char *section, const char *key, const char *value, void *user
 }
 
 typedef struct ftp_session_t ftp_session_t;
+typedef struct ftp_worker_t ftp_worker_t;
 
 #define FTP_DECLARE(x) static void x(ftp_session_t *session, const char *args)
 FTP_DECLARE(ABOR);
 FTP_DECLARE(ALLO);
 FTP_DECLARE(APPE);
+FTP_DECLARE(AVBL);
 FTP_DECLARE(CDUP);
 FTP_DECLARE(CWD);
 FTP_DECLARE(DELE);
 FTP_DECLARE(FEAT);
+FTP_DECLARE(HASH);
 FTP_DECLARE(HELP);
 FTP_DECLARE(LIST);
 FTP_DECLARE(MDTM);
@@ -95,6 +175,7 @@ FTP_DECLARE(RETR);
 FTP_DECLARE(RMD);
 FTP_DECLARE(RNFR);
 FTP_DECLARE(RNTO);
+FTP_DECLARE(SITE);
 FTP_DECLARE(SIZE);
 FTP_DECLARE(STAT);
 FTP_DECLARE(STOR);
@@ -103,6 +184,10 @@ FTP_DECLARE(STRU);
 FTP_DECLARE(SYST);
 FTP_DECLARE(TYPE);
 FTP_DECLARE(USER);
+FTP_DECLARE(XCRC);
+FTP_DECLARE(XMD5);
+FTP_DECLARE(XSHA1);
+FTP_DECLARE(XSHA256);
 
 /*! session state */
 typedef enum
@@ -127,8 +212,11 @@ typedef enum
   SESSION_PORT = BIT(2),   /*!< have peer_addr ready for data transfer command */
   SESSION_RECV = BIT(3),   /*!< data transfer in source mode */
   SESSION_SEND = BIT(4),   /*!< data transfer in sink mode */
-  SESSION_RENAME = BIT(5), /*!< last command was RNFR and buffer contains path */
+  SESSION_RENAME = BIT(5), /*!< last command was RNFR and rnfr contains path */
   SESSION_URGENT = BIT(6), /*!< in telnet urgent mode */
+  SESSION_IO_WAIT = BIT(7), /*!< transfer is waiting for file I/O */
+  SESSION_LEASE_WAIT = BIT(8), /*!< transfer command is waiting for a buffer lease */
+  SESSION_HASH = BIT(9),       /*!< checksum is being computed; later commands wait for it */
 } session_flags_t;
 
 /*! ftp_xfer_dir mode */
@@ -150,11 +238,156 @@ typedef enum
   SESSION_MLST_UNIX_MODE = BIT(4),
 } session_mlst_flags_t;
 
+/*! what getting the next entry of a listing got */
+typedef enum
+{
+  LIST_ENTRY,  /*!< an entry */
+  LIST_END,    /*!< the end of the directory */
+  LIST_WAIT,   /*!< nothing yet; the entry's stat is still running */
+  LIST_FAILED, /*!< an error */
+} list_next_t;
+
+/*! file I/O request state */
+typedef enum
+{
+  IO_IDLE,   /*!< not submitted */
+  IO_QUEUED, /*!< waiting for an I/O thread */
+  IO_BUSY,   /*!< being executed by an I/O thread */
+  IO_DONE,   /*!< result is ready */
+} io_state_t;
+
+/*! file I/O operation */
+typedef enum
+{
+  IO_READ,  /*!< read from the session's file */
+  IO_WRITE, /*!< write to the session's file */
+  IO_LSTAT, /*!< lstat a directory entry */
+  IO_MTIME, /*!< get the modification time of a directory entry */
+  IO_HASH,  /*!< read from the session's file into its checksum */
+} io_op_t;
+
+/*! file I/O request */
+typedef struct ftp_io_request_t ftp_io_request_t;
+struct ftp_io_request_t
+{
+  ftp_session_t *session;  /*!< session whose file to access */
+  io_op_t op;              /*!< operation */
+  char *data;              /*!< buffer to read into or write from, or path */
+  size_t size;             /*!< bytes to transfer */
+  struct stat *st;         /*!< stat to fill in for IO_LSTAT and IO_MTIME */
+  ssize_t result;          /*!< bytes transferred or -1 */
+  int error;               /*!< errno for a failed request */
+  io_state_t state;        /*!< request state; protected by io_lock */
+  ftp_io_request_t *next;  /*!< link in the submission queue */
+};
+
+/*! RETR read-ahead buffer */
+typedef struct
+{
+  char *data;  /*!< buffer memory, xfer_chunk_size bytes */
+  size_t size; /*!< bytes read into the buffer */
+} xfer_chunk_t;
+
+/*! MODE Z stream of a transfer */
+typedef struct
+{
+  z_stream z;                    /*!< zlib state */
+  bool deflate;                  /*!< compressing rather than decompressing */
+  bool eof;                      /*!< the file has no more to compress */
+  bool end;                      /*!< the compressed stream is complete */
+  uint64_t time_us;              /*!< time spent in zlib */
+  size_t pos;                    /*!< bytes of buffer used */
+  size_t len;                    /*!< bytes in buffer */
+  char buffer[XFER_BUFFERSIZE];  /*!< file data for RETR and STOR, compressed
+                                      output for listings */
+} xfer_zstream_t;
+
+/*! MODE B framing of a transfer */
+typedef struct
+{
+  bool on;            /*!< the transfer is in blocks */
+  bool eof;           /*!< the EOF block was sent or received */
+  uint8_t desc;       /*!< descriptor of the block being received */
+  size_t left;        /*!< bytes left in the current block */
+  uint64_t bytes;     /*!< data bytes so far */
+  uint64_t base;      /*!< file offset of the first data byte */
+  uint64_t next_mark; /*!< data bytes at which the next restart marker is sent, or 0 */
+  size_t pos;         /*!< bytes of head sent or received */
+  size_t len;         /*!< bytes in head */
+  char head[40];      /*!< block headers and a restart marker being sent or received */
+} xfer_block_t;
+
+/*! directory entry stat'd ahead of a listing */
+typedef struct
+{
+  ftp_io_request_t io; /*!< stat request */
+  struct stat st;      /*!< entry stat */
+  const char *name;    /*!< entry name, in the paths */
+  bool pending;        /*!< io was submitted and not yet completed */
+} list_prefetch_entry_t;
+
+/*! batch of directory entries stat'd ahead of a listing
+ *
+ *  The worker reads a batch of entries and hands the stats it can't get
+ *  from the directory iterator to the I/O threads, so they run side by side.
+ *  The entries are then formatted in order as their stats come in.
+ */
+typedef struct
+{
+  list_prefetch_entry_t entries[MAX_LIST_PREFETCH]; /*!< entries in the batch */
+  unsigned count;   /*!< entries in the batch */
+  unsigned next;    /*!< next entry to format */
+  size_t reserve;   /*!< room one more entry may need in paths */
+  bool eof;         /*!< the directory has no more entries */
+  bool failed;      /*!< reading the directory failed */
+  char paths[LIST_PREFETCH_PATHS]; /*!< entry names, and paths to stat */
+} list_prefetch_t;
+
+/*! directory a recursive listing is looking for subdirectories in */
+typedef struct
+{
+  DIR *dp;    /*!< open directory */
+  size_t len; /*!< length of its path in the lwd */
+} list_tree_frame_t;
+
+/*! recursive listing
+ *
+ *  Each directory is listed on its own, as for a plain listing, and then
+ *  read again for subdirectories to list next. Only the directories on the
+ *  way down from the top are held open.
+ */
+typedef struct
+{
+  list_tree_frame_t frames[MAX_LIST_DEPTH]; /*!< directories being searched, top first */
+  unsigned depth;  /*!< frames in use */
+  size_t root_len; /*!< length of the top directory's path */
+} list_tree_t;
+
+/*! broken-down UTC time, as listings show it */
+typedef struct
+{
+  time_t time;   /*!< time it was made from */
+  long year;     /*!< year */
+  int month;     /*!< month, 0-11 */
+  int day;       /*!< day of the month, 1-31 */
+  int hour;      /*!< hour, 0-23 */
+  int minute;    /*!< minute, 0-59 */
+  int second;    /*!< second, 0-59 */
+} list_time_t;
+
+/*! pooled path string */
+typedef union path_block path_block_t;
+union path_block
+{
+  path_block_t *next;         /*!< next free block */
+  char data[PATH_BLOCK_SIZE]; /*!< string memory */
+};
+
 /*! ftp session */
 struct ftp_session_t
 {
-  char cwd[4096];                  /*!< current working directory */
-  char lwd[4096];                  /*!< list working directory */
+  char *cwd;                       /*!< current working directory */
+  char *lwd;                       /*!< list working directory; in the lease */
   struct sockaddr_in peer_addr;    /*!< peer address for data connection */
   struct sockaddr_in pasv_addr;    /*!< listen address for PASV connection */
   int cmd_fd;                      /*!< socket for command connection */
@@ -165,24 +398,86 @@ struct ftp_session_t
   xfer_dir_mode_t dir_mode;        /*!< dir transfer mode */
   session_mlst_flags_t mlst_flags; /*!< session MLST flags */
   session_state_t state;           /*!< session state */
+  nfds_t poll_index;               /*!< first pollfd of this session */
+  nfds_t poll_nfds;                /*!< number of pollfds for this session */
+  ftp_worker_t *worker;            /*!< worker that owns this session */
   ftp_session_t *next;             /*!< link to next session */
   ftp_session_t *prev;             /*!< link to prev session */
 
   loop_status_t (*transfer)(ftp_session_t *); /*! data transfer callback */
-  char buffer[XFER_BUFFERSIZE];               /*! persistent data between callbacks */
-  char file_buffer[FILE_BUFFERSIZE];          /*! stdio file buffer */
-  char cmd_buffer[CMD_BUFFERSIZE];            /*! command buffer */
-  size_t bufferpos;                           /*! persistent buffer position between callbacks */
-  size_t buffersize;                          /*! persistent buffer size between callbacks */
+  char *buffer;       /*! worker scratch, or the lease during a listing */
+  char *cmd_buffer;   /*! partial command kept between reads, or NULL */
+  size_t bufferpos;   /*! persistent buffer position between callbacks */
+  size_t buffersize;  /*! persistent buffer size between callbacks */
   size_t cmd_buffersize;
+  char *lease;        /*! transfer buffers leased from the pool */
+  bool lease_queued;  /*! waiting in the lease queue; protected by lease_lock */
+  ftp_session_t *lease_next; /*! next session in the lease queue */
+  void (*lease_handler)(ftp_session_t *, const char *); /*! command to run once leased */
+  char *lease_args;   /*! arguments for lease_handler */
+  char *rnfr;         /*! path from RNFR, for RNTO */
+  char *upload_path;  /*! file being written by STOR/APPE */
   uint64_t filepos;  /*! persistent file position between callbacks */
   uint64_t filesize; /*! persistent file size between callbacks */
-  FILE *fp;          /*! persistent open file pointer between callbacks */
+  int fd;            /*! persistent open file descriptor between callbacks */
+  tar_writer_t *tar; /*! directory being sent as a tar archive, or NULL */
+  tar_reader_t *untar; /*! tar archive being extracted, or NULL */
+  xfer_zstream_t *zstream; /*! MODE Z stream of the transfer, or NULL */
+  bool mode_z;       /*! MODE Z is selected */
+  bool mode_b;       /*! MODE B is selected */
+  xfer_block_t block; /*! MODE B framing of the transfer */
+  int block_fd;      /*! MODE B data connection kept between transfers, or -1 */
+  hash_algo_t hash_algo; /*! algorithm for HASH, chosen with OPTS HASH */
+  hash_ctx_t hash;   /*! checksum being computed */
+  uint64_t hash_end; /*! where the checksummed range ends */
+  char *hash_path;   /*! file named by HASH, for the reply; NULL for XCRC and friends */
   DIR *dp;           /*! persistent open directory pointer between callbacks */
+  dircache_listing_t *listing;   /*! cached listing being sent instead of dp */
+  size_t listing_pos;            /*! next entry in listing */
+  dircache_listing_t *recording; /*! listing of dp being recorded for the cache */
+  list_prefetch_t *prefetch;     /*! entries of dp being stat'd ahead */
+  list_tree_t *tree;             /*! recursive listing, or NULL */
+  dircache_render_t *render_rec; /*! output of this listing being recorded for the cache */
+  const char *render;            /*! cached output being sent instead of formatting */
+  size_t render_pos;             /*! render bytes sent */
+  size_t render_size;            /*! render size */
+  ftp_io_request_t io; /*! file I/O request for the current transfer */
+  xfer_chunk_t chunks[MAX_READ_AHEAD]; /*! transfer buffers; [0] is being sent or received */
+  unsigned chunks_filled; /*! RETR buffers ready to send */
+  unsigned read_depth;    /*! transfer buffers allocated */
+  unsigned underruns;     /*! times RETR had to wait for the disk */
+  unsigned sends;         /*! send() calls made by RETR */
+  bool read_eof;          /*! RETR reached the end of the file */
+  uint64_t xfer_bytes;    /*! bytes sent or received on the data socket */
+  uint64_t xfer_start;    /*! transfer start time in ms */
+  uint64_t connect_deadline; /*! time in ms the data connection is given up */
+  int splice_pipe[2];     /*! STOR pipe from the data socket to the file */
   bool user_ok;
   bool pass_ok;
 };
 
+/*! session worker
+ *
+ *  Each worker runs its own poll loop over the sessions it owns. Worker 0 is
+ *  the main thread, which also accepts new clients and hands them out.
+ */
+struct ftp_worker_t
+{
+  Thread thread;                 /*!< worker thread (unused for worker 0) */
+  Mutex lock;                    /*!< protects pending, load and status */
+  ftp_session_t *pending;        /*!< accepted sessions not yet adopted */
+  size_t load;                   /*!< number of owned and pending sessions */
+  loop_status_t status;          /*!< why the worker thread stopped */
+  ftp_session_t *sessions;       /*!< list of owned sessions */
+  int wake_fd[2];                /*!< loopback pair used to interrupt poll */
+  struct pollfd *pollinfo;       /*!< pollfd set for this worker */
+  nfds_t pollinfo_size;          /*!< allocated size of pollinfo */
+  char *buffer;                  /*!< path scratch for sessions in COMMAND_STATE */
+  char *cmd_buffer;              /*!< command scratch */
+  list_time_t list_time;         /*!< last time a listing entry showed */
+  char response[CMD_BUFFERSIZE]; /*!< response buffer */
+};
+
 /*! ftp command descriptor */
 typedef struct ftp_command
 {
@@ -206,10 +501,12 @@ static ftp_command_t ftp_commands[] =
         FTP_COMMAND(ABOR),
         FTP_COMMAND(ALLO),
         FTP_COMMAND(APPE),
+        FTP_COMMAND(AVBL),
         FTP_COMMAND(CDUP),
         FTP_COMMAND(CWD),
         FTP_COMMAND(DELE),
         FTP_COMMAND(FEAT),
+        FTP_COMMAND(HASH),
         FTP_COMMAND(HELP),
         FTP_COMMAND(LIST),
         FTP_COMMAND(MDTM),
@@ -230,6 +527,7 @@ static ftp_command_t ftp_commands[] =
         FTP_COMMAND(RMD),
         FTP_COMMAND(RNFR),
         FTP_COMMAND(RNTO),
+        FTP_COMMAND(SITE),
         FTP_COMMAND(SIZE),
         FTP_COMMAND(STAT),
         FTP_COMMAND(STOR),
@@ -238,16 +536,31 @@ static ftp_command_t ftp_commands[] =
         FTP_COMMAND(SYST),
         FTP_COMMAND(TYPE),
         FTP_COMMAND(USER),
+        FTP_COMMAND(XCRC),
         FTP_ALIAS(XCUP, CDUP),
         FTP_ALIAS(XCWD, CWD),
+        FTP_COMMAND(XMD5),
         FTP_ALIAS(XMKD, MKD),
         FTP_ALIAS(XPWD, PWD),
         FTP_ALIAS(XRMD, RMD),
+        FTP_COMMAND(XSHA1),
+        FTP_COMMAND(XSHA256),
 };
 /*! number of ftp commands */
 static const size_t num_ftp_commands = sizeof(ftp_commands) / sizeof(ftp_commands[0]);
 
 static void update_free_space(void);
+static void settle_free_space(void);
+static void adjust_free_space(int64_t bytes);
+static void ftp_worker_wake(ftp_worker_t *worker);
+static void ftp_io_cancel(ftp_io_request_t *req);
+static int list_stat_path(io_op_t op, const char *path, struct stat *st);
+static void list_prefetch_free(ftp_session_t *session);
+static bool list_prefetch_ready(ftp_session_t *session);
+static void ftp_session_hash(ftp_session_t *session);
+static void list_tree_free(ftp_session_t *session);
+static void path_free(char *path);
+static char *path_dup(const char *path);
 
 /*! compare ftp command descriptors
  *
@@ -292,10 +605,80 @@ static int listenfd = -1;
 /*! current data port */
 static in_port_t data_port = DATA_PORT;
 #endif
-/*! list of ftp sessions */
-static ftp_session_t *sessions = NULL;
+/*! session workers */
+static ftp_worker_t workers[MAX_WORKERS];
+/*! number of running workers */
+static size_t num_workers = 0;
+/*! next worker to try when several are equally loaded */
+static size_t next_worker = 0;
+/*! whether the worker threads should keep running */
+static volatile bool workers_running = false;
+/*! session slots, carved out of the heap once at startup */
+static ftp_session_t *session_slab = NULL;
+/*! free session slots, linked through next */
+static ftp_session_t *free_sessions = NULL;
+/*! number of session slots */
+static size_t max_sessions = 0;
+/*! protects free_sessions */
+static Mutex session_slab_lock;
+/*! pooled path strings */
+static path_block_t path_blocks[PATH_BLOCKS];
+/*! free path strings */
+static path_block_t *free_paths = NULL;
+/*! protects free_paths */
+static Mutex path_lock;
+/*! transfer buffer leases, carved out of the heap once at startup */
+static char *lease_pool = NULL;
+/*! free leases, linked through their first bytes */
+static char *free_leases = NULL;
+/*! number of leases */
+static size_t num_leases = 0;
+/*! bytes per lease */
+static size_t lease_size = 0;
+/*! sessions waiting for a lease, oldest first */
+static ftp_session_t *lease_queue_head = NULL;
+/*! last session waiting for a lease */
+static ftp_session_t *lease_queue_tail = NULL;
+/*! protects free_leases and the lease queue */
+static Mutex lease_lock;
+/*! serializes free space queries between workers */
+static Mutex free_space_lock;
+/*! estimated free bytes on the SD card; -1 before the first statvfs */
+static int64_t free_space = -1;
+/*! whether free_space was adjusted since the last statvfs */
+static bool free_space_dirty = false;
+/*! time of the last statvfs in ms */
+static uint64_t free_space_time = 0;
+/*! time memory usage was last logged in ms */
+static uint64_t memstat_time = 0;
+/*! file I/O threads */
+static Thread io_threads[MAX_IO_THREADS];
+/*! number of running file I/O threads */
+static size_t num_io_threads = 0;
+/*! whether the file I/O threads should keep running */
+static bool io_running = false;
+/*! protects the submission queue and request states */
+static Mutex io_lock;
+/*! signaled on submission and on completion */
+static CondVar io_cond;
+/*! file I/O submission queue */
+static ftp_io_request_t *io_queue_head = NULL;
+/*! file I/O submission queue tail */
+static ftp_io_request_t *io_queue_tail = NULL;
+/*! maximum RETR read-ahead depth */
+static unsigned read_ahead_max = 4;
+/*! directory entries stat'd ahead of a listing */
+static unsigned list_prefetch_max = 8;
+/*! transfer buffer size */
+static size_t xfer_chunk_size = XFER_BUFFERSIZE;
 /*! socket buffersize */
 static int sock_buffersize = SOCK_BUFFERSIZE;
+/*! data socket send buffersize */
+static int send_buffersize = SOCK_BUFFERSIZE;
+/*! MODE Z compression level; 0 turns MODE Z off */
+static int deflate_level = 6;
+/*! MODE Z compression window in bits */
+static int deflate_window = 12;
 /*! server start time */
 static time_t start_time = 0;
 
@@ -315,6 +698,40 @@ next_data_port(void)
 #endif
 }
 
+/*! get a monotonic timestamp
+ *
+ *  @returns milliseconds
+ */
+static uint64_t
+ftp_time_ms(void)
+{
+#ifdef __SWITCH__
+  return armTicksToNs(armGetSystemTick()) / 1000000;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+/*! get a monotonic time in microseconds
+ *
+ *  @returns microseconds
+ */
+static uint64_t
+ftp_time_us(void)
+{
+#ifdef __SWITCH__
+  return armTicksToNs(armGetSystemTick()) / 1000;
+#else
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
 /*! set a socket to non-blocking
  *
  *  @param[in] fd socket
@@ -367,7 +784,7 @@ ftp_set_socket_options(int fd)
 
   /* increase send buffer size */
   rc = setsockopt(fd, SOL_SOCKET, SO_SNDBUF,
-                  &sock_buffersize, sizeof(sock_buffersize));
+                  &send_buffersize, sizeof(send_buffersize));
   if (rc != 0)
   {
     console_print(RED "setsockopt: SO_SNDBUF %d %s\n" RESET, errno, strerror(errno));
@@ -485,6 +902,223 @@ ftp_session_close_data(ftp_session_t *session)
   session->flags &= ~(SESSION_RECV | SESSION_SEND);
 }
 
+/*! close the MODE B data connection kept between transfers
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_close_block(ftp_session_t *session)
+{
+  if (session->block_fd >= 0)
+    ftp_closesocket(session->block_fd, true);
+  session->block_fd = -1;
+}
+
+/*! allocate a read-ahead transfer buffer
+ *
+ *  @returns xfer_chunk_size bytes, or NULL
+ */
+static char *
+xfer_chunk_alloc(void)
+{
+  char *data = (char *)malloc(xfer_chunk_size);
+
+  if (data != NULL)
+    memstat_add(MEM_XFER, xfer_chunk_size);
+  else
+    memstat_fail(MEM_XFER);
+
+  return data;
+}
+
+/*! release a read-ahead transfer buffer
+ *
+ *  @param[in] data buffer from xfer_chunk_alloc
+ */
+static void
+xfer_chunk_free(char *data)
+{
+  if (data != NULL)
+    memstat_sub(MEM_XFER, xfer_chunk_size);
+  free(data);
+}
+
+/*! allocate memory for zlib
+ *
+ *  @param[in] opaque unused
+ *  @param[in] items  item count
+ *  @param[in] size   item size
+ *
+ *  @returns memory, or Z_NULL
+ */
+static voidpf
+zstream_alloc(voidpf opaque,
+              uInt items,
+              uInt size)
+{
+  size_t *p;
+
+  /* the size goes in front for zstream_release */
+  p = (size_t *)malloc(sizeof(size_t) + (size_t)items * size);
+  if (p == NULL)
+  {
+    memstat_fail(MEM_XFER);
+    return Z_NULL;
+  }
+
+  p[0] = sizeof(size_t) + (size_t)items * size;
+  memstat_add(MEM_XFER, p[0]);
+  return p + 1;
+}
+
+/*! free memory from zstream_alloc
+ *
+ *  @param[in] opaque  unused
+ *  @param[in] address memory
+ */
+static void
+zstream_release(voidpf opaque,
+                voidpf address)
+{
+  size_t *p = (size_t *)address - 1;
+
+  memstat_sub(MEM_XFER, p[0]);
+  free(p);
+}
+
+/*! start the MODE Z stream of a transfer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] deflate whether to compress rather than decompress
+ *
+ *  @returns -1 for failure; without MODE Z there is nothing to do
+ */
+static int
+ftp_session_zstream_start(ftp_session_t *session,
+                          bool deflate)
+{
+  xfer_zstream_t *zs;
+  int rc;
+
+  if (!session->mode_z)
+    return 0;
+
+  zs = (xfer_zstream_t *)malloc(sizeof(*zs));
+  if (zs == NULL)
+  {
+    memstat_fail(MEM_XFER);
+    return -1;
+  }
+  memstat_add(MEM_XFER, sizeof(*zs));
+
+  memset(&zs->z, 0, sizeof(zs->z));
+  zs->z.zalloc = zstream_alloc;
+  zs->z.zfree = zstream_release;
+
+  /* the window caps the compressor at 8 times its size and the
+   * decompressor at its size; an upload made with a bigger window fails
+   */
+  if (deflate)
+    rc = deflateInit2(&zs->z, deflate_level, Z_DEFLATED, deflate_window, deflate_window - 7,
+                      Z_DEFAULT_STRATEGY);
+  else
+    rc = inflateInit2(&zs->z, deflate_window);
+  if (rc != Z_OK)
+  {
+    console_print(RED "%s: %d\n" RESET, deflate ? "deflateInit2" : "inflateInit2", rc);
+    free(zs);
+    memstat_sub(MEM_XFER, sizeof(*zs));
+    return -1;
+  }
+
+  zs->deflate = deflate;
+  zs->eof = false;
+  zs->end = false;
+  zs->time_us = 0;
+  zs->pos = 0;
+  zs->len = 0;
+  session->zstream = zs;
+  return 0;
+}
+
+/*! end the MODE Z stream of a transfer
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_zstream_end(ftp_session_t *session)
+{
+  xfer_zstream_t *zs = session->zstream;
+  uint64_t plain, packed;
+
+  if (zs == NULL)
+    return;
+
+  /* report the ratio and what it cost */
+  plain = zs->deflate ? zs->z.total_in : zs->z.total_out;
+  packed = zs->deflate ? zs->z.total_out : zs->z.total_in;
+  console_print(CYAN "MODE Z %s %" PRIu64 " bytes as %" PRIu64 " (%" PRIu64 "%%) in %" PRIu64 "ms\n" RESET,
+                zs->deflate ? "sent" : "received", plain, packed,
+                plain != 0 ? packed * 100 / plain : 0, zs->time_us / 1000);
+
+  if (zs->deflate)
+    deflateEnd(&zs->z);
+  else
+    inflateEnd(&zs->z);
+
+  free(zs);
+  memstat_sub(MEM_XFER, sizeof(*zs));
+  session->zstream = NULL;
+}
+
+/*! run data through a MODE Z stream
+ *
+ *  @param[in]     zs    stream
+ *  @param[in]     in    input
+ *  @param[in,out] inlen input size; bytes consumed
+ *  @param[in]     out   output
+ *  @param[in,out] outlen output size; bytes produced
+ *  @param[in]     flush Z_FINISH at the end of the data to compress
+ *
+ *  @returns -1 for failure
+ */
+static int
+zstream_run(xfer_zstream_t *zs,
+            const char *in,
+            size_t *inlen,
+            char *out,
+            size_t *outlen,
+            int flush)
+{
+  uint64_t start = ftp_time_us();
+  int rc;
+
+  zs->z.next_in = (Bytef *)in;
+  zs->z.avail_in = *inlen;
+  zs->z.next_out = (Bytef *)out;
+  zs->z.avail_out = *outlen;
+
+  if (zs->deflate)
+    rc = deflate(&zs->z, flush);
+  else
+    rc = inflate(&zs->z, Z_NO_FLUSH);
+
+  *inlen -= zs->z.avail_in;
+  *outlen -= zs->z.avail_out;
+  zs->time_us += ftp_time_us() - start;
+
+  if (rc == Z_STREAM_END)
+    zs->end = true;
+  else if (rc != Z_OK && rc != Z_BUF_ERROR)
+  {
+    console_print(RED "%s: %d %s\n" RESET, zs->deflate ? "deflate" : "inflate", rc,
+                  zs->z.msg != NULL ? zs->z.msg : "");
+    return -1;
+  }
+
+  return 0;
+}
+
 /*! close open file for ftp session
  *
  *  @param[in] session ftp session
@@ -493,16 +1127,97 @@ static void
 ftp_session_close_file(ftp_session_t *session)
 {
   int rc;
+  unsigned i;
+
+  /* an I/O thread may still be using the file */
+  ftp_io_cancel(&session->io);
+  session->flags &= ~(SESSION_IO_WAIT | SESSION_HASH);
+
+  ftp_session_zstream_end(session);
+
+  /* release the transfer buffers; the leased one goes back with the lease */
+  for (i = 0; i < session->read_depth; ++i)
+  {
+    if (session->chunks[i].data != session->lease)
+      xfer_chunk_free(session->chunks[i].data);
+    session->chunks[i].data = NULL;
+  }
+  session->read_depth = 0;
+  session->chunks_filled = 0;
+
+  if (session->splice_pipe[0] != -1)
+  {
+    close(session->splice_pipe[0]);
+    close(session->splice_pipe[1]);
+    session->splice_pipe[0] = session->splice_pipe[1] = -1;
+  }
 
-  if (session->fp != NULL)
+  if (session->fd != -1)
   {
-    rc = fclose(session->fp);
+    rc = close(session->fd);
     if (rc != 0)
-      console_print(RED "fclose: %d %s\n" RESET, errno, strerror(errno));
+      console_print(RED "close: %d %s\n" RESET, errno, strerror(errno));
+
+    /* settle the estimate from an upload */
+    settle_free_space();
+  }
+
+  if (session->untar != NULL)
+  {
+    tar_reader_close(session->untar);
+    session->untar = NULL;
+
+    /* an archive can reach anywhere below where it went */
+    dircache_invalidate_tree(session->upload_path);
+
+    settle_free_space();
   }
 
-  session->fp = NULL;
+  session->fd = -1;
   session->filepos = 0;
+
+  path_free(session->hash_path);
+  session->hash_path = NULL;
+
+  if (session->tar != NULL)
+  {
+    tar_writer_close(session->tar);
+    session->tar = NULL;
+  }
+
+  if (session->upload_path != NULL)
+  {
+    dircache_invalidate(session->upload_path);
+    path_free(session->upload_path);
+    session->upload_path = NULL;
+  }
+}
+
+/*! start sending a directory as a tar archive
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for error
+ */
+static int
+ftp_session_open_tar(ftp_session_t *session)
+{
+  /* the archive is made as it is sent, so it can't resume */
+  if (session->filepos != 0)
+  {
+    console_print(RED "can't resume a directory archive\n" RESET);
+    return -1;
+  }
+
+  session->tar = tar_writer_open(session->buffer);
+  if (session->tar == NULL)
+  {
+    console_print(RED "tar '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+
+  session->filesize = 0;
+  return 0;
 }
 
 /*! open file for reading for ftp session
@@ -518,64 +1233,70 @@ ftp_session_open_file_read(ftp_session_t *session)
   struct stat st;
 
   /* open file in read mode */
-  if(!strcmp("/config/sys-ftpd/logs/ftpd.log", session->buffer)) {
+  if(!strcmp(LOG_PATH, session->buffer)) {
     console_print(RED "Tried to open ftpd.log for reading. That's not allowed!\n");
     return -1;
   }
 
-  session->fp = fopen(session->buffer, "rb");
-  if (session->fp == NULL)
+  session->fd = open(session->buffer, O_RDONLY);
+  if (session->fd < 0)
   {
-    console_print(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-    return -1;
-  }
+    /* a directory is sent as a tar archive */
+    if (stat(session->buffer, &st) == 0 && S_ISDIR(st.st_mode))
+      return ftp_session_open_tar(session);
 
-  /* it's okay if this fails */
-  errno = 0;
-  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
-  if (rc != 0)
-  {
-    console_print(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+    console_print(RED "open '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
   }
 
   /* get the file size */
-  rc = fstat(fileno(session->fp), &st);
+  rc = fstat(session->fd, &st);
   if (rc != 0)
   {
     console_print(RED "fstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
     return -1;
   }
-  session->filesize = st.st_size;
 
-  if (session->filepos != 0)
+  if (S_ISDIR(st.st_mode))
   {
-    rc = fseek(session->fp, session->filepos, SEEK_SET);
-    if (rc != 0)
-    {
-      console_print(RED "fseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-      return -1;
-    }
+    close(session->fd);
+    session->fd = -1;
+    return ftp_session_open_tar(session);
   }
+  session->filesize = st.st_size;
 
+  /* reads start at the REST offset in session->filepos */
   return 0;
 }
 
 /*! read from an open file for ftp session
  *
  *  @param[in] session ftp session
+ *  @param[in] buffer  buffer to read into
+ *  @param[in] size    buffer size
  *
  *  @returns bytes read
  */
 static ssize_t
-ftp_session_read_file(ftp_session_t *session)
+ftp_session_read_file(ftp_session_t *session,
+                      char *buffer,
+                      size_t size)
 {
   ssize_t rc;
 
+  if (session->tar != NULL)
+  {
+    rc = tar_writer_read(session->tar, buffer, size);
+    if (rc > 0)
+      session->filepos += rc;
+    return rc;
+  }
+
   /* read file at current position */
-  rc = fread(session->buffer, 1, sizeof(session->buffer), session->fp);
+  rc = pread(session->fd, buffer, size, session->filepos);
   if (rc < 0)
   {
-    console_print(RED "fread: %d %s\n" RESET, errno, strerror(errno));
+    console_print(RED "pread: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
 
@@ -585,6 +1306,49 @@ ftp_session_read_file(ftp_session_t *session)
   return rc;
 }
 
+/*! read from an open file for ftp session, compressed for MODE Z
+ *
+ *  @param[in] session ftp session
+ *  @param[in] buffer  buffer to read into
+ *  @param[in] size    buffer size
+ *
+ *  @returns bytes read, 0 once the compressed stream is complete
+ */
+static ssize_t
+ftp_session_read_deflate(ftp_session_t *session,
+                         char *buffer,
+                         size_t size)
+{
+  xfer_zstream_t *zs = session->zstream;
+  size_t done = 0, in, out;
+  ssize_t rc;
+
+  while (done < size && !zs->end)
+  {
+    if (zs->pos == zs->len && !zs->eof)
+    {
+      rc = ftp_session_read_file(session, zs->buffer, sizeof(zs->buffer));
+      if (rc < 0)
+        return -1;
+
+      zs->pos = 0;
+      zs->len = rc;
+      zs->eof = rc == 0;
+    }
+
+    in = zs->len - zs->pos;
+    out = size - done;
+    if (zstream_run(zs, zs->buffer + zs->pos, &in, buffer + done, &out,
+                    zs->eof ? Z_FINISH : Z_NO_FLUSH) != 0)
+      return -1;
+
+    zs->pos += in;
+    done += out;
+  }
+
+  return done;
+}
+
 /*! open file for writing for ftp session
  *
  *  @param[in] session ftp session
@@ -598,1707 +1362,4666 @@ static int
 ftp_session_open_file_write(ftp_session_t *session,
                             bool append)
 {
-  int rc;
-  const char *mode = "wb";
+  int rc, flags = O_WRONLY | O_CREAT;
+  int64_t replaced = 0;
+  struct stat st;
 
-  if(!strcmp("/config/sys-ftpd/logs/ftpd.log", session->buffer)) {
+  if(!strcmp(LOG_PATH, session->buffer)) {
     console_print(RED "Tried to open ftpd.log for writing. That's not allowed!");
     return -1;
   }
 
-  if (append)
-    mode = "ab";
-  else if (session->filepos != 0) {
-    mode = "r+b";
+  if (!append && session->filepos == 0) {
+    /* the space of the file being replaced comes back once it is gone */
+    if (stat(session->buffer, &st) == 0 && S_ISREG(st.st_mode))
+      replaced = st.st_size;
+    if (unlink(session->buffer) == 0)
+    {
+      adjust_free_space(-replaced);
+      replaced = 0;
+    }
+    // Opening an exisiting file for writing can apparently result in corruption D:
+
+    /* the unlink fails while the file is open elsewhere; still start from empty */
+    flags |= O_TRUNC;
   }
 
-  if (!append) {
-    unlink(session->buffer);
-    // Opening an exisiting file for writing can apparently result in corruption D:
+  /* the listing showing the file goes stale once the upload is done */
+  path_free(session->upload_path);
+  session->upload_path = path_dup(session->buffer);
+  if (session->upload_path == NULL)
+  {
+    errno = ENOMEM;
+    return -1;
   }
 
   /* open file in write mode */
-  session->fp = fopen(session->buffer, mode);
-  if (session->fp == NULL)
+  session->fd = open(session->buffer, flags, 0644);
+  if (session->fd < 0)
   {
-    console_print(RED "fopen '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    console_print(RED "open '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
     return -1;
   }
 
-  update_free_space();
+  /* or once O_TRUNC has emptied it */
+  if (replaced != 0)
+    adjust_free_space(-replaced);
 
-  /* it's okay if this fails */
-  errno = 0;
-  rc = setvbuf(session->fp, session->file_buffer, _IOFBF, FILE_BUFFERSIZE);
+  dircache_invalidate(session->buffer);
+
+  /* only writes past the current end of the file take more space */
+  rc = fstat(session->fd, &st);
   if (rc != 0)
   {
-    console_print(RED "setvbuf: %d %s\n" RESET, errno, strerror(errno));
+    console_print(RED "fstat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
   }
+  session->filesize = st.st_size;
 
-  /* check if this had REST but not APPE */
-  if (session->filepos != 0 && !append)
-  {
-    /* seek to the REST offset */
-    rc = fseek(session->fp, session->filepos, SEEK_SET);
-    if (rc != 0)
-    {
-      console_print(RED "fseek '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
-      return -1;
-    }
-  }
+  /* write from the current end of the file */
+  if (append)
+    session->filepos = st.st_size;
 
+  /* otherwise writes start at the REST offset in session->filepos */
   return 0;
 }
 
-/*! write to an open file for ftp session
+/*! start extracting a tar archive for ftp session
  *
  *  @param[in] session ftp session
  *
- *  @returns bytes written
+ *  @returns -1 for error
  */
-static ssize_t
-ftp_session_write_file(ftp_session_t *session)
+static int
+ftp_session_open_untar(ftp_session_t *session)
 {
-  ssize_t rc;
+  /* an archive is extracted as it arrives, so it can't resume */
+  if (session->filepos != 0)
+  {
+    console_print(RED "can't resume extracting an archive\n" RESET);
+    return -1;
+  }
 
-  /* write to file at current position */
-  rc = fwrite(session->buffer + session->bufferpos,
-              1, session->buffersize - session->bufferpos,
-              session->fp);
-  if (rc < 0)
+  /* the directory to extract into is made if it isn't there */
+  if (mkdir(session->buffer, 0755) != 0 && errno != EEXIST)
   {
-    console_print(RED "fwrite: %d %s\n" RESET, errno, strerror(errno));
+    console_print(RED "mkdir '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
     return -1;
   }
-  else if (rc == 0)
-    console_print(RED "fwrite: wrote 0 bytes\n" RESET);
 
-  /* adjust file position */
-  session->filepos += rc;
+  /* the listings showing the tree go stale once the upload is done */
+  path_free(session->upload_path);
+  session->upload_path = path_dup(session->buffer);
+  if (session->upload_path == NULL)
+  {
+    errno = ENOMEM;
+    return -1;
+  }
 
-  update_free_space();
-  return rc;
+  session->untar = tar_reader_open(session->buffer);
+  if (session->untar == NULL)
+  {
+    console_print(RED "tar '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+    return -1;
+  }
+
+  return 0;
 }
 
-/*! close current working directory for ftp session
+/*! account for the space a write up to session->filepos took
  *
- *   @param[in] session ftp session
+ *  A resumed upload rewrites what is already there; only bytes past the old
+ *  end of the file are new.
+ *
+ *  @param[in] session ftp session
  */
 static void
-ftp_session_close_cwd(ftp_session_t *session)
+ftp_session_grow_file(ftp_session_t *session)
 {
-  int rc;
+  if (session->filepos <= session->filesize)
+    return;
 
-  /* close open directory pointer */
-  if (session->dp != NULL)
-  {
-    rc = closedir(session->dp);
-    if (rc != 0)
-      console_print(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
-  }
-  session->dp = NULL;
+  adjust_free_space(session->filepos - session->filesize);
+  session->filesize = session->filepos;
 }
 
-/*! open current working directory for ftp session
+/*! write to an open file for ftp session
  *
  *  @param[in] session ftp session
+ *  @param[in] buffer  buffer to write from
+ *  @param[in] size    bytes to write
  *
- *  @return -1 for failure
+ *  @returns bytes written
  */
-static int
-ftp_session_open_cwd(ftp_session_t *session)
+static ssize_t
+ftp_session_write_file(ftp_session_t *session,
+                       const char *buffer,
+                       size_t size)
 {
-  /* open current working directory */
-  session->dp = opendir(session->cwd);
-  if (session->dp == NULL)
+  ssize_t rc;
+
+  if (session->untar != NULL)
   {
-    console_print(RED "opendir '%s': %d %s\n" RESET, session->cwd, errno, strerror(errno));
+    rc = tar_reader_write(session->untar, buffer, size);
+    if (rc < 0)
+      return -1;
+
+    session->filepos += rc;
+    adjust_free_space(tar_reader_used(session->untar));
+    return rc;
+  }
+
+  /* write to file at current position */
+  rc = pwrite(session->fd, buffer, size, session->filepos);
+  if (rc < 0)
+  {
+    console_print(RED "pwrite: %d %s\n" RESET, errno, strerror(errno));
     return -1;
   }
+  else if (rc == 0)
+    console_print(RED "pwrite: wrote 0 bytes\n" RESET);
 
-  return 0;
+  /* adjust file position */
+  session->filepos += rc;
+
+  ftp_session_grow_file(session);
+  return rc;
 }
 
-/*! set state for ftp session
+/*! write to an open file for ftp session, decompressed for MODE Z
  *
  *  @param[in] session ftp session
- *  @param[in] state   state to set
- *  @param[in] flags   flags
+ *  @param[in] buffer  buffer to write from
+ *  @param[in] size    bytes to write
+ *
+ *  @returns size, or -1 for failure
  */
-static void
-ftp_session_set_state(ftp_session_t *session,
-                      session_state_t state,
-                      set_state_flags_t flags)
+static ssize_t
+ftp_session_write_inflate(ftp_session_t *session,
+                          const char *buffer,
+                          size_t size)
 {
-  session->state = state;
-
-  /* close pasv and data sockets */
-  if (flags & CLOSE_PASV)
-    ftp_session_close_pasv(session);
-  if (flags & CLOSE_DATA)
-    ftp_session_close_data(session);
+  xfer_zstream_t *zs = session->zstream;
+  size_t done = 0, in, out, pos;
+  ssize_t rc;
 
-  if (state == COMMAND_STATE)
+  /* go on while there is input or zlib may be holding output back;
+   * anything after the end of the stream is ignored
+   */
+  do
   {
-    /* close file/cwd */
-    ftp_session_close_file(session);
-    ftp_session_close_cwd(session);
-  }
+    if (zs->end)
+      break;
+
+    in = size - done;
+    out = sizeof(zs->buffer);
+    if (zstream_run(zs, buffer + done, &in, zs->buffer, &out, Z_NO_FLUSH) != 0)
+      return -1;
+    done += in;
+
+    for (pos = 0; pos < out; pos += rc)
+    {
+      rc = ftp_session_write_file(session, zs->buffer + pos, out - pos);
+      if (rc <= 0)
+        return -1;
+    }
+  } while (done < size || out == sizeof(zs->buffer));
+
+  return size;
 }
 
-/*! fill directory entry
+/*! read from an open file for ftp session into its checksum
  *
  *  @param[in] session ftp session
- *  @param[in] st      stat data
- *  @param[in] path    path to fill
- *  @param[in] len     path length
- *  @param[in] type    type fact
+ *  @param[in] buffer  buffer to read into
+ *  @param[in] size    buffer size
  *
- *  @returns errno
+ *  @returns bytes read, 0 at the end of the range, or -1 for failure
  */
-static int
-ftp_session_fill_dirent_type(ftp_session_t *session, const struct stat *st,
-                             const char *path, size_t len, const char *type)
+static ssize_t
+ftp_session_read_hash(ftp_session_t *session,
+                      char *buffer,
+                      size_t size)
 {
-  session->buffersize = 0;
-
-  if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
-  {
-    if (session->dir_mode == XFER_DIR_MLST)
-      session->buffer[session->buffersize++] = ' ';
-
-    if (session->mlst_flags & SESSION_MLST_TYPE)
-    {
-      /* type fact */
-      if (!type)
-      {
-        type = "???";
-        if (S_ISREG(st->st_mode))
-          type = "file";
-        else if (S_ISDIR(st->st_mode))
-          type = "dir";
-#if !defined(_3DS) && !defined(__SWITCH__)
-        else if (S_ISLNK(st->st_mode))
-          type = "os.unix=symlink";
-        else if (S_ISCHR(st->st_mode))
-          type = "os.unix=character";
-        else if (S_ISBLK(st->st_mode))
-          type = "os.unix=block";
-        else if (S_ISFIFO(st->st_mode))
-          type = "os.unix=fifo";
-        else if (S_ISSOCK(st->st_mode))
-          type = "os.unix=socket";
-#endif
-      }
-
-      session->buffersize +=
-          sprintf(session->buffer + session->buffersize, "Type=%s;", type);
-    }
+  ssize_t rc;
 
-    if (session->mlst_flags & SESSION_MLST_SIZE)
-    {
-      /* size fact */
-      session->buffersize +=
-          sprintf(session->buffer + session->buffersize, "Size=%lld;",
-                  (signed long long)st->st_size);
-    }
+  if (size > session->hash_end - session->filepos)
+    size = session->hash_end - session->filepos;
+  if (size == 0)
+    return 0;
 
-    if (session->mlst_flags & SESSION_MLST_MODIFY)
-    {
-      /* mtime fact */
-      struct tm *tm = gmtime(&st->st_mtime);
-      if (tm == NULL)
-        return errno;
-
-      session->buffersize +=
-          strftime(session->buffer + session->buffersize,
-                   sizeof(session->buffer) - session->buffersize,
-                   "Modify=%Y%m%d%H%M%S;", tm);
-      if (session->buffersize == 0)
-        return EOVERFLOW;
-    }
+  /* hashing here keeps the worker free and overlaps with other sessions' I/O */
+  rc = ftp_session_read_file(session, buffer, size);
+  if (rc > 0)
+    hash_update(&session->hash, buffer, rc);
 
-    if (session->mlst_flags & SESSION_MLST_PERM)
-    {
-      /* permission fact */
-      strcpy(session->buffer + session->buffersize, "Perm=");
-      session->buffersize += strlen("Perm=");
+  return rc;
+}
 
-      /* append permission */
-      if (S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'a';
+/*! execute a file I/O request
+ *
+ *  @param[in] req request
+ */
+static void
+ftp_io_execute(ftp_io_request_t *req)
+{
+  errno = 0;
+  switch (req->op)
+  {
+  case IO_READ:
+    if (req->session->zstream != NULL)
+      req->result = ftp_session_read_deflate(req->session, req->data, req->size);
+    else
+      req->result = ftp_session_read_file(req->session, req->data, req->size);
+    break;
 
-      /* create permission */
-      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'c';
+  case IO_WRITE:
+    if (req->session->zstream != NULL)
+      req->result = ftp_session_write_inflate(req->session, req->data, req->size);
+    else
+      req->result = ftp_session_write_file(req->session, req->data, req->size);
+    break;
 
-      /* delete permission */
-      session->buffer[session->buffersize++] = 'd';
+  case IO_LSTAT:
+  case IO_MTIME:
+    req->result = list_stat_path(req->op, req->data, req->st);
+    break;
 
-      /* chdir permission */
-      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IXUSR))
-        session->buffer[session->buffersize++] = 'e';
+  case IO_HASH:
+    req->result = ftp_session_read_hash(req->session, req->data, req->size);
+    break;
+  }
+  req->error = errno;
+}
 
-      /* rename permission */
-      session->buffer[session->buffersize++] = 'f';
+/*! file I/O thread entry point
+ *
+ *  @param[in] arg unused
+ */
+static void
+ftp_io_thread(void *arg)
+{
+  ftp_io_request_t *req;
+  ftp_worker_t *worker;
 
-      /* list permission */
-      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IRUSR))
-        session->buffer[session->buffersize++] = 'l';
+  (void)arg;
 
-      /* mkdir permission */
-      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'm';
+  mutexLock(&io_lock);
+  while (true)
+  {
+    /* wait for a request */
+    while (io_running && io_queue_head == NULL)
+      condvarWait(&io_cond, &io_lock);
+    if (!io_running)
+      break;
 
-      /* delete permission */
-      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'p';
+    req = io_queue_head;
+    io_queue_head = req->next;
+    if (io_queue_head == NULL)
+      io_queue_tail = NULL;
+    req->state = IO_BUSY;
+    mutexUnlock(&io_lock);
 
-      /* read permission */
-      if (S_ISREG(st->st_mode) && (st->st_mode & S_IRUSR))
-        session->buffer[session->buffersize++] = 'r';
+    ftp_io_execute(req);
 
-      /* write permission */
-      if (S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
-        session->buffer[session->buffersize++] = 'w';
+    /* the session may be freed as soon as the request is done */
+    worker = req->session->worker;
 
-      session->buffer[session->buffersize++] = ';';
-    }
+    mutexLock(&io_lock);
+    req->state = IO_DONE;
+    condvarWakeAll(&io_cond);
+    mutexUnlock(&io_lock);
 
-    if (session->mlst_flags & SESSION_MLST_UNIX_MODE)
-    {
-      /* unix mode fact */
-      mode_t mask = S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID;
-      session->buffersize +=
-          sprintf(session->buffer + session->buffersize, "UNIX.mode=0%lo;",
-                  (unsigned long)(st->st_mode & mask));
-    }
+    ftp_worker_wake(worker);
 
-    /* make sure space precedes name */
-    if (session->buffer[session->buffersize - 1] != ' ')
-      session->buffer[session->buffersize++] = ' ';
+    mutexLock(&io_lock);
   }
-  else if (session->dir_mode != XFER_DIR_NLST)
-  {
-    if (session->dir_mode == XFER_DIR_STAT)
-      session->buffer[session->buffersize++] = ' ';
-
-    /* perms nlinks owner group size */
-    session->buffersize +=
-        sprintf(session->buffer + session->buffersize,
-                "%c%c%c%c%c%c%c%c%c%c %lu 3DS 3DS %lld ",
-                S_ISREG(st->st_mode) ? '-' : S_ISDIR(st->st_mode) ? 'd' :
-#if !defined(_3DS) && !defined(__SWITCH__)
-                                                                  S_ISLNK(st->st_mode) ? 'l' : S_ISCHR(st->st_mode) ? 'c' : S_ISBLK(st->st_mode) ? 'b' : S_ISFIFO(st->st_mode) ? 'p' : S_ISSOCK(st->st_mode) ? 's' :
-#endif
-                                                                                                                                                                                                             '?',
-                st->st_mode & S_IRUSR ? 'r' : '-',
-                st->st_mode & S_IWUSR ? 'w' : '-',
-                st->st_mode & S_IXUSR ? 'x' : '-',
-                st->st_mode & S_IRGRP ? 'r' : '-',
-                st->st_mode & S_IWGRP ? 'w' : '-',
-                st->st_mode & S_IXGRP ? 'x' : '-',
-                st->st_mode & S_IROTH ? 'r' : '-',
-                st->st_mode & S_IWOTH ? 'w' : '-',
-                st->st_mode & S_IXOTH ? 'x' : '-',
-                (unsigned long)st->st_nlink,
-                (signed long long)st->st_size);
-
-    /* timestamp */
-    struct tm *tm = gmtime(&st->st_mtime);
-    if (tm)
-    {
-      const char *fmt = "%b %e %Y ";
-      if (session->timestamp > st->st_mtime && session->timestamp - st->st_mtime < (60 * 60 * 24 * 365 / 2))
-      {
-        fmt = "%b %e %H:%M ";
-      }
+  mutexUnlock(&io_lock);
+}
 
-      session->buffersize +=
-          strftime(session->buffer + session->buffersize,
-                   sizeof(session->buffer) - session->buffersize,
-                   fmt, tm);
-    }
-    else
-    {
-      session->buffersize +=
-          sprintf(session->buffer + session->buffersize, "Jan 1 1970 ");
-    }
-  }
+/*! submit a file I/O request
+ *
+ *  @param[in] session ftp session
+ *  @param[in] req     idle request
+ *  @param[in] op      operation
+ *  @param[in] data    buffer to read into or write from
+ *  @param[in] size    bytes to transfer
+ *
+ *  @note without I/O threads the request completes before returning
+ */
+static void
+ftp_io_submit(ftp_session_t *session,
+              ftp_io_request_t *req,
+              io_op_t op,
+              char *data,
+              size_t size)
+{
+  req->session = session;
+  req->op = op;
+  req->data = data;
+  req->size = size;
+  req->next = NULL;
 
-  if (session->buffersize + len + 2 > sizeof(session->buffer))
+  if (num_io_threads == 0)
   {
-    /* buffer will overflow */
-    return EOVERFLOW;
+    ftp_io_execute(req);
+    req->state = IO_DONE;
+    return;
   }
 
-  /* copy path */
-  memcpy(session->buffer + session->buffersize, path, len);
-  len = session->buffersize + len;
-  session->buffer[len++] = '\r';
-  session->buffer[len++] = '\n';
-  session->buffersize = len;
-
-  return 0;
+  mutexLock(&io_lock);
+  req->state = IO_QUEUED;
+  if (io_queue_tail != NULL)
+    io_queue_tail->next = req;
+  else
+    io_queue_head = req;
+  io_queue_tail = req;
+  condvarWakeAll(&io_cond);
+  mutexUnlock(&io_lock);
 }
 
-/*! fill directory entry
+/*! get the state of a file I/O request
  *
- *  @param[in] session ftp session
- *  @param[in] st      stat data
- *  @param[in] path    path to fill
- *  @param[in] len     path length
+ *  @param[in] req request
  *
- *  @returns errno
+ *  @returns request state
  */
-static int
-ftp_session_fill_dirent(ftp_session_t *session, const struct stat *st,
-                        const char *path, size_t len)
+static io_state_t
+ftp_io_state(ftp_io_request_t *req)
 {
-  return ftp_session_fill_dirent_type(session, st, path, len, NULL);
+  io_state_t state;
+
+  mutexLock(&io_lock);
+  state = req->state;
+  mutexUnlock(&io_lock);
+
+  return state;
 }
 
-/*! transfer loop
+/*! consume the result of a completed file I/O request
  *
- *  Try to transfer as much data as the sockets will allow without blocking
+ *  @param[in] req done request
  *
- *  @param[in] session ftp session
+ *  @returns bytes transferred or -1 with errno set
  */
-static void
-ftp_session_transfer(ftp_session_t *session)
+static ssize_t
+ftp_io_complete(ftp_io_request_t *req)
 {
-  int rc;
-  do
-  {
-    rc = session->transfer(session);
-  } while (rc == 0);
+  ssize_t rc;
+
+  mutexLock(&io_lock);
+  rc = req->result;
+  errno = req->error;
+  req->state = IO_IDLE;
+  mutexUnlock(&io_lock);
+
+  return rc;
 }
 
-/*! encode a path
- *
- *  @param[in]     path   path to encode
- *  @param[in,out] len    path length
- *  @param[in]     quotes whether to encode quotes
+/*! cancel a file I/O request
  *
- *  @returns encoded path
+ *  @param[in] req request
  *
- *  @note The caller must free the returned path
+ *  @note waits for the request if an I/O thread is already executing it
  */
-static char *
-encode_path(const char *path,
-            size_t *len,
-            bool quotes)
+static void
+ftp_io_cancel(ftp_io_request_t *req)
 {
-  bool enc = false;
-  size_t i, diff = 0;
-  char *out, *p = (char *)path;
-
-  /* check for \n that needs to be encoded */
-  if (memchr(p, '\n', *len) != NULL)
-    enc = true;
+  ftp_io_request_t *p, *prev = NULL;
 
-  if (quotes)
+  mutexLock(&io_lock);
+  if (req->state == IO_QUEUED)
   {
-    /* check for " that needs to be encoded */
-    p = (char *)path;
-    do
-    {
-      p = memchr(p, '"', path + *len - p);
-      if (p != NULL)
-      {
-        ++p;
-        ++diff;
-      }
-    } while (p != NULL);
+    /* unlink from the submission queue */
+    for (p = io_queue_head; p != req; p = p->next)
+      prev = p;
+
+    if (prev != NULL)
+      prev->next = req->next;
+    else
+      io_queue_head = req->next;
+    if (io_queue_tail == req)
+      io_queue_tail = prev;
   }
 
-  /* check if an encode was needed */
-  if (!enc && diff == 0)
-    return strdup(path);
+  while (req->state == IO_BUSY)
+    condvarWait(&io_cond, &io_lock);
 
-  /* allocate space for encoded path */
-  p = out = (char *)malloc(*len + diff);
-  if (out == NULL)
-    return NULL;
+  req->state = IO_IDLE;
+  mutexUnlock(&io_lock);
+}
 
-  /* copy the path while performing encoding */
-  for (i = 0; i < *len; ++i)
-  {
-    if (*path == '\n')
+/*! start the file I/O threads
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_io_init(void)
+{
+  Result rc;
+  size_t count;
+  char str_value[100];
+
+  ini_gets("Workers", "io_threads:", "2", str_value, sizearray(str_value), CONFIGPATH);
+  count = atoi(str_value);
+  if (count > MAX_IO_THREADS)
+    count = MAX_IO_THREADS;
+
+  ini_gets("Transfer", "read_ahead:", "4", str_value, sizearray(str_value), CONFIGPATH);
+  read_ahead_max = atoi(str_value);
+  if (read_ahead_max < 1)
+    read_ahead_max = 1;
+  if (read_ahead_max > MAX_READ_AHEAD)
+    read_ahead_max = MAX_READ_AHEAD;
+
+  ini_gets("Transfer", "list_prefetch:", "8", str_value, sizearray(str_value), CONFIGPATH);
+  list_prefetch_max = atoi(str_value);
+  if (list_prefetch_max > MAX_LIST_PREFETCH)
+    list_prefetch_max = MAX_LIST_PREFETCH;
+
+  ini_gets("Transfer", "chunk_size:", "16384", str_value, sizearray(str_value), CONFIGPATH);
+  xfer_chunk_size = atoi(str_value);
+  if (xfer_chunk_size < MIN_CHUNK_SIZE)
+    xfer_chunk_size = MIN_CHUNK_SIZE;
+  if (xfer_chunk_size > MAX_CHUNK_SIZE)
+    xfer_chunk_size = MAX_CHUNK_SIZE;
+
+  ini_gets("Transfer", "send_buffer:", "16384", str_value, sizearray(str_value), CONFIGPATH);
+  send_buffersize = atoi(str_value);
+  if (send_buffersize < SOCK_BUFFERSIZE)
+    send_buffersize = SOCK_BUFFERSIZE;
+  if (send_buffersize > MAX_SOCK_BUFFERSIZE)
+    send_buffersize = MAX_SOCK_BUFFERSIZE;
+
+  ini_gets("Transfer", "deflate_level:", "6", str_value, sizearray(str_value), CONFIGPATH);
+  deflate_level = atoi(str_value);
+  if (deflate_level < 0)
+    deflate_level = 0;
+  if (deflate_level > 9)
+    deflate_level = 9;
+
+  ini_gets("Transfer", "deflate_window:", "12", str_value, sizearray(str_value), CONFIGPATH);
+  deflate_window = atoi(str_value);
+  if (deflate_window < MIN_DEFLATE_WINDOW)
+    deflate_window = MIN_DEFLATE_WINDOW;
+  if (deflate_window > MAX_DEFLATE_WINDOW)
+    deflate_window = MAX_DEFLATE_WINDOW;
+
+  mutexInit(&io_lock);
+  condvarInit(&io_cond);
+  io_queue_head = io_queue_tail = NULL;
+  io_running = true;
+
+  while (num_io_threads < count)
+  {
+    rc = threadCreate(&io_threads[num_io_threads], ftp_io_thread, NULL, NULL,
+                      IO_STACK_SIZE, IO_PRIORITY, -2);
+    if (R_SUCCEEDED(rc))
     {
-      /* encoded \n is \0 */
-      *p++ = 0;
+      rc = threadStart(&io_threads[num_io_threads]);
+      if (R_FAILED(rc))
+        threadClose(&io_threads[num_io_threads]);
     }
-    else if (quotes && *path == '"')
+
+    if (R_FAILED(rc))
     {
-      /* encoded " is "" */
-      *p++ = '"';
-      *p++ = '"';
+      console_print(RED "failed to start I/O thread: 0x%x\n" RESET, rc);
+      return -1;
     }
-    else
-      *p++ = *path;
-    ++path;
+
+    ++num_io_threads;
   }
 
-  *len += diff;
-  return out;
+  return 0;
 }
 
-/*! decode a path
+/*! stop the file I/O threads
  *
- *  @param[in] session ftp session
- *  @param[in] len     command length
+ *  @note all sessions must be gone
  */
 static void
-decode_path(ftp_session_t *session,
-            size_t len)
+ftp_io_exit(void)
 {
   size_t i;
 
-  /* decode \0 from the first command */
-  for (i = 0; i < len; ++i)
+  mutexLock(&io_lock);
+  io_running = false;
+  condvarWakeAll(&io_cond);
+  mutexUnlock(&io_lock);
+
+  for (i = 0; i < num_io_threads; ++i)
   {
-    /* this is an encoded \n */
-    if (session->cmd_buffer[i] == 0)
-      session->cmd_buffer[i] = '\n';
+    threadWaitForExit(&io_threads[i]);
+    threadClose(&io_threads[i]);
   }
+  num_io_threads = 0;
 }
 
-/*! fill cdir directory entry
- *
- *  @param[in] session ftp session
- *  @param[in] path    path to fill
+/*! close current working directory for ftp session
  *
- *  @returns errno
+ *   @param[in] session ftp session
  */
-static int
-ftp_session_fill_dirent_cdir(ftp_session_t *session, const char *path)
+static void
+ftp_session_close_cwd(ftp_session_t *session)
 {
   int rc;
-  struct stat st;
-  char *buffer;
-  size_t len;
 
-  rc = stat(path, &st);
-  /* double-check this was a directory */
-  if (rc == 0 && !S_ISDIR(st.st_mode))
+  /* close open directory pointer */
+  if (session->dp != NULL)
   {
-    /* shouldn't happen but just in case */
-    rc = -1;
-    errno = ENOTDIR;
+    rc = closedir(session->dp);
+    if (rc != 0)
+      console_print(RED "closedir: %d %s\n" RESET, errno, strerror(errno));
   }
-  if (rc != 0)
-    return errno;
+  session->dp = NULL;
 
-  /* encode \n in path */
-  len = strlen(path);
-  buffer = encode_path(path, &len, false);
-  if (!buffer)
-    return ENOMEM;
+  /* the I/O threads may still be stat'ing entries */
+  list_prefetch_free(session);
 
-  /* fill dirent with listed directory as type=cdir */
-  rc = ftp_session_fill_dirent_type(session, &st, buffer, len, "cdir");
-  free(buffer);
+  /* drop the cached listing, or the unfinished recording */
+  if (session->listing != NULL)
+    dircache_put(session->listing);
+  session->listing = NULL;
 
-  return rc;
+  if (session->render_rec != NULL)
+    dircache_render_discard(session->render_rec);
+  session->render_rec = NULL;
+
+  if (session->recording != NULL)
+    dircache_put(session->recording);
+  session->recording = NULL;
+
+  session->render = NULL;
 }
 
-/*! send a response on the command socket
+/*! open current working directory for ftp session
  *
  *  @param[in] session ftp session
- *  @param[in] buffer  buffer to send
- *  @param[in] len     buffer length
+ *
+ *  @return -1 for failure
  */
-static void
-ftp_send_response_buffer(ftp_session_t *session,
-                         const char *buffer,
-                         size_t len)
+static int
+ftp_session_open_cwd(ftp_session_t *session)
 {
-  ssize_t rc, to_send;
+  /* open current working directory */
+  session->dp = opendir(session->cwd);
+  if (session->dp == NULL)
+  {
+    console_print(RED "opendir '%s': %d %s\n" RESET, session->cwd, errno, strerror(errno));
+    return -1;
+  }
 
-  if (session->cmd_fd < 0)
-    return;
+  return 0;
+}
 
-  /* send response */
-  to_send = len;
-  console_print(GREEN "%s" RESET, buffer);
-  rc = send(session->cmd_fd, buffer, to_send, 0);
-  if (rc < 0)
+/*! carve the transfer buffer leases out of the heap
+ *
+ *  @returns -1 for failure
+ */
+static int
+lease_pool_init(void)
+{
+  size_t i;
+  char str_buffers[100];
+
+  ini_gets("Transfer", "buffers:", "4", str_buffers, sizearray(str_buffers), CONFIGPATH);
+  num_leases = atoi(str_buffers);
+  if (num_leases < 1)
+    num_leases = 1;
+  if (num_leases > MAX_SESSIONS)
+    num_leases = MAX_SESSIONS;
+
+  /* a listing needs a path buffer and the lwd, a file transfer one chunk */
+  lease_size = XFER_BUFFERSIZE + LWD_BUFFERSIZE;
+  if (lease_size < xfer_chunk_size)
+    lease_size = xfer_chunk_size;
+
+  lease_pool = (char *)malloc(num_leases * lease_size);
+  if (lease_pool == NULL)
   {
-    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
+    console_print(RED "failed to allocate %zu transfer buffers\n" RESET, num_leases);
+    memstat_fail(MEM_XFER);
+    return -1;
   }
-  else if (rc != to_send)
+
+  mutexInit(&lease_lock);
+  free_leases = NULL;
+  for (i = 0; i < num_leases; ++i)
   {
-    console_print(RED "only sent %u/%u bytes\n" RESET,
-                  (unsigned int)rc, (unsigned int)to_send);
-    ftp_session_close_cmd(session);
+    *(char **)(lease_pool + i * lease_size) = free_leases;
+    free_leases = lease_pool + i * lease_size;
   }
+  lease_queue_head = lease_queue_tail = NULL;
+
+  return 0;
 }
 
-__attribute__((format(printf, 3, 4)))
-/*! send ftp response to ftp session's peer
+/*! release the transfer buffer leases
  *
- *  @param[in] session ftp session
- *  @param[in] code    response code
- *  @param[in] fmt     format string
- *  @param[in] ...     format arguments
+ *  @note all sessions must be gone
  */
 static void
-ftp_send_response(ftp_session_t *session,
-                  int code,
-                  const char *fmt, ...)
+lease_pool_exit(void)
 {
-  static char buffer[CMD_BUFFERSIZE];
-  ssize_t rc;
-  va_list ap;
+  free(lease_pool);
+  lease_pool = NULL;
+  free_leases = NULL;
+}
 
-  if (session->cmd_fd < 0)
-    return;
+/*! return a lease to the pool, or hand it to the oldest waiting session
+ *
+ *  @param[in] lease lease to return
+ */
+static void
+lease_put(char *lease)
+{
+  ftp_session_t *waiter;
 
-  /* print response code and message to buffer */
-  va_start(ap, fmt);
-  if (code > 0)
-    rc = sprintf(buffer, "%d ", code);
+  mutexLock(&lease_lock);
+  waiter = lease_queue_head;
+  if (waiter != NULL)
+  {
+    lease_queue_head = waiter->lease_next;
+    if (lease_queue_head == NULL)
+      lease_queue_tail = NULL;
+    waiter->lease_queued = false;
+    waiter->lease = lease;
+  }
   else
-    rc = sprintf(buffer, "%d-", -code);
-  rc += vsnprintf(buffer + rc, sizeof(buffer) - rc, fmt, ap);
-  va_end(ap);
-
-  if (rc >= sizeof(buffer))
   {
-    /* couldn't fit message; just send code */
-    console_print(RED "%s: buffersize too small\n" RESET, __func__);
-    if (code > 0)
-      rc = sprintf(buffer, "%d \r\n", code);
-    else
-      rc = sprintf(buffer, "%d-\r\n", -code);
+    *(char **)lease = free_leases;
+    free_leases = lease;
+    memstat_sub(MEM_XFER, lease_size);
   }
+  mutexUnlock(&lease_lock);
 
-  ftp_send_response_buffer(session, buffer, rc);
+  /* the waiter's worker picks the command up again on its next pass */
+  if (waiter != NULL)
+    ftp_worker_wake(waiter->worker);
 }
 
-/*! destroy ftp session
+/*! lease transfer buffers for a data transfer
  *
  *  @param[in] session ftp session
  *
- *  @returns the next session in the list
+ *  @returns whether the session holds a lease; if not, it waits for one
  */
-static ftp_session_t *
-ftp_session_destroy(ftp_session_t *session)
+static bool
+ftp_session_lease(ftp_session_t *session)
 {
-  ftp_session_t *next = session->next;
+  bool leased;
 
-  /* close all sockets/files */
-  ftp_session_close_cmd(session);
-  ftp_session_close_pasv(session);
-  ftp_session_close_data(session);
-  ftp_session_close_file(session);
-  ftp_session_close_cwd(session);
+  mutexLock(&lease_lock);
+  if (session->lease == NULL && free_leases != NULL)
+  {
+    session->lease = free_leases;
+    free_leases = *(char **)free_leases;
+    memstat_add(MEM_XFER, lease_size);
+  }
 
-  /* unlink from sessions list */
-  if (session->next)
-    session->next->prev = session->prev;
-  if (session == sessions)
-    sessions = session->next;
-  else
+  leased = session->lease != NULL;
+  if (!leased && !session->lease_queued)
   {
-    session->prev->next = session->next;
-    if (session == sessions->prev)
-      sessions->prev = session->prev;
+    /* get in line */
+    session->lease_next = NULL;
+    if (lease_queue_tail != NULL)
+      lease_queue_tail->lease_next = session;
+    else
+      lease_queue_head = session;
+    lease_queue_tail = session;
+    session->lease_queued = true;
   }
+  mutexUnlock(&lease_lock);
 
-  /* deallocate */
-  free(session);
+  if (!leased)
+    session->flags |= SESSION_LEASE_WAIT;
 
-  return next;
+  return leased;
 }
 
-/*! allocate new ftp session
+/*! check whether a waiting session was handed a lease
  *
- *  @param[in] listen_fd socket to accept connection from
+ *  @param[in] session ftp session
+ *
+ *  @returns whether the session holds a lease
  */
-static int
-ftp_session_new(int listen_fd)
+static bool
+ftp_session_leased(ftp_session_t *session)
 {
-  ssize_t rc;
-  int new_fd;
-  ftp_session_t *session;
-  struct sockaddr_in addr;
-  socklen_t addrlen = sizeof(addr);
-
-  /* accept connection */
-  new_fd = accept(listen_fd, (struct sockaddr *)&addr, &addrlen);
-  if (new_fd < 0)
-  {
-    console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
-  }
+  bool leased;
 
-  console_print(CYAN "accepted connection from %s:%u\n" RESET,
-                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+  mutexLock(&lease_lock);
+  leased = session->lease != NULL;
+  mutexUnlock(&lease_lock);
 
-  /* allocate a new session */
-  session = (ftp_session_t *)calloc(1, sizeof(ftp_session_t));
-  if (session == NULL)
-  {
-    console_print(RED "failed to allocate session\n" RESET);
-    ftp_closesocket(new_fd, true);
-    return -1;
-  }
+  return leased;
+}
 
-  /* initialize session */
-  strcpy(session->cwd, "/");
-  session->peer_addr.sin_addr.s_addr = INADDR_ANY;
-  session->cmd_fd = new_fd;
-  session->pasv_fd = -1;
-  session->data_fd = -1;
-  session->mlst_flags = SESSION_MLST_TYPE | SESSION_MLST_SIZE | SESSION_MLST_MODIFY | SESSION_MLST_PERM;
-  session->state = COMMAND_STATE;
-  session->user_ok    = false;
-  session->pass_ok    = false;
+/*! give up the session's lease, or its place in the lease queue
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_release(ftp_session_t *session)
+{
+  ftp_session_t *p, *prev = NULL;
+  char *lease;
 
-  /* link to the sessions list */
-  if (sessions == NULL)
-  {
-    sessions = session;
-    session->prev = session;
-  }
-  else
+  mutexLock(&lease_lock);
+  if (session->lease_queued)
   {
-    sessions->prev->next = session;
-    session->prev = sessions->prev;
-    sessions->prev = session;
-  }
+    /* leave the queue */
+    for (p = lease_queue_head; p != session; p = p->lease_next)
+      prev = p;
+    if (prev != NULL)
+      prev->lease_next = session->lease_next;
+    else
+      lease_queue_head = session->lease_next;
+    if (lease_queue_tail == session)
+      lease_queue_tail = prev;
+    session->lease_queued = false;
+  }
+  lease = session->lease;
+  session->lease = NULL;
+  mutexUnlock(&lease_lock);
+
+  if (lease != NULL)
+    lease_put(lease);
+
+  /* paths go back to the worker's scratch buffer */
+  session->buffer = session->worker->buffer;
+  session->lwd = NULL;
+
+  session->flags &= ~SESSION_LEASE_WAIT;
+  path_free(session->lease_args);
+  session->lease_args = NULL;
+  session->lease_handler = NULL;
+}
 
-  /* copy socket address to pasv address */
-  addrlen = sizeof(session->pasv_addr);
-  rc = getsockname(new_fd, (struct sockaddr *)&session->pasv_addr, &addrlen);
-  if (rc != 0)
-  {
+/*! set state for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] state   state to set
+ *  @param[in] flags   flags
+ */
+static void
+ftp_session_set_state(ftp_session_t *session,
+                      session_state_t state,
+                      set_state_flags_t flags)
+{
+  session->state = state;
+
+  /* close pasv and data sockets */
+  if (flags & CLOSE_PASV)
+    ftp_session_close_pasv(session);
+  if (flags & CLOSE_DATA)
+    ftp_session_close_data(session);
+
+  if (state == COMMAND_STATE)
+  {
+    session->block.on = false;
+
+    /* close file/cwd */
+    ftp_session_close_file(session);
+    ftp_session_close_cwd(session);
+    list_tree_free(session);
+
+    /* idle sessions don't hold transfer buffers */
+    ftp_session_release(session);
+  }
+}
+
+/*! month abbreviations for LIST */
+static const char months[12][4] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec",
+};
+
+/*! break down a time for a listing
+ *
+ *  Listings show many entries with the same mtime, so the last one is kept
+ *  and only a different second is converted again. The date is worked out
+ *  from the day count directly, which is cheaper than gmtime_r.
+ *
+ *  @param[in,out] lt last time shown
+ *  @param[in]     t  time to show
+ */
+static void
+list_time_set(list_time_t *lt,
+              time_t t)
+{
+  int64_t days, secs, era, year;
+  unsigned doe, yoe, doy, mp;
+
+  if (t == lt->time && lt->day != 0)
+    return;
+
+  days = (int64_t)t / 86400;
+  secs = (int64_t)t % 86400;
+  if (secs < 0)
+  {
+    secs += 86400;
+    --days;
+  }
+
+  lt->time = t;
+  lt->hour = secs / 3600;
+  lt->minute = secs / 60 % 60;
+  lt->second = secs % 60;
+
+  /* civil date from days since 1970-01-01, in 400-year eras from 0000-03-01 */
+  days += 719468;
+  era = (days >= 0 ? days : days - 146096) / 146097;
+  doe = days - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  year = yoe + era * 400;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp = (5 * doy + 2) / 153;
+
+  lt->day = doy - (153 * mp + 2) / 5 + 1;
+  lt->month = mp < 10 ? mp + 2 : mp - 10;
+  lt->year = year + (lt->month < 2);
+}
+
+/*! write an unsigned decimal
+ *
+ *  @param[in] p     where to write
+ *  @param[in] value value to write
+ *
+ *  @returns end of the written digits
+ */
+static char *
+put_uint(char *p,
+         unsigned long long value)
+{
+  char digits[20];
+  size_t n = 0;
+
+  do
+  {
+    digits[n++] = '0' + value % 10;
+    value /= 10;
+  } while (value != 0);
+
+  while (n > 0)
+    *p++ = digits[--n];
+
+  return p;
+}
+
+/*! write a signed decimal
+ *
+ *  @param[in] p     where to write
+ *  @param[in] value value to write
+ *
+ *  @returns end of the written digits
+ */
+static char *
+put_int(char *p,
+        long long value)
+{
+  if (value >= 0)
+    return put_uint(p, value);
+
+  *p++ = '-';
+  return put_uint(p, -(unsigned long long)value);
+}
+
+/*! write a number as two digits
+ *
+ *  @param[in] p     where to write
+ *  @param[in] value value to write, 0-99
+ *
+ *  @returns end of the written digits
+ */
+static inline char *
+put_2digits(char *p,
+            unsigned value)
+{
+  *p++ = '0' + value / 10;
+  *p++ = '0' + value % 10;
+  return p;
+}
+
+/*! write a string
+ *
+ *  @param[in] p   where to write
+ *  @param[in] str string to write
+ *
+ *  @returns end of the written string
+ */
+static inline char *
+put_str(char *p,
+        const char *str)
+{
+  size_t len = strlen(str);
+
+  memcpy(p, str, len);
+  return p + len;
+}
+
+/*! write a name, encoding \n as \0
+ *
+ *  @param[in] p    where to write
+ *  @param[in] name name to write
+ *  @param[in] len  name length
+ *
+ *  @returns end of the written name
+ */
+static char *
+put_name(char *p,
+         const char *name,
+         size_t len)
+{
+  const char *nl;
+
+  while ((nl = memchr(name, '\n', len)) != NULL)
+  {
+    memcpy(p, name, nl - name);
+    p += nl - name;
+    *p++ = 0;
+    len -= nl - name + 1;
+    name = nl + 1;
+  }
+
+  memcpy(p, name, len);
+  return p + len;
+}
+
+/*! append directory entry to session->buffer
+ *
+ *  Writes straight into the buffer without going through printf or strftime,
+ *  since this runs for every entry of every listing.
+ *
+ *  @param[in] session ftp session
+ *  @param[in] st      stat data
+ *  @param[in] path    path to fill; \n is encoded here
+ *  @param[in] len     path length
+ *  @param[in] type    type fact
+ *
+ *  @returns errno
+ */
+static int
+ftp_session_fill_dirent_type(ftp_session_t *session, const struct stat *st,
+                             const char *path, size_t len, const char *type)
+{
+  list_time_t *lt = &session->worker->list_time;
+  char *p = session->buffer + session->buffersize;
+
+  if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
+  {
+    if (session->dir_mode == XFER_DIR_MLST)
+      *p++ = ' ';
+
+    if (session->mlst_flags & SESSION_MLST_TYPE)
+    {
+      /* type fact */
+      if (!type)
+      {
+        type = "???";
+        if (S_ISREG(st->st_mode))
+          type = "file";
+        else if (S_ISDIR(st->st_mode))
+          type = "dir";
+#if !defined(_3DS) && !defined(__SWITCH__)
+        else if (S_ISLNK(st->st_mode))
+          type = "os.unix=symlink";
+        else if (S_ISCHR(st->st_mode))
+          type = "os.unix=character";
+        else if (S_ISBLK(st->st_mode))
+          type = "os.unix=block";
+        else if (S_ISFIFO(st->st_mode))
+          type = "os.unix=fifo";
+        else if (S_ISSOCK(st->st_mode))
+          type = "os.unix=socket";
+#endif
+      }
+
+      p = put_str(p, "Type=");
+      p = put_str(p, type);
+      *p++ = ';';
+    }
+
+    if (session->mlst_flags & SESSION_MLST_SIZE)
+    {
+      /* size fact */
+      p = put_str(p, "Size=");
+      p = put_int(p, st->st_size);
+      *p++ = ';';
+    }
+
+    if (session->mlst_flags & SESSION_MLST_MODIFY)
+    {
+      /* mtime fact */
+      list_time_set(lt, st->st_mtime);
+      p = put_str(p, "Modify=");
+      p = put_int(p, lt->year);
+      p = put_2digits(p, lt->month + 1);
+      p = put_2digits(p, lt->day);
+      p = put_2digits(p, lt->hour);
+      p = put_2digits(p, lt->minute);
+      p = put_2digits(p, lt->second);
+      *p++ = ';';
+    }
+
+    if (session->mlst_flags & SESSION_MLST_PERM)
+    {
+      /* permission fact */
+      p = put_str(p, "Perm=");
+
+      /* append permission */
+      if (S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
+        *p++ = 'a';
+
+      /* create permission */
+      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
+        *p++ = 'c';
+
+      /* delete permission */
+      *p++ = 'd';
+
+      /* chdir permission */
+      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IXUSR))
+        *p++ = 'e';
+
+      /* rename permission */
+      *p++ = 'f';
+
+      /* list permission */
+      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IRUSR))
+        *p++ = 'l';
+
+      /* mkdir permission */
+      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
+        *p++ = 'm';
+
+      /* delete permission */
+      if (S_ISDIR(st->st_mode) && (st->st_mode & S_IWUSR))
+        *p++ = 'p';
+
+      /* read permission */
+      if (S_ISREG(st->st_mode) && (st->st_mode & S_IRUSR))
+        *p++ = 'r';
+
+      /* write permission */
+      if (S_ISREG(st->st_mode) && (st->st_mode & S_IWUSR))
+        *p++ = 'w';
+
+      *p++ = ';';
+    }
+
+    if (session->mlst_flags & SESSION_MLST_UNIX_MODE)
+    {
+      /* unix mode fact */
+      mode_t mode = st->st_mode & (S_IRWXU | S_IRWXG | S_IRWXO | S_ISVTX | S_ISGID | S_ISUID);
+      char digits[8];
+      size_t n = 0;
+
+      p = put_str(p, "UNIX.mode=0");
+      do
+      {
+        digits[n++] = '0' + (mode & 7);
+        mode >>= 3;
+      } while (mode != 0);
+      while (n > 0)
+        *p++ = digits[--n];
+      *p++ = ';';
+    }
+
+    /* make sure space precedes name */
+    if (p[-1] != ' ')
+      *p++ = ' ';
+  }
+  else if (session->dir_mode != XFER_DIR_NLST)
+  {
+    if (session->dir_mode == XFER_DIR_STAT)
+      *p++ = ' ';
+
+    /* perms nlinks owner group size */
+    *p++ = S_ISREG(st->st_mode) ? '-' : S_ISDIR(st->st_mode) ? 'd' :
+#if !defined(_3DS) && !defined(__SWITCH__)
+           S_ISLNK(st->st_mode) ? 'l' : S_ISCHR(st->st_mode) ? 'c' : S_ISBLK(st->st_mode) ? 'b' :
+           S_ISFIFO(st->st_mode) ? 'p' : S_ISSOCK(st->st_mode) ? 's' :
+#endif
+           '?';
+    *p++ = st->st_mode & S_IRUSR ? 'r' : '-';
+    *p++ = st->st_mode & S_IWUSR ? 'w' : '-';
+    *p++ = st->st_mode & S_IXUSR ? 'x' : '-';
+    *p++ = st->st_mode & S_IRGRP ? 'r' : '-';
+    *p++ = st->st_mode & S_IWGRP ? 'w' : '-';
+    *p++ = st->st_mode & S_IXGRP ? 'x' : '-';
+    *p++ = st->st_mode & S_IROTH ? 'r' : '-';
+    *p++ = st->st_mode & S_IWOTH ? 'w' : '-';
+    *p++ = st->st_mode & S_IXOTH ? 'x' : '-';
+    *p++ = ' ';
+    p = put_uint(p, st->st_nlink);
+    p = put_str(p, " 3DS 3DS ");
+    p = put_int(p, st->st_size);
+    *p++ = ' ';
+
+    /* timestamp, as strftime's "%b %e %H:%M " or "%b %e %Y " */
+    list_time_set(lt, st->st_mtime);
+    p = put_str(p, months[lt->month]);
+    *p++ = ' ';
+    *p++ = lt->day < 10 ? ' ' : '0' + lt->day / 10;
+    *p++ = '0' + lt->day % 10;
+    *p++ = ' ';
+    if (session->timestamp > st->st_mtime && session->timestamp - st->st_mtime < LIST_RECENT)
+    {
+      p = put_2digits(p, lt->hour);
+      *p++ = ':';
+      p = put_2digits(p, lt->minute);
+    }
+    else
+      p = put_int(p, lt->year);
+    *p++ = ' ';
+  }
+
+  session->buffersize = p - session->buffer;
+
+  if (session->buffersize + len + 2 > XFER_BUFFERSIZE)
+  {
+    /* buffer will overflow */
+    return EOVERFLOW;
+  }
+
+  /* copy path */
+  p = put_name(p, path, len);
+  *p++ = '\r';
+  *p++ = '\n';
+  session->buffersize = p - session->buffer;
+
+  return 0;
+}
+
+/*! append directory entry to session->buffer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] st      stat data
+ *  @param[in] path    path to fill
+ *  @param[in] len     path length
+ *
+ *  @returns errno
+ */
+static int
+ftp_session_fill_dirent(ftp_session_t *session, const struct stat *st,
+                        const char *path, size_t len)
+{
+  return ftp_session_fill_dirent_type(session, st, path, len, NULL);
+}
+
+/*! transfer loop
+ *
+ *  Try to transfer as much data as the sockets will allow without blocking
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_transfer(ftp_session_t *session)
+{
+  int rc;
+
+  /* the transfer sets this again if it has to wait for file I/O */
+  session->flags &= ~SESSION_IO_WAIT;
+
+  do
+  {
+    rc = session->transfer(session);
+  } while (rc == 0);
+}
+
+/*! set up the path string pool */
+static void
+path_pool_init(void)
+{
+  size_t i;
+
+  mutexInit(&path_lock);
+  free_paths = NULL;
+  for (i = 0; i < PATH_BLOCKS; ++i)
+  {
+    path_blocks[i].next = free_paths;
+    free_paths = &path_blocks[i];
+  }
+}
+
+/*! allocate a path string
+ *
+ *  @param[in] size bytes needed
+ *
+ *  @returns string memory, or NULL
+ *
+ *  @note The caller must release it with path_free
+ */
+static char *
+path_alloc(size_t size)
+{
+  path_block_t *block = NULL;
+
+  if (size <= PATH_BLOCK_SIZE)
+  {
+    mutexLock(&path_lock);
+    block = free_paths;
+    if (block != NULL)
+      free_paths = block->next;
+    mutexUnlock(&path_lock);
+  }
+
+  /* long paths, or a busy pool */
+  if (block == NULL)
+  {
+    char *path = (char *)malloc(size);
+
+    if (path != NULL)
+      memstat_add(MEM_PATHS, malloc_usable_size(path));
+    else
+      memstat_fail(MEM_PATHS);
+    return path;
+  }
+
+  memstat_add(MEM_PATHS, PATH_BLOCK_SIZE);
+  return block->data;
+}
+
+/*! release a path string
+ *
+ *  @param[in] path path from path_alloc or path_dup
+ */
+static void
+path_free(char *path)
+{
+  path_block_t *block = (path_block_t *)path;
+
+  if (block >= path_blocks && block < path_blocks + PATH_BLOCKS)
+  {
+    mutexLock(&path_lock);
+    block->next = free_paths;
+    free_paths = block;
+    mutexUnlock(&path_lock);
+    memstat_sub(MEM_PATHS, PATH_BLOCK_SIZE);
+  }
+  else if (path != NULL)
+  {
+    memstat_sub(MEM_PATHS, malloc_usable_size(path));
+    free(path);
+  }
+}
+
+/*! duplicate a path string
+ *
+ *  @param[in] path path to copy
+ *
+ *  @returns copy, or NULL
+ *
+ *  @note The caller must release it with path_free
+ */
+static char *
+path_dup(const char *path)
+{
+  size_t size = strlen(path) + 1;
+  char *copy = path_alloc(size);
+
+  if (copy != NULL)
+    memcpy(copy, path, size);
+  return copy;
+}
+
+/*! encode a path
+ *
+ *  @param[in]     path   path to encode
+ *  @param[in,out] len    path length
+ *  @param[in]     quotes whether to encode quotes
+ *
+ *  @returns encoded path
+ *
+ *  @note The caller must release the returned path with path_free
+ */
+static char *
+encode_path(const char *path,
+            size_t *len,
+            bool quotes)
+{
+  bool enc = false;
+  size_t i, diff = 0;
+  char *out, *p = (char *)path;
+
+  /* check for \n that needs to be encoded */
+  if (memchr(p, '\n', *len) != NULL)
+    enc = true;
+
+  if (quotes)
+  {
+    /* check for " that needs to be encoded */
+    p = (char *)path;
+    do
+    {
+      p = memchr(p, '"', path + *len - p);
+      if (p != NULL)
+      {
+        ++p;
+        ++diff;
+      }
+    } while (p != NULL);
+  }
+
+  /* check if an encode was needed */
+  if (!enc && diff == 0)
+    return path_dup(path);
+
+  /* allocate space for encoded path */
+  p = out = path_alloc(*len + diff);
+  if (out == NULL)
+    return NULL;
+
+  /* copy the path while performing encoding */
+  for (i = 0; i < *len; ++i)
+  {
+    if (*path == '\n')
+    {
+      /* encoded \n is \0 */
+      *p++ = 0;
+    }
+    else if (quotes && *path == '"')
+    {
+      /* encoded " is "" */
+      *p++ = '"';
+      *p++ = '"';
+    }
+    else
+      *p++ = *path;
+    ++path;
+  }
+
+  *len += diff;
+  return out;
+}
+
+/*! decode a path
+ *
+ *  @param[in] session ftp session
+ *  @param[in] len     command length
+ */
+static void
+decode_path(ftp_session_t *session,
+            size_t len)
+{
+  size_t i;
+
+  /* decode \0 from the first command */
+  for (i = 0; i < len; ++i)
+  {
+    /* this is an encoded \n */
+    if (session->worker->cmd_buffer[i] == 0)
+      session->worker->cmd_buffer[i] = '\n';
+  }
+}
+
+/*! fill cdir directory entry
+ *
+ *  @param[in] session ftp session
+ *  @param[in] path    path to fill
+ *
+ *  @returns errno
+ */
+static int
+ftp_session_fill_dirent_cdir(ftp_session_t *session, const char *path)
+{
+  int rc;
+  struct stat st;
+  char *buffer;
+  size_t len;
+
+  rc = stat(path, &st);
+  /* double-check this was a directory */
+  if (rc == 0 && !S_ISDIR(st.st_mode))
+  {
+    /* shouldn't happen but just in case */
+    rc = -1;
+    errno = ENOTDIR;
+  }
+  if (rc != 0)
+    return errno;
+
+  /* encode \n in path */
+  len = strlen(path);
+  buffer = encode_path(path, &len, false);
+  if (!buffer)
+    return ENOMEM;
+
+  /* fill dirent with listed directory as type=cdir */
+  rc = ftp_session_fill_dirent_type(session, &st, buffer, len, "cdir");
+  path_free(buffer);
+
+  return rc;
+}
+
+/*! send a response on the command socket
+ *
+ *  @param[in] session ftp session
+ *  @param[in] buffer  buffer to send
+ *  @param[in] len     buffer length
+ */
+static void
+ftp_send_response_buffer(ftp_session_t *session,
+                         const char *buffer,
+                         size_t len)
+{
+  ssize_t rc, to_send;
+
+  if (session->cmd_fd < 0)
+    return;
+
+  /* send response */
+  to_send = len;
+  console_print(GREEN "%s" RESET, buffer);
+  rc = send(session->cmd_fd, buffer, to_send, 0);
+  if (rc < 0)
+  {
+    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_cmd(session);
+  }
+  else if (rc != to_send)
+  {
+    console_print(RED "only sent %u/%u bytes\n" RESET,
+                  (unsigned int)rc, (unsigned int)to_send);
+    ftp_session_close_cmd(session);
+  }
+}
+
+__attribute__((format(printf, 3, 4)))
+/*! send ftp response to ftp session's peer
+ *
+ *  @param[in] session ftp session
+ *  @param[in] code    response code
+ *  @param[in] fmt     format string
+ *  @param[in] ...     format arguments
+ */
+static void
+ftp_send_response(ftp_session_t *session,
+                  int code,
+                  const char *fmt, ...)
+{
+  char *buffer = session->worker->response;
+  size_t size = sizeof(session->worker->response);
+  ssize_t rc;
+  va_list ap;
+
+  if (session->cmd_fd < 0)
+    return;
+
+  /* print response code and message to buffer */
+  va_start(ap, fmt);
+  if (code > 0)
+    rc = sprintf(buffer, "%d ", code);
+  else
+    rc = sprintf(buffer, "%d-", -code);
+  rc += vsnprintf(buffer + rc, size - rc, fmt, ap);
+  va_end(ap);
+
+  if (rc >= size)
+  {
+    /* couldn't fit message; just send code */
+    console_print(RED "%s: buffersize too small\n" RESET, __func__);
+    if (code > 0)
+      rc = sprintf(buffer, "%d \r\n", code);
+    else
+      rc = sprintf(buffer, "%d-\r\n", -code);
+  }
+
+  ftp_send_response_buffer(session, buffer, rc);
+}
+
+/*! carve the session slots out of the heap
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_sessions_init(void)
+{
+  size_t i;
+  char str_sessions[100];
+
+  ini_gets("Workers", "max_sessions:", "6", str_sessions, sizearray(str_sessions), CONFIGPATH);
+  max_sessions = atoi(str_sessions);
+  if (max_sessions < 1)
+    max_sessions = 1;
+  if (max_sessions > MAX_SESSIONS)
+    max_sessions = MAX_SESSIONS;
+
+  /* one allocation up front, so connection churn can't fragment the heap */
+  session_slab = (ftp_session_t *)malloc(max_sessions * sizeof(ftp_session_t));
+  if (session_slab == NULL)
+  {
+    memstat_fail(MEM_SESSIONS);
+    console_print(RED "failed to allocate %zu sessions\n" RESET, max_sessions);
+    return -1;
+  }
+
+  mutexInit(&session_slab_lock);
+  free_sessions = NULL;
+  for (i = 0; i < max_sessions; ++i)
+  {
+    session_slab[i].next = free_sessions;
+    free_sessions = &session_slab[i];
+  }
+
+  path_pool_init();
+
+  return lease_pool_init();
+}
+
+/*! release the session slots */
+static void
+ftp_sessions_exit(void)
+{
+  free(session_slab);
+  session_slab = NULL;
+  free_sessions = NULL;
+
+  lease_pool_exit();
+}
+
+/*! take a session slot
+ *
+ *  @returns zeroed session, or NULL if all slots are in use
+ */
+static ftp_session_t *
+ftp_session_alloc(void)
+{
+  ftp_session_t *session;
+
+  mutexLock(&session_slab_lock);
+  session = free_sessions;
+  if (session != NULL)
+    free_sessions = session->next;
+  mutexUnlock(&session_slab_lock);
+
+  if (session != NULL)
+  {
+    memset(session, 0, sizeof(*session));
+    memstat_add(MEM_SESSIONS, sizeof(*session));
+  }
+  else
+    memstat_fail(MEM_SESSIONS);
+  return session;
+}
+
+/*! return a session slot
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_free(ftp_session_t *session)
+{
+  mutexLock(&session_slab_lock);
+  session->next = free_sessions;
+  free_sessions = session;
+  mutexUnlock(&session_slab_lock);
+
+  memstat_sub(MEM_SESSIONS, sizeof(*session));
+}
+
+/*! destroy ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns the next session in the list
+ */
+static ftp_session_t *
+ftp_session_destroy(ftp_session_t *session)
+{
+  ftp_session_t *next = session->next;
+  ftp_worker_t *worker = session->worker;
+
+  /* close all sockets/files */
+  ftp_session_close_cmd(session);
+  ftp_session_close_pasv(session);
+  ftp_session_close_data(session);
+  ftp_session_close_block(session);
+  ftp_session_close_file(session);
+  ftp_session_close_cwd(session);
+  list_tree_free(session);
+  ftp_session_release(session);
+  path_free(session->cwd);
+  path_free(session->cmd_buffer);
+  path_free(session->rnfr);
+
+  /* unlink from sessions list */
+  if (session->next)
+    session->next->prev = session->prev;
+  if (session == worker->sessions)
+    worker->sessions = session->next;
+  else
+  {
+    session->prev->next = session->next;
+    if (session == worker->sessions->prev)
+      worker->sessions->prev = session->prev;
+  }
+
+  /* deallocate */
+  ftp_session_free(session);
+
+  mutexLock(&worker->lock);
+  --worker->load;
+  mutexUnlock(&worker->lock);
+
+  return next;
+}
+
+/*! wake a worker that may be blocked in poll
+ *
+ *  @param[in] worker worker to wake
+ */
+static void
+ftp_worker_wake(ftp_worker_t *worker)
+{
+  ssize_t rc;
+
+  /* a full socket buffer means a wakeup is already pending */
+  rc = send(worker->wake_fd[1], "", 1, 0);
+  if (rc < 0 && errno != EWOULDBLOCK)
+    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+}
+
+/*! pick the worker for a new session
+ *
+ *  @returns least loaded worker, round-robin between equally loaded ones
+ */
+static ftp_worker_t *
+ftp_worker_select(void)
+{
+  ftp_worker_t *best = NULL;
+  size_t i, best_load = 0;
+
+  for (i = 0; i < num_workers; ++i)
+  {
+    ftp_worker_t *worker = &workers[(next_worker + i) % num_workers];
+    size_t load;
+
+    mutexLock(&worker->lock);
+    load = worker->load;
+    mutexUnlock(&worker->lock);
+
+    if (best == NULL || load < best_load)
+    {
+      best = worker;
+      best_load = load;
+    }
+  }
+
+  next_worker = (best - workers + 1) % num_workers;
+  return best;
+}
+
+/*! allocate new ftp session
+ *
+ *  @param[in] listen_fd socket to accept connection from
+ *
+ *  @note the session is handed to a worker, which greets the peer
+ */
+static int
+ftp_session_new(int listen_fd)
+{
+  static const char busy[] = "421 Too many connections\r\n";
+  int new_fd;
+  ftp_session_t *session;
+  ftp_worker_t *worker;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+
+  /* accept connection */
+  new_fd = accept(listen_fd, (struct sockaddr *)&addr, &addrlen);
+  if (new_fd < 0)
+  {
+    console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  console_print(CYAN "accepted connection from %s:%u\n" RESET,
+                inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+  /* allocate a new session */
+  session = ftp_session_alloc();
+  if (session == NULL)
+  {
+    /* every slot is taken; turn the client away cleanly */
+    console_print(YELLOW "all %zu sessions in use\n" RESET, max_sessions);
+    send(new_fd, busy, sizeof(busy) - 1, 0);
+    ftp_closesocket(new_fd, true);
+    return 0;
+  }
+
+  /* initialize session */
+  session->cwd = path_dup("/");
+  if (session->cwd == NULL)
+  {
+    console_print(RED "failed to allocate cwd\n" RESET);
+    send(new_fd, busy, sizeof(busy) - 1, 0);
+    ftp_closesocket(new_fd, true);
+    ftp_session_free(session);
+    return 0;
+  }
+  session->peer_addr.sin_addr.s_addr = INADDR_ANY;
+  session->cmd_fd = new_fd;
+  session->pasv_fd = -1;
+  session->data_fd = -1;
+  session->block_fd = -1;
+  session->fd = -1;
+  session->splice_pipe[0] = session->splice_pipe[1] = -1;
+  session->mlst_flags = SESSION_MLST_TYPE | SESSION_MLST_SIZE | SESSION_MLST_MODIFY | SESSION_MLST_PERM;
+  session->state = COMMAND_STATE;
+  session->user_ok    = false;
+  session->pass_ok    = false;
+
+  /* hand the session to a worker */
+  worker = ftp_worker_select();
+  session->worker = worker;
+
+  mutexLock(&worker->lock);
+  session->next = worker->pending;
+  worker->pending = session;
+  ++worker->load;
+  mutexUnlock(&worker->lock);
+
+  /* worker 0 is the caller, so it will adopt the session on its next pass */
+  if (worker != &workers[0])
+    ftp_worker_wake(worker);
+
+  return 0;
+}
+
+/*! start a session adopted by a worker
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_start(ftp_session_t *session)
+{
+  ftp_worker_t *worker = session->worker;
+  socklen_t addrlen;
+  int rc;
+
+  /* build paths in the worker's scratch buffer until a transfer leases one */
+  session->buffer = worker->buffer;
+
+  /* link to the sessions list */
+  session->next = NULL;
+  if (worker->sessions == NULL)
+  {
+    worker->sessions = session;
+    session->prev = session;
+  }
+  else
+  {
+    worker->sessions->prev->next = session;
+    session->prev = worker->sessions->prev;
+    worker->sessions->prev = session;
+  }
+
+  /* copy socket address to pasv address */
+  addrlen = sizeof(session->pasv_addr);
+  rc = getsockname(session->cmd_fd, (struct sockaddr *)&session->pasv_addr, &addrlen);
+  if (rc != 0)
+  {
+    console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
+    ftp_send_response(session, 451, "Failed to get connection info\r\n");
+    ftp_session_destroy(session);
+    return;
+  }
+
+  /* send initiator response */
+  ftp_send_response(session, 220, "Hello!\r\n");
+}
+
+/*! adopt the sessions handed to a worker
+ *
+ *  @param[in] worker worker
+ */
+static void
+ftp_worker_adopt(ftp_worker_t *worker)
+{
+  ftp_session_t *session, *pending;
+
+  mutexLock(&worker->lock);
+  pending = worker->pending;
+  worker->pending = NULL;
+  mutexUnlock(&worker->lock);
+
+  while (pending != NULL)
+  {
+    session = pending;
+    pending = pending->next;
+    ftp_session_start(session);
+  }
+}
+
+/*! accept PASV connection for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_session_accept(ftp_session_t *session)
+{
+  int rc, new_fd;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+
+  if (session->flags & SESSION_PASV)
+  {
+    /* clear PASV flag */
+    session->flags &= ~SESSION_PASV;
+
+    /* tell the peer that we're ready to accept the connection */
+    ftp_send_response(session, 150, "Ready\r\n");
+
+    /* accept connection from peer */
+    new_fd = accept(session->pasv_fd, (struct sockaddr *)&addr, &addrlen);
+    if (new_fd < 0)
+    {
+      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      return -1;
+    }
+
+    /* set the socket to non-blocking */
+    rc = ftp_set_socket_nonblocking(new_fd);
+    if (rc != 0)
+    {
+      ftp_closesocket(new_fd, true);
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      return -1;
+    }
+
+    console_print(CYAN "accepted connection from %s:%u\n" RESET,
+                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
+
+    /* we are ready to transfer data */
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+    session->data_fd = new_fd;
+
+    return 0;
+  }
+  else
+  {
+    /* peer didn't send PASV command */
+    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+    return -1;
+  }
+}
+
+/*! connect to peer for ftp session
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_session_connect(ftp_session_t *session)
+{
+  int rc;
+
+  /* clear PORT flag */
+  session->flags &= ~SESSION_PORT;
+
+  /* create a new socket */
+  session->data_fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (session->data_fd < 0)
+  {
+    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  /* set socket options */
+  rc = ftp_set_socket_options(session->data_fd);
+  if (rc != 0)
+  {
+    ftp_closesocket(session->data_fd, false);
+    session->data_fd = -1;
+    return -1;
+  }
+
+  /* set socket to non-blocking */
+  rc = ftp_set_socket_nonblocking(session->data_fd);
+  if (rc != 0)
+    return -1;
+
+  /* connect to peer */
+  rc = connect(session->data_fd, (struct sockaddr *)&session->peer_addr,
+               sizeof(session->peer_addr));
+  if (rc != 0)
+  {
+    if (errno != EINPROGRESS)
+    {
+      console_print(RED "connect: %d %s\n" RESET, errno, strerror(errno));
+      ftp_closesocket(session->data_fd, false);
+      session->data_fd = -1;
+      return -1;
+    }
+  }
+  else
+  {
+    console_print(CYAN "connected to %s:%u\n" RESET,
+                  inet_ntoa(session->peer_addr.sin_addr),
+                  ntohs(session->peer_addr.sin_port));
+
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+    ftp_send_response(session, 150, "Ready\r\n");
+  }
+
+  return 0;
+}
+
+static bool
+ftp_auth_oncommand(ftp_session_t *session, const char *command) 
+{
+  if(command && (strcasecmp("USER", command) == 0 || strcasecmp("PASS", command) == 0 || strcasecmp("QUIT", command) == 0)) 
+  {
+    return true;
+  }
+  
+  return session->user_ok && session->pass_ok;
+}
+
+static void
+ftp_auth_check(ftp_session_t *session, const char *user, const char *pass) 
+{
+	char str_user[100];
+  ini_gets("User", "user:", "dummy", str_user, sizearray(str_user), CONFIGPATH); 
+  char str_pass[100];
+  ini_gets("Password", "password:", "dummy", str_pass, sizearray(str_pass), CONFIGPATH); 
+  char str_anony[100];
+  ini_gets("Anonymous", "anonymous:", "dummy", str_anony, sizearray(str_anony), CONFIGPATH); 
+  
+  if (strcmp("1", str_anony) == 0)
+  {      
+        session->user_ok = false;
+        session->pass_ok = false;
+        ftp_send_response(session, 230, "OK, Huh Anonymous is that you ???\r\n");
+		return;
+  }
+  
+  if(user) 
+  {
+    if(strcmp(str_user, user) == 0) 
+	{
+      session->user_ok = true;
+    } 
+	else 
+	{
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 430, "Unknown user, Please check /config/sys-ftpd/config.ini\r\n");
+      ftp_session_close_cmd(session);
+      return;
+    }
+  }
+  
+  if(pass) 
+  {
+    if(strcmp(str_pass, pass) == 0) 
+	{
+      session->pass_ok = true;
+    } 
+	else 
+	{
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 430, "Wrong password, Please check /config/sys-ftpd/config.ini\r\n");
+      ftp_session_close_cmd(session);
+      return;
+    }
+  }
+  
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+  if(ftp_auth_oncommand(session, NULL)) 
+  {
+    ftp_send_response(session, 230, "OK\r\n");
+	return;
+  } 
+  else 
+  {
+    ftp_send_response(session, 331, "next step required\r\n");
+	return;
+  }
+}
+
+/*! check whether a buffered command may run while an earlier one waits
+ *
+ *  @param[in] buffer command buffer
+ *  @param[in] size   bytes in the buffer
+ *
+ *  @returns whether the first command is ABOR or QUIT
+ */
+static bool
+ftp_command_cancels(const char *buffer,
+                    size_t size)
+{
+  if (size < 5)
+    return false;
+
+  if (strncasecmp(buffer, "ABOR", 4) != 0 && strncasecmp(buffer, "QUIT", 4) != 0)
+    return false;
+
+  return buffer[4] == '\r' || buffer[4] == '\n' || buffer[4] == ' ';
+}
+
+/*! execute the complete commands in the worker's command buffer
+ *
+ *  @param[in] session ftp session
+ *
+ *  @note a partial command is left at the start of the buffer
+ */
+static void
+ftp_session_run_commands(ftp_session_t *session)
+{
+  char *cmd_buffer = session->worker->cmd_buffer;
+  char *buffer, *args, *next = NULL;
+  size_t i, len;
+  ftp_command_t key, *command;
+
+  /* loop through commands */
+  while (true)
+  {
+    /* a transfer command is waiting for a lease, or a checksum for its I/O;
+     * the rest has to wait too, except ABOR and QUIT, which cancel it */
+    if ((session->flags & (SESSION_LEASE_WAIT | SESSION_HASH)) &&
+        !ftp_command_cancels(cmd_buffer, session->cmd_buffersize))
+      return;
+
+    /* must have at least enough data for the delimiter */
+    if (session->cmd_buffersize < 1)
+      return;
+
+    /* look for \r\n or \n delimiter */
+    for (i = 0; i < session->cmd_buffersize; ++i)
+    {
+      if (i < session->cmd_buffersize - 1 && cmd_buffer[i] == '\r' && cmd_buffer[i + 1] == '\n')
+      {
+        /* we found a \r\n delimiter */
+        cmd_buffer[i] = 0;
+        next = &cmd_buffer[i + 2];
+        break;
+      }
+      else if (cmd_buffer[i] == '\n')
+      {
+        /* we found a \n delimiter */
+        cmd_buffer[i] = 0;
+        next = &cmd_buffer[i + 1];
+        break;
+      }
+    }
+
+    /* check if a delimiter was found */
+    if (i == session->cmd_buffersize)
+      return;
+
+    /* decode the command */
+    decode_path(session, i);
+
+    /* split command from arguments */
+    args = buffer = cmd_buffer;
+    while (*args && !isspace((int)*args))
+      ++args;
+    if (*args)
+      *args++ = 0;
+
+    /* look up the command */
+    key.name = buffer;
+    command = bsearch(&key, ftp_commands,
+                      num_ftp_commands, sizeof(ftp_command_t),
+                      ftp_command_cmp);
+
+    /* update command timestamp */
+    session->timestamp = time(NULL);
+
+    /* execute the command */
+    if (command == NULL)
+    {
+      /* send header */
+      ftp_send_response(session, 502, "Invalid command \"");
+
+      /* send command */
+      len = strlen(buffer);
+      buffer = encode_path(buffer, &len, false);
+      if (buffer != NULL)
+        ftp_send_response_buffer(session, buffer, len);
+      else
+        ftp_send_response_buffer(session, key.name, strlen(key.name));
+      path_free(buffer);
+
+      /* send args (if any) */
+      if (*args != 0)
+      {
+        ftp_send_response_buffer(session, " ", 1);
+
+        len = strlen(args);
+        buffer = encode_path(args, &len, false);
+        if (buffer != NULL)
+          ftp_send_response_buffer(session, buffer, len);
+        else
+          ftp_send_response_buffer(session, args, strlen(args));
+        path_free(buffer);
+      }
+
+      /* send footer */
+      ftp_send_response_buffer(session, "\"\r\n", 3);
+    }
+    else if (session->state != COMMAND_STATE)
+    {
+      /* only some commands are available during data transfer */
+      if (strcasecmp(command->name, "ABOR") != 0 && strcasecmp(command->name, "STAT") != 0 && strcasecmp(command->name, "QUIT") != 0)
+      {
+        ftp_send_response(session, 503, "Invalid command during transfer\r\n");
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_session_close_cmd(session);
+      }
+      else
+        command->handler(session, args);
+    }
+    else
+    {
+      /* clear RENAME flag for all commands except RNTO */
+      if (strcasecmp(command->name, "RNTO") != 0 && (session->flags & SESSION_RENAME))
+      {
+        session->flags &= ~SESSION_RENAME;
+        path_free(session->rnfr);
+        session->rnfr = NULL;
+      }
+
+      command->handler(session, args);
+
+      /* remember the command so it can run again once a lease frees up */
+      if (session->flags & SESSION_LEASE_WAIT)
+      {
+        session->lease_handler = command->handler;
+        session->lease_args = path_dup(args);
+        if (session->lease_args == NULL)
+        {
+          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+          ftp_send_response(session, 451, "Insufficient memory\r\n");
+        }
+      }
+    }
+
+    /* remove executed command from the command buffer */
+    len = cmd_buffer + session->cmd_buffersize - next;
+    if (len > 0)
+      memmove(cmd_buffer, next, len);
+    session->cmd_buffersize = len;
+  }
+}
+
+/*! move a partial command from the session to the worker's command buffer
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_load_commands(ftp_session_t *session)
+{
+  if (session->cmd_buffer == NULL)
+    return;
+
+  memcpy(session->worker->cmd_buffer, session->cmd_buffer, session->cmd_buffersize);
+  path_free(session->cmd_buffer);
+  session->cmd_buffer = NULL;
+}
+
+/*! keep what is left in the worker's command buffer until the next read
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_store_commands(ftp_session_t *session)
+{
+  if (session->cmd_buffersize == 0 || session->cmd_fd < 0)
+  {
+    session->cmd_buffersize = 0;
+    return;
+  }
+
+  session->cmd_buffer = path_alloc(session->cmd_buffersize);
+  if (session->cmd_buffer == NULL)
+  {
+    console_print(RED "failed to keep partial command\n" RESET);
+    ftp_session_close_cmd(session);
+    session->cmd_buffersize = 0;
+    return;
+  }
+
+  memcpy(session->cmd_buffer, session->worker->cmd_buffer, session->cmd_buffersize);
+}
+
+/*! read command for ftp session
+ *
+ *  @param[in] session ftp session
+ *  @param[in] events  poll events
+ */
+static void
+ftp_session_read_command(ftp_session_t *session,
+                         int events)
+{
+  char *cmd_buffer = session->worker->cmd_buffer;
+  char *buffer;
+  size_t i, len;
+  int atmark;
+  ssize_t rc;
+
+  ftp_session_load_commands(session);
+
+  /* check out-of-band data */
+  if (events & POLLPRI)
+  {
+    session->flags |= SESSION_URGENT;
+
+    /* check if we are at the urgent marker */
+    atmark = sockatmark(session->cmd_fd);
+    if (atmark < 0)
+    {
+      console_print(RED "sockatmark: %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_close_cmd(session);
+      ftp_session_store_commands(session);
+      return;
+    }
+
+    if (!atmark)
+    {
+      /* discard in-band data */
+      rc = recv(session->cmd_fd, cmd_buffer, CMD_BUFFERSIZE, 0);
+      if (rc < 0 && errno != EWOULDBLOCK)
+      {
+        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+        ftp_session_close_cmd(session);
+      }
+
+      session->cmd_buffersize = 0;
+      return;
+    }
+
+    /* retrieve the urgent data */
+    rc = recv(session->cmd_fd, cmd_buffer, CMD_BUFFERSIZE, MSG_OOB);
+    if (rc < 0)
+    {
+      /* EWOULDBLOCK means out-of-band data is on the way */
+      if (errno == EWOULDBLOCK)
+      {
+        session->cmd_buffersize = 0;
+        return;
+      }
+
+      /* error retrieving out-of-band data */
+      console_print(RED "recv (oob): %d %s\n" RESET, errno, strerror(errno));
+      ftp_session_close_cmd(session);
+      session->cmd_buffersize = 0;
+      return;
+    }
+
+    /* reset the command buffer */
+    session->cmd_buffersize = 0;
+    return;
+  }
+
+  /* prepare to receive data */
+  buffer = cmd_buffer + session->cmd_buffersize;
+  len = CMD_BUFFERSIZE - session->cmd_buffersize;
+  if (len == 0)
+  {
+    /* error retrieving command */
+    console_print(RED "Exceeded command buffer size\n" RESET);
+    ftp_session_close_cmd(session);
+    ftp_session_store_commands(session);
+    return;
+  }
+
+  /* retrieve command data */
+  rc = recv(session->cmd_fd, buffer, len, 0);
+  if (rc < 0)
+  {
+    /* error retrieving command */
+    console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_close_cmd(session);
+    ftp_session_store_commands(session);
+    return;
+  }
+  if (rc == 0)
+  {
+    /* peer closed connection */
+    debug_print("peer closed connection\n");
+    ftp_session_close_cmd(session);
+    ftp_session_store_commands(session);
+    return;
+  }
+
+  session->cmd_buffersize += rc;
+  len = CMD_BUFFERSIZE - session->cmd_buffersize;
+
+  if (session->flags & SESSION_URGENT)
+  {
+    /* look for telnet data mark */
+    for (i = 0; i < session->cmd_buffersize; ++i)
+    {
+      if ((unsigned char)cmd_buffer[i] == 0xF2)
+      {
+        /* ignore all data that precedes the data mark */
+        if (i < session->cmd_buffersize - 1)
+          memmove(cmd_buffer, cmd_buffer + i + 1, len - i - 1);
+        session->cmd_buffersize -= i + 1;
+        session->flags &= ~SESSION_URGENT;
+        break;
+      }
+    }
+  }
+
+  ftp_session_run_commands(session);
+  ftp_session_store_commands(session);
+}
+
+/*! run a transfer command that was waiting for a lease
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_resume(ftp_session_t *session)
+{
+  void (*handler)(ftp_session_t *, const char *) = session->lease_handler;
+  char *args = session->lease_args;
+
+  session->flags &= ~SESSION_LEASE_WAIT;
+  session->lease_handler = NULL;
+  session->lease_args = NULL;
+
+  handler(session, args);
+  if (session->flags & SESSION_LEASE_WAIT)
+  {
+    /* somebody else got the lease first */
+    session->lease_handler = handler;
+    session->lease_args = args;
+    return;
+  }
+  path_free(args);
+
+  /* then whatever the client sent in the meantime */
+  ftp_session_load_commands(session);
+  ftp_session_run_commands(session);
+  ftp_session_store_commands(session);
+}
+
+/*! set up pollfds for ftp session
+ *
+ *  @param[in]  session  ftp session
+ *  @param[out] pollinfo pollfds to fill (room for two)
+ *
+ *  @returns number of pollfds filled
+ */
+static nfds_t
+ftp_session_poll_setup(ftp_session_t *session,
+                       struct pollfd *pollinfo)
+{
+  nfds_t nfds = 1;
+
+  /* the first pollfd is the command socket */
+  pollinfo[0].fd = session->cmd_fd;
+  pollinfo[0].events = POLLIN | POLLPRI;
+  pollinfo[0].revents = 0;
+
+  switch (session->state)
+  {
+  case COMMAND_STATE:
+    /* we are waiting to read a command */
+    break;
+
+  case DATA_CONNECT_STATE:
+    if (session->flags & SESSION_PASV)
+    {
+      /* we are waiting for a PASV connection */
+      pollinfo[1].fd = session->pasv_fd;
+      pollinfo[1].events = POLLIN;
+    }
+    else
+    {
+      /* we are waiting to complete a PORT connection */
+      pollinfo[1].fd = session->data_fd;
+      pollinfo[1].events = POLLOUT;
+    }
+    pollinfo[1].revents = 0;
+    nfds = 2;
+    break;
+
+  case DATA_TRANSFER_STATE:
+    /* the socket has to wait until the file I/O is done */
+    if (session->flags & SESSION_IO_WAIT)
+      break;
+
+    /* we need to transfer data */
+    pollinfo[1].fd = session->data_fd;
+    if (session->flags & SESSION_RECV)
+      pollinfo[1].events = POLLIN;
+    else
+      pollinfo[1].events = POLLOUT;
+    pollinfo[1].revents = 0;
+    nfds = 2;
+    break;
+  }
+
+  return nfds;
+}
+
+/*! handle poll events for ftp session
+ *
+ *  @param[in] session  ftp session
+ *  @param[in] pollinfo pollfds filled by ftp_session_poll_setup
+ *
+ *  @returns next session
+ */
+static ftp_session_t *
+ftp_session_poll(ftp_session_t *session,
+                 struct pollfd *pollinfo)
+{
+  nfds_t nfds = session->poll_nfds;
+
+  /* session was created after the pollfds were set up */
+  if (nfds == 0)
+    return session->next;
+
+  /* check the command socket */
+  if (pollinfo[0].revents != 0)
+  {
+    /* handle command */
+    if (pollinfo[0].revents & POLL_UNKNOWN)
+      console_print(YELLOW "cmd_fd: revents=0x%08X\n" RESET, pollinfo[0].revents);
+
+    /* we need to read a new command */
+    if (pollinfo[0].revents & (POLLERR | POLLHUP))
+    {
+      debug_print("cmd revents=0x%x\n", pollinfo[0].revents);
+      ftp_session_close_cmd(session);
+    }
+    else if (pollinfo[0].revents & (POLLIN | POLLPRI))
+      ftp_session_read_command(session, pollinfo[0].revents);
+  }
+
+  /* check the data/pasv socket */
+  if (nfds > 1 && pollinfo[1].revents != 0)
+  {
+    switch (session->state)
+    {
+    case COMMAND_STATE:
+      /* the command handler already finished with this socket */
+      break;
+
+    case DATA_CONNECT_STATE:
+      if (pollinfo[1].revents & POLL_UNKNOWN)
+        console_print(YELLOW "pasv_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+
+      /* we need to accept the PASV connection */
+      if (pollinfo[1].revents & (POLLERR | POLLHUP))
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 426, "Data connection failed\r\n");
+      }
+      else if (pollinfo[1].revents & POLLIN)
+      {
+        if (ftp_session_accept(session) != 0)
+          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      }
+      else if (pollinfo[1].revents & POLLOUT)
+      {
+
+        console_print(CYAN "connected to %s:%u\n" RESET,
+                      inet_ntoa(session->peer_addr.sin_addr),
+                      ntohs(session->peer_addr.sin_port));
+
+        ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+        ftp_send_response(session, 150, "Ready\r\n");
+      }
+      break;
+
+    case DATA_TRANSFER_STATE:
+      if (pollinfo[1].revents & POLL_UNKNOWN)
+        console_print(YELLOW "data_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+
+      /* we need to transfer data */
+      if (pollinfo[1].revents & (POLLERR | POLLHUP))
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 426, "Data connection failed\r\n");
+      }
+      else if (pollinfo[1].revents & (POLLIN | POLLOUT))
+        ftp_session_transfer(session);
+      break;
+    }
+  }
+
+  /* give up on a client that never makes the data connection, which would
+   * otherwise keep its lease forever */
+  if (session->state == DATA_CONNECT_STATE && ftp_time_ms() >= session->connect_deadline)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 425, "can't open data connection\r\n");
+  }
+
+  /* run a command that was handed a lease */
+  if ((session->flags & SESSION_LEASE_WAIT) && session->cmd_fd >= 0 && ftp_session_leased(session))
+    ftp_session_resume(session);
+
+  /* continue a checksum whose file I/O completed, then the commands behind it */
+  if ((session->flags & SESSION_HASH) && ftp_io_state(&session->io) == IO_DONE)
+  {
+    ftp_session_hash(session);
+    if (!(session->flags & SESSION_HASH))
+    {
+      ftp_session_load_commands(session);
+      ftp_session_run_commands(session);
+      ftp_session_store_commands(session);
+    }
+  }
+
+  /* continue a transfer whose file I/O completed */
+  if (session->state == DATA_TRANSFER_STATE &&
+      (ftp_io_state(&session->io) == IO_DONE || list_prefetch_ready(session)))
+    ftp_session_transfer(session);
+
+  /* still connected to peer; return next session */
+  if (session->cmd_fd >= 0)
+    return session->next;
+
+  /* disconnected from peer; destroy it and return next session */
+  debug_print("disconnected from peer\n");
+  flash_led_disconnect();
+  return ftp_session_destroy(session);
+}
+
+/* Refresh the free space estimate with statvfs and show it in the status bar;
+ * free_space_lock must be held */
+static void
+update_free_space_locked(void)
+{
+#if defined(_3DS) || defined(__SWITCH__)
+#define KiB (1024.0)
+#define MiB (1024.0 * KiB)
+#define GiB (1024.0 * MiB)
+  char buffer[16];
+  double bytes_free;
+  int len;
+  const char *path = "sdmc:/";
+#else
+  const char *path = "/";
+#endif
+  struct statvfs st;
+  int rc;
+
+  rc = statvfs(path, &st);
+  free_space_time = ftp_time_ms();
+  if (rc != 0)
+    console_print(RED "statvfs: %d %s\n" RESET, errno, strerror(errno));
+  else
+  {
+    free_space = (int64_t)st.f_bsize * st.f_bfree;
+    free_space_dirty = false;
+
+#if defined(_3DS) || defined(__SWITCH__)
+    bytes_free = free_space;
+
+    if (bytes_free < 1000.0)
+      len = snprintf(buffer, sizeof(buffer), "%.0lfB", bytes_free);
+    else if (bytes_free < 10.0 * KiB)
+      len = snprintf(buffer, sizeof(buffer), "%.2lfKiB", floor((bytes_free * 100.0) / KiB) / 100.0);
+    else if (bytes_free < 100.0 * KiB)
+      len = snprintf(buffer, sizeof(buffer), "%.1lfKiB", floor((bytes_free * 10.0) / KiB) / 10.0);
+    else if (bytes_free < 1000.0 * KiB)
+      len = snprintf(buffer, sizeof(buffer), "%.0lfKiB", floor(bytes_free / KiB));
+    else if (bytes_free < 10.0 * MiB)
+      len = snprintf(buffer, sizeof(buffer), "%.2lfMiB", floor((bytes_free * 100.0) / MiB) / 100.0);
+    else if (bytes_free < 100.0 * MiB)
+      len = snprintf(buffer, sizeof(buffer), "%.1lfMiB", floor((bytes_free * 10.0) / MiB) / 10.0);
+    else if (bytes_free < 1000.0 * MiB)
+      len = snprintf(buffer, sizeof(buffer), "%.0lfMiB", floor(bytes_free / MiB));
+    else if (bytes_free < 10.0 * GiB)
+      len = snprintf(buffer, sizeof(buffer), "%.2lfGiB", floor((bytes_free * 100.0) / GiB) / 100.0);
+    else if (bytes_free < 100.0 * GiB)
+      len = snprintf(buffer, sizeof(buffer), "%.1lfGiB", floor((bytes_free * 10.0) / GiB) / 10.0);
+    else
+      len = snprintf(buffer, sizeof(buffer), "%.0lfGiB", floor(bytes_free / GiB));
+
+    console_set_status("\x1b[0;%dH" GREEN "%s", 50 - len, buffer);
+#endif
+  }
+}
+
+/* Refresh the free space estimate with statvfs and show it in the status bar */
+static void
+update_free_space(void)
+{
+  mutexLock(&free_space_lock);
+  update_free_space_locked();
+  mutexUnlock(&free_space_lock);
+}
+
+/*! refresh the free space estimate if it was adjusted since the last statvfs */
+static void
+settle_free_space(void)
+{
+  mutexLock(&free_space_lock);
+  if (free_space_dirty)
+    update_free_space_locked();
+  mutexUnlock(&free_space_lock);
+}
+
+/*! account for bytes written to or freed from the SD card
+ *
+ *  @param[in] bytes bytes used; negative for bytes freed
+ */
+static void
+adjust_free_space(int64_t bytes)
+{
+  mutexLock(&free_space_lock);
+  if (free_space >= 0)
+  {
+    free_space -= bytes;
+    if (free_space < 0)
+      free_space = 0;
+  }
+  free_space_dirty = true;
+  mutexUnlock(&free_space_lock);
+}
+
+/*! refresh an adjusted free space estimate once it is old enough */
+static void
+check_free_space(void)
+{
+  mutexLock(&free_space_lock);
+  if (free_space_dirty && ftp_time_ms() - free_space_time >= FREE_SPACE_INTERVAL)
+    update_free_space_locked();
+  mutexUnlock(&free_space_lock);
+}
+
+/*! log memory usage every MEMSTAT_INTERVAL */
+static void
+check_memstat(void)
+{
+  uint64_t now = ftp_time_ms();
+
+  if (now - memstat_time < MEMSTAT_INTERVAL)
+    return;
+
+  memstat_time = now;
+  memstat_log();
+}
+
+/*! get the free space estimate
+ *
+ *  @returns free bytes, or -1 for error
+ */
+static int64_t
+get_free_space(void)
+{
+  int64_t bytes;
+
+  mutexLock(&free_space_lock);
+  if (free_space < 0)
+    update_free_space_locked();
+  bytes = free_space;
+  mutexUnlock(&free_space_lock);
+
+  return bytes;
+}
+
+/*! Update status bar */
+static int
+update_status(void)
+{
+#if defined(_3DS) || defined(__SWITCH__)
+//  console_set_status("\n" GREEN STATUS_STRING " "
+#ifdef ENABLE_LOGGING
+//                     "DEBUG "
+#endif
+  //                    CYAN "%s:%u" RESET,
+  //                  inet_ntoa(serv_addr.sin_addr),
+  //                ntohs(serv_addr.sin_port));
+  update_free_space();
+#elif 0 //defined(__SWITCH__)
+  char hostname[128];
+  socklen_t addrlen = sizeof(serv_addr);
+  int rc;
+  rc = gethostname(hostname, sizeof(hostname));
+  if (rc != 0)
+  {
+    console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+  console_set_status("\n" GREEN STATUS_STRING " test "
+#ifdef ENABLE_LOGGING
+                     "DEBUG "
+#endif
+                     CYAN "%s:%u" RESET,
+                     hostname,
+                     ntohs(serv_addr.sin_port));
+  update_free_space();
+#else
+  char hostname[128];
+  socklen_t addrlen = sizeof(serv_addr);
+  int rc;
+
+  rc = getsockname(listenfd, (struct sockaddr *)&serv_addr, &addrlen);
+  if (rc != 0)
+  {
     console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-    ftp_send_response(session, 451, "Failed to get connection info\r\n");
-    ftp_session_destroy(session);
     return -1;
   }
 
-  session->cmd_fd = new_fd;
+  rc = gethostname(hostname, sizeof(hostname));
+  if (rc != 0)
+  {
+    console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  console_set_status(GREEN STATUS_STRING " "
+#ifdef ENABLE_LOGGING
+                                         "DEBUG "
+#endif
+                     YELLOW "IP:" CYAN "%s " YELLOW "Port:" CYAN "%u" RESET,
+                     hostname,
+                     ntohs(serv_addr.sin_port));
+#endif
+
+  return 0;
+}
+
+#ifdef _3DS
+/*! Handle apt events
+ *
+ *  @param[in] type    Event type
+ *  @param[in] closure Callback closure
+ */
+static void
+apt_hook(APT_HookType type,
+         void *closure)
+{
+  switch (type)
+  {
+  case APTHOOK_ONSUSPEND:
+  case APTHOOK_ONSLEEP:
+    /* turn on backlight, or you can't see the home menu! */
+    if (R_SUCCEEDED(gspLcdInit()))
+    {
+      GSPLCD_PowerOnBacklight(GSPLCD_SCREEN_BOTH);
+      gspLcdExit();
+    }
+    break;
+
+  case APTHOOK_ONRESTORE:
+  case APTHOOK_ONWAKEUP:
+    /* restore backlight power state */
+    if (R_SUCCEEDED(gspLcdInit()))
+    {
+      (lcd_power ? GSPLCD_PowerOnBacklight : GSPLCD_PowerOffBacklight)(GSPLCD_SCREEN_BOTH);
+      gspLcdExit();
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+#elif defined(__SWITCH__)
+/*! Handle applet events
+ *
+ *  @param[in] type    Event type
+ *  @param[in] closure Callback closure
+ */
+static void
+applet_hook(AppletHookType type,
+            void *closure)
+{
+  (void)closure;
+  (void)type;
+  /* stubbed for now */
+  switch (type)
+  {
+  default:
+    break;
+  }
+}
+#endif
+
+/*! create the loopback socket pair used to wake a worker
+ *
+ *  @param[in] worker worker
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_worker_wake_init(ftp_worker_t *worker)
+{
+  int rc, fd;
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+
+  worker->wake_fd[0] = worker->wake_fd[1] = -1;
+
+  /* listen on an ephemeral loopback port */
+  fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+  {
+    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+
+  rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  if (rc == 0)
+    rc = listen(fd, 1);
+  if (rc == 0)
+    rc = getsockname(fd, (struct sockaddr *)&addr, &addrlen);
+  if (rc != 0)
+  {
+    console_print(RED "wake listen: %d %s\n" RESET, errno, strerror(errno));
+    ftp_closesocket(fd, false);
+    return -1;
+  }
+
+  /* connect the write end and accept the read end */
+  worker->wake_fd[1] = socket(AF_INET, SOCK_STREAM, 0);
+  if (worker->wake_fd[1] < 0 || connect(worker->wake_fd[1], (struct sockaddr *)&addr, sizeof(addr)) != 0)
+  {
+    console_print(RED "wake connect: %d %s\n" RESET, errno, strerror(errno));
+    ftp_closesocket(fd, false);
+    return -1;
+  }
+
+  worker->wake_fd[0] = accept(fd, NULL, NULL);
+  ftp_closesocket(fd, false);
+  if (worker->wake_fd[0] < 0)
+  {
+    console_print(RED "wake accept: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  if (ftp_set_socket_nonblocking(worker->wake_fd[0]) != 0 || ftp_set_socket_nonblocking(worker->wake_fd[1]) != 0)
+    return -1;
+
+  return 0;
+}
+
+/*! tear down a worker after its thread has stopped
+ *
+ *  @param[in] worker worker
+ */
+static void
+ftp_worker_exit(ftp_worker_t *worker)
+{
+  ftp_session_t *session;
+
+  /* clean up all sessions */
+  while (worker->sessions != NULL)
+    ftp_session_destroy(worker->sessions);
+
+  /* and the ones that were never adopted */
+  while (worker->pending != NULL)
+  {
+    session = worker->pending;
+    worker->pending = session->next;
+    ftp_closesocket(session->cmd_fd, true);
+    path_free(session->cwd);
+    ftp_session_free(session);
+  }
+
+  if (worker->wake_fd[0] >= 0)
+    ftp_closesocket(worker->wake_fd[0], false);
+  if (worker->wake_fd[1] >= 0)
+    ftp_closesocket(worker->wake_fd[1], false);
+  worker->wake_fd[0] = worker->wake_fd[1] = -1;
+
+  free(worker->pollinfo);
+  worker->pollinfo = NULL;
+  worker->pollinfo_size = 0;
+  if (worker->buffer != NULL)
+    memstat_sub(MEM_SESSIONS, XFER_BUFFERSIZE + CMD_BUFFERSIZE);
+  free(worker->buffer);
+  worker->buffer = worker->cmd_buffer = NULL;
+  worker->load = 0;
+}
+
+/*! one pass of a worker's poll loop
+ *
+ *  Blocks in a single poll over the worker's wake socket, every socket of
+ *  its sessions and, for worker 0, the listen socket, then dispatches
+ *  whatever became ready
+ *
+ *  @param[in] worker worker
+ *
+ *  @returns whether to keep looping
+ */
+static loop_status_t
+ftp_worker_loop(ftp_worker_t *worker)
+{
+  int rc;
+  char drain[16];
+  nfds_t nfds, listen_index = 0, num_sessions = 0;
+  struct pollfd *pollinfo;
+  ftp_session_t *session;
+
+  /* take over sessions handed to us since the last pass */
+  ftp_worker_adopt(worker);
+
+  /* make room for the wake and listen sockets and two sockets per session */
+  for (session = worker->sessions; session != NULL; session = session->next)
+    ++num_sessions;
+
+  if (worker->pollinfo_size < 2 + 2 * num_sessions)
+  {
+    pollinfo = (struct pollfd *)realloc(worker->pollinfo, (2 + 2 * num_sessions) * sizeof(*pollinfo));
+    if (pollinfo == NULL)
+    {
+      console_print(RED "failed to allocate pollfds\n" RESET);
+      return LOOP_RESTART;
+    }
+
+    worker->pollinfo = pollinfo;
+    worker->pollinfo_size = 2 + 2 * num_sessions;
+  }
+  pollinfo = worker->pollinfo;
+
+  /* we will poll for wakeups */
+  pollinfo[0].fd = worker->wake_fd[0];
+  pollinfo[0].events = POLLIN;
+  pollinfo[0].revents = 0;
+  nfds = 1;
+
+  /* worker 0 polls for new client connections */
+  if (worker == &workers[0])
+  {
+    listen_index = nfds++;
+    pollinfo[listen_index].fd = listenfd;
+    pollinfo[listen_index].events = POLLIN;
+    pollinfo[listen_index].revents = 0;
+  }
+
+  /* and for whatever each session is waiting on */
+  for (session = worker->sessions; session != NULL; session = session->next)
+  {
+    session->poll_index = nfds;
+    session->poll_nfds = ftp_session_poll_setup(session, &pollinfo[nfds]);
+    nfds += session->poll_nfds;
+  }
+
+  /* block until something is ready */
+  rc = poll(pollinfo, nfds, POLL_TIMEOUT);
+  if (rc < 0)
+  {
+    /* wifi got disabled */
+    console_print(RED "poll: FAILED!\n" RESET);
+
+    if (errno == ENETDOWN)
+      return LOOP_RESTART;
+
+    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
+    return LOOP_EXIT;
+  }
+
+  /* consume wakeups */
+  if (pollinfo[0].revents & POLLIN)
+  {
+    while (recv(worker->wake_fd[0], drain, sizeof(drain), 0) > 0)
+      ;
+  }
+
+  if (listen_index != 0 && pollinfo[listen_index].revents != 0)
+  {
+    if (pollinfo[listen_index].revents & POLLIN)
+    {
+      /* we got a new client */
+      if (ftp_session_new(listenfd) != 0)
+      {
+        return LOOP_RESTART;
+      }
+      flash_led_connect();
+    }
+    else
+    {
+      console_print(YELLOW "listenfd: revents=0x%08X\n" RESET, pollinfo[listen_index].revents);
+    }
+  }
+
+  /* dispatch each session */
+  session = worker->sessions;
+  while (session != NULL)
+    session = ftp_session_poll(session, &pollinfo[session->poll_index]);
+
+  return LOOP_CONTINUE;
+}
+
+/*! worker thread entry point
+ *
+ *  @param[in] arg worker
+ */
+static void
+ftp_worker_thread(void *arg)
+{
+  ftp_worker_t *worker = (ftp_worker_t *)arg;
+  loop_status_t status = LOOP_CONTINUE;
+
+  while (workers_running && status == LOOP_CONTINUE)
+    status = ftp_worker_loop(worker);
+
+  mutexLock(&worker->lock);
+  worker->status = status == LOOP_CONTINUE ? LOOP_EXIT : status;
+  mutexUnlock(&worker->lock);
+}
+
+/*! start the session workers
+ *
+ *  @returns -1 for failure
+ */
+static int
+ftp_workers_init(void)
+{
+  Result rc;
+  size_t count;
+  char str_workers[100];
+
+  ini_gets("Workers", "workers:", "1", str_workers, sizearray(str_workers), CONFIGPATH);
+  count = atoi(str_workers);
+  if (count < 1)
+    count = 1;
+  if (count > MAX_WORKERS)
+    count = MAX_WORKERS;
+
+  workers_running = true;
+  next_worker = 0;
+
+  while (num_workers < count)
+  {
+    ftp_worker_t *worker = &workers[num_workers];
+
+    mutexInit(&worker->lock);
+    worker->pending = NULL;
+    worker->sessions = NULL;
+    worker->load = 0;
+    worker->status = LOOP_CONTINUE;
+    worker->buffer = worker->cmd_buffer = NULL;
+
+    if (ftp_worker_wake_init(worker) != 0)
+    {
+      ftp_worker_exit(worker);
+      return -1;
+    }
+
+    /* scratch shared by the worker's sessions; only one command runs at a time */
+    worker->buffer = (char *)malloc(XFER_BUFFERSIZE + CMD_BUFFERSIZE);
+    if (worker->buffer == NULL)
+    {
+      console_print(RED "failed to allocate worker buffers\n" RESET);
+      memstat_fail(MEM_SESSIONS);
+      ftp_worker_exit(worker);
+      return -1;
+    }
+    worker->cmd_buffer = worker->buffer + XFER_BUFFERSIZE;
+    memstat_add(MEM_SESSIONS, XFER_BUFFERSIZE + CMD_BUFFERSIZE);
+
+    /* worker 0 runs on the main thread */
+    if (num_workers != 0)
+    {
+      rc = threadCreate(&worker->thread, ftp_worker_thread, worker, NULL,
+                        WORKER_STACK_SIZE, WORKER_PRIORITY, -2);
+      if (R_SUCCEEDED(rc))
+      {
+        rc = threadStart(&worker->thread);
+        if (R_FAILED(rc))
+          threadClose(&worker->thread);
+      }
+
+      if (R_FAILED(rc))
+      {
+        console_print(RED "failed to start worker: 0x%x\n" RESET, rc);
+        ftp_worker_exit(worker);
+        return -1;
+      }
+    }
+
+    ++num_workers;
+  }
+
+  return 0;
+}
+
+void ftp_pre_init(void)
+{
+  start_time = time(NULL);
+
+  /* register applet hook */
+  appletHook(&cookie, applet_hook, NULL);
+}
+
+/*! initialize ftp subsystem */
+int ftp_init(void)
+{
+  int rc = 0;
+
+  /* allocate socket to listen for clients */
+  listenfd = socket(AF_INET, SOCK_STREAM, 0);
+  if (listenfd < 0)
+  {
+    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* get address to listen on */
+  serv_addr.sin_family = AF_INET;
+
+  serv_addr.sin_addr.s_addr = INADDR_ANY;
+  char str_port[100];
+  ini_gets("Port", "port:", "dummy", str_port, sizearray(str_port), CONFIGPATH); 
+  LISTEN_PORT = atoi (str_port);
+  serv_addr.sin_port = htons(LISTEN_PORT);
+
+  /* reuse address */
+  {
+    int yes = 1;
+    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    if (rc != 0)
+    {
+      console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
+      ftp_exit();
+      return -1;
+    }
+  }
+
+  /* bind socket to listen address */
+  rc = bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
+  if (rc != 0)
+  {
+    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* listen on socket */
+  rc = listen(listenfd, 5);
+  if (rc != 0)
+  {
+    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
+    ftp_exit();
+    return -1;
+  }
+
+  /* print server address */
+  rc = update_status();
+  if (rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  /* start the file I/O threads */
+  rc = ftp_io_init();
+  if (rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  /* reserve the session slots */
+  rc = ftp_sessions_init();
+  if (rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  dircache_init();
+
+  /* start handing out sessions */
+  rc = ftp_workers_init();
+  if (rc != 0)
+  {
+    ftp_exit();
+    return -1;
+  }
+
+  return 0;
+}
+
+/*! deinitialize ftp subsystem */
+void ftp_exit(void)
+{
+
+  size_t i;
+
+  debug_print("exiting ftp server\n");
+
+  /* stop the worker threads */
+  workers_running = false;
+  for (i = 1; i < num_workers; ++i)
+  {
+    ftp_worker_wake(&workers[i]);
+    threadWaitForExit(&workers[i].thread);
+    threadClose(&workers[i].thread);
+  }
+
+  /* clean up all sessions */
+  for (i = 0; i < num_workers; ++i)
+    ftp_worker_exit(&workers[i]);
+  num_workers = 0;
+
+  /* nothing can submit file I/O anymore */
+  ftp_io_exit();
+  ftp_sessions_exit();
+  dircache_exit();
+
+  /* stop listening for new clients */
+  if (listenfd >= 0)
+    ftp_closesocket(listenfd, false);
+
+  /* deinitialize socket driver */
+  console_render();
+  console_print(CYAN "Waiting for socketExit()...\n" RESET);
+
+}
+
+void ftp_post_exit(void)
+{
+}
+
+/*! ftp loop
+ *
+ *  Runs worker 0 on the main thread and checks on the other workers
+ *
+ *  @returns whether to keep looping
+ */
+loop_status_t
+ftp_loop(void)
+{
+  loop_status_t status;
+  size_t i;
+
+  status = ftp_worker_loop(&workers[0]);
+  if (status != LOOP_CONTINUE)
+    return status;
+
+  check_free_space();
+  check_memstat();
+
+  /* a worker thread stops on its own when e.g. wifi goes down */
+  for (i = 1; i < num_workers; ++i)
+  {
+    mutexLock(&workers[i].lock);
+    status = workers[i].status;
+    mutexUnlock(&workers[i].lock);
+
+    if (status != LOOP_CONTINUE)
+      return status;
+  }
+
+#ifdef _3DS
+  /* check if the user wants to exit */
+  hidScanInput();
+  u32 down = hidKeysDown();
 
-  /* send initiator response */
-  ftp_send_response(session, 220, "Hello!\r\n");
-  return 0;
-}
+  if (down & KEY_B)
+    return LOOP_EXIT;
 
+  /* check if the user wants to toggle the LCD power */
+  if (down & KEY_START)
+  {
+    lcd_power = !lcd_power;
+    apt_hook(APTHOOK_ONRESTORE, NULL);
+  }
+#elif defined(__SWITCH__)
+    /* check if the user wants to exit */
+#endif
 
+  return LOOP_CONTINUE;
+}
 
-/*! accept PASV connection for ftp session
+/*! change to parent directory
  *
  *  @param[in] session ftp session
+ */
+static void
+cd_up(ftp_session_t *session)
+{
+  char *slash = NULL, *p;
+
+  /* remove basename from cwd */
+  for (p = session->cwd; *p; ++p)
+  {
+    if (*p == '/')
+      slash = p;
+  }
+  *slash = 0;
+  if (strlen(session->cwd) == 0)
+    strcat(session->cwd, "/");
+}
+
+/*! validate a path
  *
- *  @returns -1 for failure
+ *  @param[in] args path to validate
  */
 static int
-ftp_session_accept(ftp_session_t *session)
+validate_path(const char *args)
 {
-  int rc, new_fd;
-  struct sockaddr_in addr;
-  socklen_t addrlen = sizeof(addr);
+  const char *p;
 
-  if (session->flags & SESSION_PASV)
+  /* make sure no path components are '..' */
+  p = args;
+  while ((p = strstr(p, "/..")) != NULL)
   {
-    /* clear PASV flag */
-    session->flags &= ~SESSION_PASV;
+    if (p[3] == 0 || p[3] == '/')
+      return -1;
+  }
 
-    /* tell the peer that we're ready to accept the connection */
-    ftp_send_response(session, 150, "Ready\r\n");
+  /* make sure there are no '//' */
+  if (strstr(args, "//") != NULL)
+    return -1;
 
-    /* accept connection from peer */
-    new_fd = accept(session->pasv_fd, (struct sockaddr *)&addr, &addrlen);
-    if (new_fd < 0)
+  return 0;
+}
+
+/*! get a path relative to cwd
+ *
+ *  @param[out] buffer  where to put the path, XFER_BUFFERSIZE bytes
+ *  @param[out] size    path length
+ *  @param[in]  cwd     working directory
+ *  @param[in]  args    path to make
+ *
+ *  @returns error
+ */
+static int
+build_path_to(char *buffer,
+              size_t *size,
+              const char *cwd,
+              const char *args)
+{
+  int rc;
+  char *p;
+
+  *size = 0;
+  buffer[0] = 0;
+
+  /* make sure the input is a valid path */
+  if (validate_path(args) != 0)
+  {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (args[0] == '/')
+  {
+    /* this is an absolute path */
+    size_t len = strlen(args);
+    if (len > XFER_BUFFERSIZE - 1)
     {
-      console_print(RED "accept: %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      errno = ENAMETOOLONG;
       return -1;
     }
 
-    /* set the socket to non-blocking */
-    rc = ftp_set_socket_nonblocking(new_fd);
-    if (rc != 0)
+    memcpy(buffer, args, len + 1);
+    *size = len;
+  }
+  else
+  {
+    /* this is a relative path */
+    if (strcmp(cwd, "/") == 0)
+      rc = snprintf(buffer, XFER_BUFFERSIZE, "/%s",
+                    args);
+    else
+      rc = snprintf(buffer, XFER_BUFFERSIZE, "%s/%s",
+                    cwd, args);
+
+    if (rc >= XFER_BUFFERSIZE)
     {
-      ftp_closesocket(new_fd, true);
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 425, "Failed to establish connection\r\n");
+      errno = ENAMETOOLONG;
       return -1;
     }
 
-    console_print(CYAN "accepted connection from %s:%u\n" RESET,
-                  inet_ntoa(addr.sin_addr), ntohs(addr.sin_port));
-
-    /* we are ready to transfer data */
-    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
-    session->data_fd = new_fd;
+    *size = rc;
+  }
 
-    return 0;
+  /* remove trailing / */
+  p = buffer + *size;
+  while (p > buffer && *--p == '/')
+  {
+    *p = 0;
+    --*size;
   }
-  else
+
+  /* if we ended with an empty path, it is the root directory */
+  if (*size == 0)
   {
-    /* peer didn't send PASV command */
-    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
-    return -1;
+    buffer[(*size)++] = '/';
+    buffer[*size] = 0;
   }
+
+  return 0;
 }
 
-/*! connect to peer for ftp session
+/*! get a path relative to cwd
  *
  *  @param[in] session ftp session
+ *  @param[in] cwd     working directory
+ *  @param[in] args    path to make
  *
- *  @returns -1 for failure
+ *  @returns error
+ *
+ *  @note the output goes to session->buffer
  */
 static int
-ftp_session_connect(ftp_session_t *session)
+build_path(ftp_session_t *session,
+           const char *cwd,
+           const char *args)
 {
-  int rc;
+  return build_path_to(session->buffer, &session->buffersize, cwd, args);
+}
 
-  /* clear PORT flag */
-  session->flags &= ~SESSION_PORT;
+#ifdef __SWITCH__
+/*! get a file's modification time straight from its filesystem
+ *
+ *  @param[in] path path to the file
+ *
+ *  @returns modification time, or 0 if it is unknown
+ */
+static time_t
+fsdev_getmtime(const char *path)
+{
+  char fspath[FS_MAX_PATH];
+  FsFileSystem *fs;
+  FsTimeStampRaw timestamp;
+  Result rc;
 
-  /* create a new socket */
-  session->data_fd = socket(AF_INET, SOCK_STREAM, 0);
-  if (session->data_fd < 0)
+  if (fsdevTranslatePath(path, &fs, fspath) == -1)
   {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    console_print(RED "fsdevTranslatePath '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    return 0;
   }
 
-  /* set socket options */
-  rc = ftp_set_socket_options(session->data_fd);
-  if (rc != 0)
+  rc = fsFsGetFileTimeStampRaw(fs, fspath, &timestamp);
+  if (R_FAILED(rc))
   {
-    ftp_closesocket(session->data_fd, false);
-    session->data_fd = -1;
-    return -1;
+    console_print(RED "fsFsGetFileTimeStampRaw '%s': 0x%x\n" RESET, path, rc);
+    return 0;
   }
 
-  /* set socket to non-blocking */
-  rc = ftp_set_socket_nonblocking(session->data_fd);
-  if (rc != 0)
-    return -1;
+  if (!timestamp.is_valid)
+    return 0;
 
-  /* connect to peer */
-  rc = connect(session->data_fd, (struct sockaddr *)&session->peer_addr,
-               sizeof(session->peer_addr));
-  if (rc != 0)
+  return timestamp.modified;
+}
+#endif
+
+/*! get the type, size and time of a directory entry
+ *
+ *  Fills in what the directory iterator already has. If the rest has to
+ *  come from the filesystem, the entry's path is left in the worker's
+ *  scratch buffer for list_stat_path, since session->buffer holds the
+ *  listing.
+ *
+ *  @param[in]  session ftp session
+ *  @param[in]  dent    directory entry
+ *  @param[out] st      where to put them
+ *  @param[out] op      what list_stat_path still has to do
+ *
+ *  @returns 1 if st needs list_stat_path, 0 if it is complete, or -1 for
+ *           failure
+ */
+static int
+list_stat(ftp_session_t *session,
+          struct dirent *dent,
+          struct stat *st,
+          io_op_t *op)
+{
+  char *path = session->worker->buffer;
+  size_t pathsize;
+
+#ifdef _3DS
+  /* the sdmc directory entry already has the type and size, so no need to do a slow stat */
+  u32 magic = *(u32 *)session->dp->dirData->dirStruct;
+
+  if (magic == SDMC_DIRITER_MAGIC)
   {
-    if (errno != EINPROGRESS)
+    sdmc_dir_t *dir = (sdmc_dir_t *)session->dp->dirData->dirStruct;
+    FS_DirectoryEntry *entry = &dir->entry_data[dir->index];
+
+    if (entry->attributes & FS_ATTRIBUTE_DIRECTORY)
+      st->st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
+    else
+      st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+
+    if (!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
+      st->st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+
+    st->st_size = entry->fileSize;
+    st->st_mtime = 0;
+
+    bool getmtime = true;
+    if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
     {
-      console_print(RED "connect: %d %s\n" RESET, errno, strerror(errno));
-      ftp_closesocket(session->data_fd, false);
-      session->data_fd = -1;
-      return -1;
+      if (!(session->mlst_flags & SESSION_MLST_MODIFY))
+        getmtime = false;
+    }
+    else if (session->dir_mode == XFER_DIR_NLST)
+      getmtime = false;
+
+    if (!getmtime)
+      return 0;
+
+    if (build_path_to(path, &pathsize, session->lwd, dent->d_name) != 0)
+    {
+      console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
+      return 0;
     }
+
+    *op = IO_MTIME;
+    return 1;
   }
-  else
+#elif defined(__SWITCH__)
+  /* the fsdev directory entry already has the type and size, so no need to
+   * do a stat, which costs several FS round-trips per entry */
+  u32 magic = *(u32 *)session->dp->dirData->dirStruct;
+
+  if (magic == FSDEV_DIRITER_MAGIC)
   {
-    console_print(CYAN "connected to %s:%u\n" RESET,
-                  inet_ntoa(session->peer_addr.sin_addr),
-                  ntohs(session->peer_addr.sin_port));
+    fsdev_dir_t *dir = (fsdev_dir_t *)session->dp->dirData->dirStruct;
+    FsDirectoryEntry *entry = &dir->entry_data[dir->index];
+
+    memset(st, 0, sizeof(*st));
+    if (entry->type == FsDirEntryType_Dir)
+      st->st_mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IRWXO;
+    else
+      st->st_mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
+
+    st->st_nlink = 1;
+    st->st_size = entry->file_size;
+
+    /* only MLSD/MLST with the modify fact and LIST/STAT show the time */
+    if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
+    {
+      if (!(session->mlst_flags & SESSION_MLST_MODIFY))
+        return 0;
+    }
+
+    if (build_path_to(path, &pathsize, session->lwd, dent->d_name) != 0)
+    {
+      console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
+      return 0;
+    }
+
+    *op = IO_MTIME;
+    return 1;
+  }
+#endif
+
+  /* lstat the entry */
+  if (build_path_to(path, &pathsize, session->lwd, dent->d_name) != 0)
+  {
+    console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
+    return -1;
+  }
+
+  *op = IO_LSTAT;
+  return 1;
+}
+
+/*! finish the stat of a directory entry from the filesystem
+ *
+ *  @param[in]     op   IO_LSTAT or IO_MTIME, from list_stat
+ *  @param[in]     path entry path
+ *  @param[in,out] st   stat to finish
+ *
+ *  @returns -1 for failure
+ *
+ *  @note this runs on the I/O threads when the stat was prefetched
+ */
+static int
+list_stat_path(io_op_t op,
+               const char *path,
+               struct stat *st)
+{
+#ifdef _3DS
+  if (op == IO_MTIME)
+  {
+    uint64_t mtime = 0;
+    Result rc;
+
+    if ((rc = sdmc_getmtime(path, &mtime)) != 0)
+      console_print(RED "sdmc_getmtime '%s': 0x%x\n" RESET, path, rc);
+    else
+      st->st_mtime = mtime;
+    return 0;
+  }
+#elif defined(__SWITCH__)
+  if (op == IO_MTIME)
+  {
+    st->st_mtime = fsdev_getmtime(path);
+    return 0;
+  }
+#else
+  (void)op;
+#endif
 
-    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
-    ftp_send_response(session, 150, "Ready\r\n");
+  if (lstat(path, st) != 0)
+  {
+    console_print(RED "stat '%s': %d %s\n" RESET, path, errno, strerror(errno));
+    return -1;
   }
 
   return 0;
 }
 
-static bool
-ftp_auth_oncommand(ftp_session_t *session, const char *command) 
+/*! get the path of the directory being listed, from the top of the tree
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns path, empty for the top
+ */
+static const char *
+list_tree_path(ftp_session_t *session)
 {
-  if(command && (strcasecmp("USER", command) == 0 || strcasecmp("PASS", command) == 0 || strcasecmp("QUIT", command) == 0)) 
-  {
-    return true;
-  }
-  
-  return session->user_ok && session->pass_ok;
+  const char *path = session->lwd + session->tree->root_len;
+
+  if (*path == '/')
+    ++path;
+  return path;
 }
 
-static void
-ftp_auth_check(ftp_session_t *session, const char *user, const char *pass) 
+/*! format one directory entry onto the end of the listing
+ *
+ *  @param[in] session ftp session
+ *  @param[in] name    entry name
+ *  @param[in] st      entry stat; not used by NLST
+ *
+ *  @returns -1 if the transfer was ended
+ */
+static int
+list_entry(ftp_session_t *session,
+           const char *name,
+           const struct stat *st)
 {
-	char str_user[100];
-  ini_gets("User", "user:", "dummy", str_user, sizearray(str_user), CONFIGPATH); 
-  char str_pass[100];
-  ini_gets("Password", "password:", "dummy", str_pass, sizearray(str_pass), CONFIGPATH); 
-  char str_anony[100];
-  ini_gets("Anonymous", "anonymous:", "dummy", str_anony, sizearray(str_anony), CONFIGPATH); 
-  
-  if (strcmp("1", str_anony) == 0)
-  {      
-        session->user_ok = false;
-        session->pass_ok = false;
-        ftp_send_response(session, 230, "OK, Huh Anonymous is that you ???\r\n");
-		return;
-  }
-  
-  if(user) 
+  int rc;
+  char *p, *path = session->worker->buffer;
+  const char *dir;
+  size_t pathsize;
+
+  /* check if this was a NLST */
+  if (session->dir_mode == XFER_DIR_NLST)
   {
-    if(strcmp(str_user, user) == 0) 
-	{
-      session->user_ok = true;
-    } 
-	else 
-	{
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 430, "Unknown user, Please check /config/sys-ftpd/config.ini\r\n");
-      ftp_session_close_cmd(session);
-      return;
+    /* NLST gives the whole path name */
+    if (build_path_to(path, &pathsize, session->lwd, name) == 0)
+    {
+      /* append to the listing, encoding \n */
+      p = put_name(session->buffer + session->buffersize, path, pathsize);
+      *p++ = '\r';
+      *p++ = '\n';
+      session->buffersize = p - session->buffer;
     }
+
+    return 0;
   }
-  
-  if(pass) 
+
+  /* a recursive MLSD names entries from the top directory */
+  if (session->tree != NULL && session->dir_mode == XFER_DIR_MLSD)
   {
-    if(strcmp(str_pass, pass) == 0) 
-	{
-      session->pass_ok = true;
-    } 
-	else 
-	{
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, 430, "Wrong password, Please check /config/sys-ftpd/config.ini\r\n");
-      ftp_session_close_cmd(session);
-      return;
+    dir = list_tree_path(session);
+    if (*dir != 0)
+    {
+      p = put_str(path, dir);
+      *p++ = '/';
+      strcpy(p, name);
+      name = path;
     }
   }
-  
-  ftp_session_set_state(session, COMMAND_STATE, 0);
-  if(ftp_auth_oncommand(session, NULL)) 
-  {
-    ftp_send_response(session, 230, "OK\r\n");
-	return;
-  } 
-  else 
+
+  rc = ftp_session_fill_dirent(session, st, name, strlen(name));
+  if (rc != 0)
   {
-    ftp_send_response(session, 331, "next step required\r\n");
-	return;
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 425, "%s\r\n", strerror(rc));
+    return -1;
   }
+
+  return 0;
 }
 
-/*! read command for ftp session
+/*! get the facts the current listing shows
  *
  *  @param[in] session ftp session
- *  @param[in] events  poll events
+ *
+ *  @returns DIRCACHE_* facts
  */
-static void
-ftp_session_read_command(ftp_session_t *session,
-                         int events)
+static unsigned
+list_facts(ftp_session_t *session)
 {
-  char *buffer, *args, *next = NULL;
-  size_t i, len;
-  int atmark;
-  ssize_t rc;
-  ftp_command_t key, *command;
+  if (session->dir_mode == XFER_DIR_NLST)
+    return 0;
 
-  /* check out-of-band data */
-  if (events & POLLPRI)
+  if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
   {
-    session->flags |= SESSION_URGENT;
+    if (!(session->mlst_flags & SESSION_MLST_MODIFY))
+      return DIRCACHE_STAT;
+  }
 
-    /* check if we are at the urgent marker */
-    atmark = sockatmark(session->cmd_fd);
-    if (atmark < 0)
-    {
-      console_print(RED "sockatmark: %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_close_cmd(session);
-      return;
-    }
+  return DIRCACHE_STAT | DIRCACHE_MTIME;
+}
 
-    if (!atmark)
-    {
-      /* discard in-band data */
-      rc = recv(session->cmd_fd, session->cmd_buffer, sizeof(session->cmd_buffer), 0);
-      if (rc < 0 && errno != EWOULDBLOCK)
-      {
-        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-        ftp_session_close_cmd(session);
-      }
+/*! get the next entry of a cached listing
+ *
+ *  @param[in]  session ftp session
+ *  @param[out] st      entry stat
+ *
+ *  @returns entry name, or NULL at the end
+ */
+static const char *
+list_next_cached(ftp_session_t *session,
+                 struct stat *st)
+{
+  const dircache_dirent_t *dent;
 
-      return;
-    }
+  dent = dircache_next(session->listing, &session->listing_pos);
+  if (dent == NULL)
+    return NULL;
 
-    /* retrieve the urgent data */
-    rc = recv(session->cmd_fd, session->cmd_buffer, sizeof(session->cmd_buffer), MSG_OOB);
-    if (rc < 0)
-    {
-      /* EWOULDBLOCK means out-of-band data is on the way */
-      if (errno == EWOULDBLOCK)
-        return;
+  memset(st, 0, sizeof(*st));
+  st->st_mode = dent->mode;
+  st->st_nlink = dent->nlink;
+  st->st_size = dent->size;
+  st->st_mtime = dent->mtime;
 
-      /* error retrieving out-of-band data */
-      console_print(RED "recv (oob): %d %s\n" RESET, errno, strerror(errno));
-      ftp_session_close_cmd(session);
+  return dent->name;
+}
+
+/*! look for a directory in the listing cache
+ *
+ *  @param[in] session ftp session
+ *  @param[in] path    directory path
+ *
+ *  @returns whether the listing will come from the cache
+ */
+static bool
+list_cached(ftp_session_t *session,
+            const char *path)
+{
+  session->listing = dircache_get(path, list_facts(session), ftp_time_ms());
+  session->listing_pos = 0;
+  return session->listing != NULL;
+}
+
+/*! get the cache key for the current listing's output format
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns key
+ */
+static unsigned
+list_render_key(ftp_session_t *session)
+{
+  /* the facts only matter to MLSD/MLST */
+  if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
+    return session->dir_mode | (session->mlst_flags << 8);
+
+  return session->dir_mode;
+}
+
+/*! pick up output formatted for an earlier listing, or start keeping this
+ *  one's for the next
+ *
+ *  @param[in] session ftp session
+ */
+static void
+list_render_start(ftp_session_t *session)
+{
+  unsigned key = list_render_key(session);
+
+  /* a recursive MLSD names the entries below the top differently */
+  if (session->tree != NULL && session->dir_mode == XFER_DIR_MLSD && *list_tree_path(session) != 0)
+    return;
+
+  if (session->listing != NULL)
+  {
+    if (dircache_render_get(session->listing, session->lwd, key, session->timestamp,
+                            &session->render, &session->render_size))
+    {
+      session->render_pos = 0;
       return;
     }
 
-    /* reset the command buffer */
-    session->cmd_buffersize = 0;
-    return;
+    session->render_rec = dircache_render_record(session->listing, session->lwd, key);
   }
+  else if (session->recording != NULL)
+    session->render_rec = dircache_render_record(session->recording, session->lwd, key);
+}
 
-  /* prepare to receive data */
-  buffer = session->cmd_buffer + session->cmd_buffersize;
-  len = sizeof(session->cmd_buffer) - session->cmd_buffersize;
-  if (len == 0)
-  {
-    /* error retrieving command */
-    console_print(RED "Exceeded command buffer size\n" RESET);
-    ftp_session_close_cmd(session);
+/*! keep the output of one entry for the next listing
+ *
+ *  @param[in] session ftp session
+ *  @param[in] start   where the entry starts in session->buffer
+ *  @param[in] st      entry stat; not used by NLST
+ */
+static void
+list_render_add(ftp_session_t *session,
+                size_t start,
+                const struct stat *st)
+{
+  if (session->render_rec == NULL)
     return;
-  }
 
-  /* retrieve command data */
-  rc = recv(session->cmd_fd, buffer, len, 0);
-  if (rc < 0)
+  /* LIST shows the time for recent files and the year for others, so the
+   * output is only good until one of them crosses over */
+  if (session->dir_mode == XFER_DIR_LIST || session->dir_mode == XFER_DIR_STAT)
   {
-    /* error retrieving command */
-    console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
-    return;
+    if (st->st_mtime >= session->timestamp)
+      dircache_render_expire(session->render_rec, st->st_mtime + 1);
+    else if (session->timestamp - st->st_mtime < LIST_RECENT)
+      dircache_render_expire(session->render_rec, st->st_mtime + LIST_RECENT);
   }
-  if (rc == 0)
+
+  if (dircache_render_add(session->render_rec, session->buffer + start,
+                          session->buffersize - start) != 0)
   {
-    /* peer closed connection */
-    debug_print("peer closed connection\n");
-    ftp_session_close_cmd(session);
-    return;
+    /* too big to cache */
+    dircache_render_discard(session->render_rec);
+    session->render_rec = NULL;
   }
-  else
-  {
-    session->cmd_buffersize += rc;
-    len = sizeof(session->cmd_buffer) - session->cmd_buffersize;
+}
 
-    if (session->flags & SESSION_URGENT)
-    {
-      /* look for telnet data mark */
-      for (i = 0; i < session->cmd_buffersize; ++i)
-      {
-        if ((unsigned char)session->cmd_buffer[i] == 0xF2)
-        {
-          /* ignore all data that precedes the data mark */
-          if (i < session->cmd_buffersize - 1)
-            memmove(session->cmd_buffer, session->cmd_buffer + i + 1, len - i - 1);
-          session->cmd_buffersize -= i + 1;
-          session->flags &= ~SESSION_URGENT;
-          break;
-        }
-      }
-    }
+/*! keep a listing that was read to the end, and its output, for next time
+ *
+ *  @param[in] session ftp session
+ */
+static void
+list_keep(ftp_session_t *session)
+{
+  if (session->render_rec != NULL)
+  {
+    dircache_render_publish(session->listing != NULL ? session->listing : session->recording,
+                            session->render_rec);
+    session->render_rec = NULL;
+  }
 
-    /* loop through commands */
-    while (true)
-    {
-      /* must have at least enough data for the delimiter */
-      if (session->cmd_buffersize < 1)
-        return;
+  if (session->recording != NULL)
+  {
+    dircache_publish(session->recording);
+    session->recording = NULL;
+  }
+}
 
-      /* look for \r\n or \n delimiter */
-      for (i = 0; i < session->cmd_buffersize; ++i)
-      {
-        if (i < session->cmd_buffersize - 1 && session->cmd_buffer[i] == '\r' && session->cmd_buffer[i + 1] == '\n')
-        {
-          /* we found a \r\n delimiter */
-          session->cmd_buffer[i] = 0;
-          next = &session->cmd_buffer[i + 2];
-          break;
-        }
-        else if (session->cmd_buffer[i] == '\n')
-        {
-          /* we found a \n delimiter */
-          session->cmd_buffer[i] = 0;
-          next = &session->cmd_buffer[i + 1];
-          break;
-        }
-      }
+/*! stage a MODE B block header
+ *
+ *  @param[in] block framing
+ *  @param[in] desc  descriptor
+ *  @param[in] count bytes in the block
+ */
+static void
+block_stage(xfer_block_t *block,
+            uint8_t desc,
+            size_t count)
+{
+  block->head[block->len++] = desc;
+  block->head[block->len++] = count >> 8;
+  block->head[block->len++] = count & 0xFF;
+}
 
-      /* check if a delimiter was found */
-      if (i == session->cmd_buffersize)
-        return;
+/*! send the staged MODE B headers
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns 0 once they are out, or -1 for failure
+ */
+static ssize_t
+block_flush(ftp_session_t *session)
+{
+  xfer_block_t *block = &session->block;
+  ssize_t rc;
 
-      /* decode the command */
-      decode_path(session, i);
+  while (block->pos < block->len)
+  {
+    rc = send(session->data_fd, block->head + block->pos, block->len - block->pos, 0);
+    if (rc <= 0)
+    {
+      if (rc == 0)
+        errno = ECONNRESET;
+      return -1;
+    }
+    block->pos += rc;
+  }
 
-      /* split command from arguments */
-      args = buffer = session->cmd_buffer;
-      while (*args && !isspace((int)*args))
-        ++args;
-      if (*args)
-        *args++ = 0;
+  block->pos = block->len = 0;
+  return 0;
+}
 
-      /* look up the command */
-      key.name = buffer;
-      command = bsearch(&key, ftp_commands,
-                        num_ftp_commands, sizeof(ftp_command_t),
-                        ftp_command_cmp);
+/*! send transfer data, in blocks for MODE B
+ *
+ *  @param[in] session ftp session
+ *  @param[in] data    data to send
+ *  @param[in] size    data size
+ *
+ *  @returns bytes sent, or what send returned
+ */
+static ssize_t
+ftp_data_send(ftp_session_t *session,
+              const char *data,
+              size_t size)
+{
+  xfer_block_t *block = &session->block;
+  size_t done = 0, len;
+  ssize_t rc;
+  int n;
 
-      /* update command timestamp */
-      session->timestamp = time(NULL);
+  if (!block->on)
+    return send(session->data_fd, data, size, 0);
 
-      /* execute the command */
-      if (command == NULL)
+  while (done < size)
+  {
+    if (block->left == 0 && block->len == 0)
+    {
+      /* a restart marker is the offset to give REST to resume from here */
+      if (block->next_mark != 0 && block->bytes >= block->next_mark)
       {
-        /* send header */
-        ftp_send_response(session, 502, "Invalid command \"");
+        n = snprintf(block->head + 3, sizeof(block->head) - 6, "%" PRIu64, block->base + block->bytes);
+        block_stage(block, BLOCK_MARK, n);
+        block->len += n;
+        block->next_mark += BLOCK_MARK_INTERVAL;
+      }
 
-        /* send command */
-        len = strlen(buffer);
-        buffer = encode_path(buffer, &len, false);
-        if (buffer != NULL)
-          ftp_send_response_buffer(session, buffer, len);
-        else
-          ftp_send_response_buffer(session, key.name, strlen(key.name));
-        free(buffer);
+      block->left = size - done < BLOCK_SIZE ? size - done : BLOCK_SIZE;
+      block_stage(block, 0, block->left);
+    }
 
-        /* send args (if any) */
-        if (*args != 0)
-        {
-          ftp_send_response_buffer(session, " ", 1);
-
-          len = strlen(args);
-          buffer = encode_path(args, &len, false);
-          if (buffer != NULL)
-            ftp_send_response_buffer(session, buffer, len);
-          else
-            ftp_send_response_buffer(session, args, strlen(args));
-          free(buffer);
-        }
+    rc = block_flush(session);
+    if (rc != 0)
+      return done != 0 ? (ssize_t)done : rc;
 
-        /* send footer */
-        ftp_send_response_buffer(session, "\"\r\n", 3);
-      }
-      else if (session->state != COMMAND_STATE)
-      {
-        /* only some commands are available during data transfer */
-        if (strcasecmp(command->name, "ABOR") != 0 && strcasecmp(command->name, "STAT") != 0 && strcasecmp(command->name, "QUIT") != 0)
-        {
-          ftp_send_response(session, 503, "Invalid command during transfer\r\n");
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_session_close_cmd(session);
-        }
-        else
-          command->handler(session, args);
-      }
-      else
-      {
-        /* clear RENAME flag for all commands except RNTO */
-        if (strcasecmp(command->name, "RNTO") != 0)
-          session->flags &= ~SESSION_RENAME;
+    len = size - done < block->left ? size - done : block->left;
+    rc = send(session->data_fd, data + done, len, 0);
+    if (rc <= 0)
+      return done != 0 ? (ssize_t)done : rc;
 
-        command->handler(session, args);
-      }
+    block->left -= rc;
+    block->bytes += rc;
+    done += rc;
 
-      /* remove executed command from the command buffer */
-      len = session->cmd_buffer + session->cmd_buffersize - next;
-      if (len > 0)
-        memmove(session->cmd_buffer, next, len);
-      session->cmd_buffersize = len;
-    }
+    /* the socket is full */
+    if ((size_t)rc < len)
+      break;
   }
+
+  return done;
 }
 
-/*! poll sockets for ftp session
+/*! end sent data with the MODE B EOF block
  *
  *  @param[in] session ftp session
  *
- *  @returns next session
+ *  @returns 0 once it is out or without MODE B; -1 to wait for the socket,
+ *           or for failure, which ends the transfer
  */
-static ftp_session_t *
-ftp_session_poll(ftp_session_t *session)
+static int
+ftp_data_send_eof(ftp_session_t *session)
 {
-  int rc;
-  struct pollfd pollinfo[2];
-  nfds_t nfds = 1;
+  xfer_block_t *block = &session->block;
 
-  /* the first pollfd is the command socket */
-  pollinfo[0].fd = session->cmd_fd;
-  pollinfo[0].events = POLLIN | POLLPRI;
-  pollinfo[0].revents = 0;
+  if (!block->on)
+    return 0;
 
-  switch (session->state)
+  if (!block->eof)
   {
-  case COMMAND_STATE:
-    /* we are waiting to read a command */
-    break;
-
-  case DATA_CONNECT_STATE:
-    if (session->flags & SESSION_PASV)
-    {
-      /* we are waiting for a PASV connection */
-      pollinfo[1].fd = session->pasv_fd;
-      pollinfo[1].events = POLLIN;
-    }
-    else
-    {
-      /* we are waiting to complete a PORT connection */
-      pollinfo[1].fd = session->data_fd;
-      pollinfo[1].events = POLLOUT;
-    }
-    pollinfo[1].revents = 0;
-    nfds = 2;
-    break;
-
-  case DATA_TRANSFER_STATE:
-    /* we need to transfer data */
-    pollinfo[1].fd = session->data_fd;
-    if (session->flags & SESSION_RECV)
-      pollinfo[1].events = POLLIN;
-    else
-      pollinfo[1].events = POLLOUT;
-    pollinfo[1].revents = 0;
-    nfds = 2;
-    break;
+    block_stage(block, BLOCK_EOF, 0);
+    block->eof = true;
   }
 
-  /* poll the selected sockets */
-  rc = poll(pollinfo, nfds, 0);
-  if (rc < 0)
+  if (block_flush(session) == 0)
+    return 0;
+
+  if (errno != EWOULDBLOCK)
   {
-    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
-    ftp_session_close_cmd(session);
+    console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
   }
-  else if (rc > 0)
-  {
-    /* check the command socket */
-    if (pollinfo[0].revents != 0)
-    {
-      /* handle command */
-      if (pollinfo[0].revents & POLL_UNKNOWN)
-        console_print(YELLOW "cmd_fd: revents=0x%08X\n" RESET, pollinfo[0].revents);
+  return -1;
+}
 
-      /* we need to read a new command */
-      if (pollinfo[0].revents & (POLLERR | POLLHUP))
-      {
-        debug_print("cmd revents=0x%x\n", pollinfo[0].revents);
-        ftp_session_close_cmd(session);
-      }
-      else if (pollinfo[0].revents & (POLLIN | POLLPRI))
-        ftp_session_read_command(session, pollinfo[0].revents);
-    }
+/*! receive transfer data, taking it out of blocks for MODE B
+ *
+ *  A restart marker from the client is answered with a 110 reply giving
+ *  the REST offset to resume from.
+ *
+ *  @param[in] session ftp session
+ *  @param[in] buffer  buffer to receive into
+ *  @param[in] size    buffer size
+ *
+ *  @returns bytes received, 0 at the end of the data, or -1 for failure
+ */
+static ssize_t
+ftp_data_recv(ftp_session_t *session,
+              char *buffer,
+              size_t size)
+{
+  xfer_block_t *block = &session->block;
+  size_t len;
+  ssize_t rc;
+
+  if (!block->on)
+    return recv(session->data_fd, buffer, size, 0);
+
+  while (true)
+  {
+    if (block->left == 0 && (block->desc & BLOCK_EOF))
+      return 0;
 
-    /* check the data/pasv socket */
-    if (nfds > 1 && pollinfo[1].revents != 0)
+    if (block->left == 0)
     {
-      switch (session->state)
-      {
-      case COMMAND_STATE:
-        /* this shouldn't happen? */
+      /* get the next header */
+      rc = recv(session->data_fd, block->head + block->pos, 3 - block->pos, 0);
+      if (rc <= 0)
         break;
 
-      case DATA_CONNECT_STATE:
-        if (pollinfo[1].revents & POLL_UNKNOWN)
-          console_print(YELLOW "pasv_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+      block->pos += rc;
+      if (block->pos < 3)
+        continue;
 
-        /* we need to accept the PASV connection */
-        if (pollinfo[1].revents & (POLLERR | POLLHUP))
-        {
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 426, "Data connection failed\r\n");
-        }
-        else if (pollinfo[1].revents & POLLIN)
-        {
-          if (ftp_session_accept(session) != 0)
-            ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        }
-        else if (pollinfo[1].revents & POLLOUT)
-        {
+      block->pos = 0;
+      block->len = 0;
+      block->desc = block->head[0];
+      block->left = ((uint8_t)block->head[1] << 8) | (uint8_t)block->head[2];
+      continue;
+    }
 
-          console_print(CYAN "connected to %s:%u\n" RESET,
-                        inet_ntoa(session->peer_addr.sin_addr),
-                        ntohs(session->peer_addr.sin_port));
+    len = size < block->left ? size : block->left;
+    rc = recv(session->data_fd, buffer, len, 0);
+    if (rc <= 0)
+      break;
 
-          ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
-          ftp_send_response(session, 150, "Ready\r\n");
-        }
-        break;
+    block->left -= rc;
+    if (!(block->desc & BLOCK_MARK))
+      return rc;
+
+    /* keep what fits of a restart marker */
+    len = sizeof(block->head) - 1 - block->len;
+    if (len > (size_t)rc)
+      len = rc;
+    memcpy(block->head + block->len, buffer, len);
+    block->len += len;
 
-      case DATA_TRANSFER_STATE:
-        if (pollinfo[1].revents & POLL_UNKNOWN)
-          console_print(YELLOW "data_fd: revents=0x%08X\n" RESET, pollinfo[1].revents);
+    if (block->left == 0)
+    {
+      block->desc &= ~BLOCK_MARK;
 
-        /* we need to transfer data */
-        if (pollinfo[1].revents & (POLLERR | POLLHUP))
+      /* the data before it is written; a converted stream has no offset */
+      if (session->zstream == NULL && session->untar == NULL)
+      {
+        block->head[block->len] = 0;
+        for (len = 0; len < block->len; ++len)
         {
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 426, "Data connection failed\r\n");
+          if (!isprint((unsigned char)block->head[len]))
+            block->head[len] = '?';
         }
-        else if (pollinfo[1].revents & (POLLIN | POLLOUT))
-          ftp_session_transfer(session);
-        break;
+        ftp_send_response(session, 110, "MARK %" PRIu64 " = %s\r\n", session->filepos, block->head);
       }
     }
   }
 
-  /* still connected to peer; return next session */
-  if (session->cmd_fd >= 0)
-    return session->next;
-
-  /* disconnected from peer; destroy it and return next session */
-  debug_print("disconnected from peer\n");
-  flash_led_disconnect();
-  return ftp_session_destroy(session);
+  /* the connection may not close before the EOF block */
+  if (rc == 0)
+    errno = ECONNRESET;
+  return -1;
 }
 
-/* Update free space in status bar */
+/*! finish a transfer that went through
+ *
+ *  In MODE B the data connection is kept for the next transfer.
+ *
+ *  @param[in] session ftp session
+ */
 static void
-update_free_space(void)
+ftp_session_end_transfer(ftp_session_t *session)
 {
-#if defined(_3DS) || defined(__SWITCH__)
-#define KiB (1024.0)
-#define MiB (1024.0 * KiB)
-#define GiB (1024.0 * MiB)
-  char buffer[16];
-  struct statvfs st;
-  double bytes_free;
-  int rc, len;
-
-  rc = statvfs("sdmc:/", &st);
-  if (rc != 0)
-    console_print(RED "statvfs: %d %s\n" RESET, errno, strerror(errno));
-  else
+  if (session->block.on && session->data_fd >= 0)
   {
-    bytes_free = (double)st.f_bsize * st.f_bfree;
-
-    if (bytes_free < 1000.0)
-      len = snprintf(buffer, sizeof(buffer), "%.0lfB", bytes_free);
-    else if (bytes_free < 10.0 * KiB)
-      len = snprintf(buffer, sizeof(buffer), "%.2lfKiB", floor((bytes_free * 100.0) / KiB) / 100.0);
-    else if (bytes_free < 100.0 * KiB)
-      len = snprintf(buffer, sizeof(buffer), "%.1lfKiB", floor((bytes_free * 10.0) / KiB) / 10.0);
-    else if (bytes_free < 1000.0 * KiB)
-      len = snprintf(buffer, sizeof(buffer), "%.0lfKiB", floor(bytes_free / KiB));
-    else if (bytes_free < 10.0 * MiB)
-      len = snprintf(buffer, sizeof(buffer), "%.2lfMiB", floor((bytes_free * 100.0) / MiB) / 100.0);
-    else if (bytes_free < 100.0 * MiB)
-      len = snprintf(buffer, sizeof(buffer), "%.1lfMiB", floor((bytes_free * 10.0) / MiB) / 10.0);
-    else if (bytes_free < 1000.0 * MiB)
-      len = snprintf(buffer, sizeof(buffer), "%.0lfMiB", floor(bytes_free / MiB));
-    else if (bytes_free < 10.0 * GiB)
-      len = snprintf(buffer, sizeof(buffer), "%.2lfGiB", floor((bytes_free * 100.0) / GiB) / 100.0);
-    else if (bytes_free < 100.0 * GiB)
-      len = snprintf(buffer, sizeof(buffer), "%.1lfGiB", floor((bytes_free * 10.0) / GiB) / 10.0);
-    else
-      len = snprintf(buffer, sizeof(buffer), "%.0lfGiB", floor(bytes_free / GiB));
-
-    console_set_status("\x1b[0;%dH" GREEN "%s", 50 - len, buffer);
+    session->block_fd = session->data_fd;
+    session->data_fd = -1;
   }
-#endif
+
+  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
 }
 
-/*! Update status bar */
-static int
-update_status(void)
+/*! send listing data
+ *
+ *  In MODE Z the data is compressed first, and an empty send ends the
+ *  compressed stream.
+ *
+ *  @param[in]     session ftp session
+ *  @param[in]     data    data to send
+ *  @param[in,out] pos     bytes of data sent
+ *  @param[in]     size    data size
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+list_send(ftp_session_t *session,
+          const char *data,
+          size_t *pos,
+          size_t size)
 {
-#if defined(_3DS) || defined(__SWITCH__)
-//  console_set_status("\n" GREEN STATUS_STRING " "
-#ifdef ENABLE_LOGGING
-//                     "DEBUG "
-#endif
-  //                    CYAN "%s:%u" RESET,
-  //                  inet_ntoa(serv_addr.sin_addr),
-  //                ntohs(serv_addr.sin_port));
-  update_free_space();
-#elif 0 //defined(__SWITCH__)
-  char hostname[128];
-  socklen_t addrlen = sizeof(serv_addr);
-  int rc;
-  rc = gethostname(hostname, sizeof(hostname));
-  if (rc != 0)
-  {
-    console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
-  }
-  console_set_status("\n" GREEN STATUS_STRING " test "
-#ifdef ENABLE_LOGGING
-                     "DEBUG "
-#endif
-                     CYAN "%s:%u" RESET,
-                     hostname,
-                     ntohs(serv_addr.sin_port));
-  update_free_space();
-#else
-  char hostname[128];
-  socklen_t addrlen = sizeof(serv_addr);
-  int rc;
+  xfer_zstream_t *zs = session->zstream;
+  size_t in, out;
+  ssize_t rc;
 
-  rc = getsockname(listenfd, (struct sockaddr *)&serv_addr, &addrlen);
-  if (rc != 0)
+  if (zs != NULL)
   {
-    console_print(RED "getsockname: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    /* compress more once the last of it is out */
+    if (zs->pos == zs->len)
+    {
+      in = size - *pos;
+      out = sizeof(zs->buffer);
+      if (zstream_run(zs, data + *pos, &in, zs->buffer, &out, in == 0 ? Z_FINISH : Z_NO_FLUSH) != 0)
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 451, "Compression failed\r\n");
+        return LOOP_EXIT;
+      }
+
+      *pos += in;
+      zs->pos = 0;
+      zs->len = out;
+      if (out == 0)
+        return LOOP_CONTINUE;
+    }
+
+    data = zs->buffer;
+    pos = &zs->pos;
+    size = zs->len;
   }
 
-  rc = gethostname(hostname, sizeof(hostname));
-  if (rc != 0)
+  rc = ftp_data_send(session, data + *pos, size - *pos);
+  if (rc <= 0)
   {
-    console_print(RED "gethostname: %d %s\n" RESET, errno, strerror(errno));
-    return -1;
+    /* error sending data */
+    if (rc < 0)
+    {
+      if (errno == EWOULDBLOCK)
+        return LOOP_EXIT;
+      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return LOOP_EXIT;
   }
 
-  console_set_status(GREEN STATUS_STRING " "
-#ifdef ENABLE_LOGGING
-                                         "DEBUG "
-#endif
-                     YELLOW "IP:" CYAN "%s " YELLOW "Port:" CYAN "%u" RESET,
-                     hostname,
-                     ntohs(serv_addr.sin_port));
-#endif
+  /* we can try to send more data */
+  *pos += rc;
+  return LOOP_CONTINUE;
+}
+
+/*! finish a listing
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns LOOP_EXIT, or whether to call again while a MODE Z stream ends
+ */
+static loop_status_t
+list_done(ftp_session_t *session)
+{
+  size_t pos = 0;
+  int rc;
+
+  /* the rest of the compressed stream goes out first */
+  if (session->zstream != NULL && (!session->zstream->end || session->zstream->pos < session->zstream->len))
+    return list_send(session, "", &pos, 0);
+
+  if (ftp_data_send_eof(session) != 0)
+    return LOOP_EXIT;
 
-  return 0;
+  /* check xfer dir type */
+  if (session->dir_mode == XFER_DIR_STAT)
+    rc = 213;
+  else
+    rc = 226;
+
+  ftp_session_end_transfer(session);
+  ftp_send_response(session, rc, "OK\r\n");
+  return LOOP_EXIT;
 }
 
-#ifdef _3DS
-/*! Handle apt events
+/*! start stat'ing the entries of a directory ahead of the listing
  *
- *  @param[in] type    Event type
- *  @param[in] closure Callback closure
+ *  @param[in] session ftp session
+ *
+ *  @note without it, or if it can't be had, entries are stat'd one by one
  */
 static void
-apt_hook(APT_HookType type,
-         void *closure)
+list_prefetch_start(ftp_session_t *session)
 {
-  switch (type)
-  {
-  case APTHOOK_ONSUSPEND:
-  case APTHOOK_ONSLEEP:
-    /* turn on backlight, or you can't see the home menu! */
-    if (R_SUCCEEDED(gspLcdInit()))
-    {
-      GSPLCD_PowerOnBacklight(GSPLCD_SCREEN_BOTH);
-      gspLcdExit();
-    }
-    break;
+  list_prefetch_t *prefetch;
+  size_t reserve;
+  unsigned i;
 
-  case APTHOOK_ONRESTORE:
-  case APTHOOK_ONWAKEUP:
-    /* restore backlight power state */
-    if (R_SUCCEEDED(gspLcdInit()))
-    {
-      (lcd_power ? GSPLCD_PowerOnBacklight : GSPLCD_PowerOffBacklight)(GSPLCD_SCREEN_BOTH);
-      gspLcdExit();
-    }
-    break;
+  /* NLST needs no stats, and without I/O threads they would run one by one */
+  if (list_prefetch_max == 0 || num_io_threads == 0 || session->dir_mode == XFER_DIR_NLST)
+    return;
 
-  default:
-    break;
+  /* each entry takes its name and maybe its path */
+  reserve = strlen(session->lwd) + 2 * sizeof(((struct dirent *)0)->d_name) + 2;
+  if (reserve > LIST_PREFETCH_PATHS)
+    return;
+
+  prefetch = (list_prefetch_t *)malloc(sizeof(*prefetch));
+  if (prefetch == NULL)
+    return;
+  memstat_add(MEM_XFER, sizeof(*prefetch));
+
+  for (i = 0; i < MAX_LIST_PREFETCH; ++i)
+  {
+    prefetch->entries[i].io.state = IO_IDLE;
+    prefetch->entries[i].pending = false;
   }
+  prefetch->count = 0;
+  prefetch->next = 0;
+  prefetch->reserve = reserve;
+  prefetch->eof = false;
+  prefetch->failed = false;
+
+  session->prefetch = prefetch;
 }
-#elif defined(__SWITCH__)
-/*! Handle applet events
+
+/*! stop stat'ing ahead and free the batch
  *
- *  @param[in] type    Event type
- *  @param[in] closure Callback closure
+ *  @param[in] session ftp session
  */
 static void
-applet_hook(AppletHookType type,
-            void *closure)
+list_prefetch_free(ftp_session_t *session)
 {
-  (void)closure;
-  (void)type;
-  /* stubbed for now */
-  switch (type)
+  list_prefetch_t *prefetch = session->prefetch;
+  unsigned i;
+
+  if (prefetch == NULL)
+    return;
+
+  /* wait out the stats the I/O threads are running */
+  for (i = 0; i < prefetch->count; ++i)
   {
-  default:
-    break;
+    if (prefetch->entries[i].pending)
+      ftp_io_cancel(&prefetch->entries[i].io);
   }
-}
-#endif
-
-void ftp_pre_init(void)
-{
-  start_time = time(NULL);
 
-  /* register applet hook */
-  appletHook(&cookie, applet_hook, NULL);
+  free(prefetch);
+  memstat_sub(MEM_XFER, sizeof(*prefetch));
+  session->prefetch = NULL;
 }
 
-/*! initialize ftp subsystem */
-int ftp_init(void)
+/*! read the next batch of entries and start their stats
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
+ */
+static int
+list_prefetch_fill(ftp_session_t *session)
 {
-  int rc = 0;
-
-  /* allocate socket to listen for clients */
-  listenfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (listenfd < 0)
-  {
-    console_print(RED "socket: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
-  }
-
-  /* get address to listen on */
-  serv_addr.sin_family = AF_INET;
+  list_prefetch_t *prefetch = session->prefetch;
+  list_prefetch_entry_t *entry;
+  struct dirent *dent;
+  char *p = prefetch->paths;
+  size_t len;
+  io_op_t op;
+  int rc;
 
-  serv_addr.sin_addr.s_addr = INADDR_ANY;
-  char str_port[100];
-  ini_gets("Port", "port:", "dummy", str_port, sizearray(str_port), CONFIGPATH); 
-  LISTEN_PORT = atoi (str_port);
-  serv_addr.sin_port = htons(LISTEN_PORT);
+  prefetch->count = 0;
+  prefetch->next = 0;
 
-  /* reuse address */
+  while (!prefetch->eof && prefetch->count < list_prefetch_max &&
+         (size_t)(prefetch->paths + LIST_PREFETCH_PATHS - p) >= prefetch->reserve)
   {
-    int yes = 1;
-    rc = setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-    if (rc != 0)
+    /* get the next directory entry */
+    errno = 0;
+    dent = readdir(session->dp);
+    if (dent == NULL)
     {
-      console_print(RED "setsockopt: %d %s\n" RESET, errno, strerror(errno));
-      ftp_exit();
-      return -1;
+      prefetch->eof = true;
+      prefetch->failed = errno != 0;
+      break;
     }
-  }
 
-  /* bind socket to listen address */
-  rc = bind(listenfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr));
-  if (rc != 0)
-  {
-    console_print(RED "bind: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
-  }
+    /* TODO I think we are supposed to return entries for . and .. */
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
 
-  /* listen on socket */
-  rc = listen(listenfd, 5);
-  if (rc != 0)
-  {
-    console_print(RED "listen: %d %s\n" RESET, errno, strerror(errno));
-    ftp_exit();
-    return -1;
-  }
+    entry = &prefetch->entries[prefetch->count++];
+    len = strlen(dent->d_name) + 1;
+    entry->name = memcpy(p, dent->d_name, len);
+    p += len;
 
-  /* print server address */
-  rc = update_status();
-  if (rc != 0)
-  {
-    ftp_exit();
-    return -1;
+    /* the directory iterator only has this entry until the next readdir */
+    rc = list_stat(session, dent, &entry->st, &op);
+    if (rc < 0)
+      return -1;
+
+    if (rc > 0)
+    {
+      len = strlen(session->worker->buffer) + 1;
+      memcpy(p, session->worker->buffer, len);
+
+      entry->io.st = &entry->st;
+      ftp_io_submit(session, &entry->io, op, p, 0);
+      entry->pending = true;
+      p += len;
+    }
   }
 
   return 0;
 }
 
-/*! deinitialize ftp subsystem */
-void ftp_exit(void)
+/*! check if a listing waiting on a stat can go on
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether the next entry's stat is done
+ */
+static bool
+list_prefetch_ready(ftp_session_t *session)
 {
+  list_prefetch_t *prefetch = session->prefetch;
+  list_prefetch_entry_t *entry;
 
-  debug_print("exiting ftp server\n");
-
-  /* clean up all sessions */
-  while (sessions != NULL)
-    ftp_session_destroy(sessions);
-
-  /* stop listening for new clients */
-  if (listenfd >= 0)
-    ftp_closesocket(listenfd, false);
-
-  /* deinitialize socket driver */
-  console_render();
-  console_print(CYAN "Waiting for socketExit()...\n" RESET);
-
-}
+  if (prefetch == NULL || !(session->flags & SESSION_IO_WAIT) || prefetch->next == prefetch->count)
+    return false;
 
-void ftp_post_exit(void)
-{
+  entry = &prefetch->entries[prefetch->next];
+  return !entry->pending || ftp_io_state(&entry->io) == IO_DONE;
 }
 
-/*! ftp look
+/*! get the next entry of a directory whose stats are prefetched
  *
- *  @returns whether to keep looping
+ *  @param[in]  session ftp session
+ *  @param[out] name    entry name
+ *  @param[out] st      entry stat
+ *
+ *  @returns what was got
  */
-loop_status_t
-ftp_loop(void)
+static list_next_t
+list_next_prefetched(ftp_session_t *session,
+                     const char **name,
+                     struct stat *st)
 {
-  int rc;
-  struct pollfd pollinfo;
-  ftp_session_t *session;
+  list_prefetch_t *prefetch = session->prefetch;
+  list_prefetch_entry_t *entry;
 
-  /* we will poll for new client connections */
-  pollinfo.fd = listenfd;
-  pollinfo.events = POLLIN;
-  pollinfo.revents = 0;
+  /* read ahead again once the batch is used up */
+  if (prefetch->next == prefetch->count && list_prefetch_fill(session) != 0)
+    return LIST_FAILED;
 
-  /* poll for a new client */
-  rc = poll(&pollinfo, 1, 0);
-  if (rc < 0)
+  if (prefetch->count == 0)
   {
-    /* wifi got disabled */
-    console_print(RED "poll: FAILED!\n" RESET);
+    /* we have exhausted the directory listing; keep it unless reading it
+     * failed part way */
+    if (!prefetch->failed)
+      list_keep(session);
+    ftp_session_close_cwd(session);
+    return LIST_END;
+  }
 
-    if (errno == ENETDOWN)
-      return LOOP_RESTART;
+  entry = &prefetch->entries[prefetch->next];
+  if (entry->pending)
+  {
+    if (ftp_io_state(&entry->io) != IO_DONE)
+      return LIST_WAIT;
 
-    console_print(RED "poll: %d %s\n" RESET, errno, strerror(errno));
-    return LOOP_EXIT;
+    entry->pending = false;
+    if (ftp_io_complete(&entry->io) != 0)
+      return LIST_FAILED;
   }
-  else if (rc > 0)
+
+  ++prefetch->next;
+  *name = entry->name;
+  *st = entry->st;
+  return LIST_ENTRY;
+}
+
+/*! get the next entry of a directory, stat'ing it here
+ *
+ *  @param[in]  session ftp session
+ *  @param[out] name    entry name
+ *  @param[out] st      entry stat; not filled in for NLST
+ *
+ *  @returns what was got
+ */
+static list_next_t
+list_next_dir(ftp_session_t *session,
+              const char **name,
+              struct stat *st)
+{
+  struct dirent *dent;
+  io_op_t op;
+  int rc;
+
+  do
   {
-    if (pollinfo.revents & POLLIN)
-    {
-      /* we got a new client */
-      if (ftp_session_new(listenfd) != 0)
-      {
-        return LOOP_RESTART;
-      }
-      flash_led_connect();
-    }
-    else
+    /* get the next directory entry */
+    errno = 0;
+    dent = readdir(session->dp);
+    if (dent == NULL)
     {
-      console_print(YELLOW "listenfd: revents=0x%08X\n" RESET, pollinfo.revents);
+      /* we have exhausted the directory listing; keep it unless reading it
+       * failed part way */
+      if (errno == 0)
+        list_keep(session);
+      ftp_session_close_cwd(session);
+      return LIST_END;
     }
-  }
 
-  /* poll each session */
-  session = sessions;
-  while (session != NULL)
-    session = ftp_session_poll(session);
+    /* TODO I think we are supposed to return entries for . and .. */
+  } while (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0);
 
-#ifdef _3DS
-  /* check if the user wants to exit */
-  hidScanInput();
-  u32 down = hidKeysDown();
+  *name = dent->d_name;
+  if (session->dir_mode == XFER_DIR_NLST)
+    return LIST_ENTRY;
 
-  if (down & KEY_B)
-    return LOOP_EXIT;
+  rc = list_stat(session, dent, st, &op);
+  if (rc > 0)
+    rc = list_stat_path(op, session->worker->buffer, st);
+  if (rc != 0)
+    return LIST_FAILED;
 
-  /* check if the user wants to toggle the LCD power */
-  if (down & KEY_START)
+  return LIST_ENTRY;
+}
+
+/*! get ready to read the directory in the lwd
+ *
+ *  @param[in] session ftp session
+ */
+static void
+list_start(ftp_session_t *session)
+{
+  /* keep what we read for the next listing of this directory */
+  if (session->dp != NULL)
   {
-    lcd_power = !lcd_power;
-    apt_hook(APTHOOK_ONRESTORE, NULL);
+    session->recording = dircache_record(session->lwd, list_facts(session), ftp_time_ms());
+    list_prefetch_start(session);
   }
-#elif defined(__SWITCH__)
-    /* check if the user wants to exit */
-#endif
-
-  return LOOP_CONTINUE;
+  list_render_start(session);
 }
 
-/*! change to parent directory
+/*! start a directory's part of a recursive LIST, the way ls -R does
  *
  *  @param[in] session ftp session
  */
 static void
-cd_up(ftp_session_t *session)
+list_tree_header(ftp_session_t *session)
 {
-  char *slash = NULL, *p;
+  const char *path = list_tree_path(session);
+  char *p = session->buffer + session->buffersize;
 
-  /* remove basename from cwd */
-  for (p = session->cwd; *p; ++p)
+  if (*path == 0)
+    p = put_str(p, ".:");
+  else
   {
-    if (*p == '/')
-      slash = p;
+    p = put_str(p, "\r\n./");
+    p = put_name(p, path, strlen(path));
+    *p++ = ':';
   }
-  *slash = 0;
-  if (strlen(session->cwd) == 0)
-    strcat(session->cwd, "/");
+  *p++ = '\r';
+  *p++ = '\n';
+
+  session->buffersize = p - session->buffer;
 }
 
-/*! validate a path
+/*! start a recursive listing of the directory in the lwd
  *
- *  @param[in] args path to validate
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure
  */
 static int
-validate_path(const char *args)
+list_tree_start(ftp_session_t *session)
 {
-  const char *p;
-
-  /* make sure no path components are '..' */
-  p = args;
-  while ((p = strstr(p, "/..")) != NULL)
-  {
-    if (p[3] == 0 || p[3] == '/')
-      return -1;
-  }
+  list_tree_t *tree;
 
-  /* make sure there are no '//' */
-  if (strstr(args, "//") != NULL)
+  tree = (list_tree_t *)malloc(sizeof(*tree));
+  if (tree == NULL)
     return -1;
+  memstat_add(MEM_XFER, sizeof(*tree));
+
+  tree->depth = 0;
+  tree->root_len = strlen(session->lwd);
+  session->tree = tree;
+
+  if (session->dir_mode == XFER_DIR_LIST)
+    list_tree_header(session);
 
   return 0;
 }
 
-/*! get a path relative to cwd
+/*! end a recursive listing
  *
  *  @param[in] session ftp session
- *  @param[in] cwd     working directory
- *  @param[in] args    path to make
+ */
+static void
+list_tree_free(ftp_session_t *session)
+{
+  list_tree_t *tree = session->tree;
+
+  if (tree == NULL)
+    return;
+
+  while (tree->depth > 0)
+    closedir(tree->frames[--tree->depth].dp);
+
+  free(tree);
+  memstat_sub(MEM_XFER, sizeof(*tree));
+  session->tree = NULL;
+}
+
+/*! go on to the next directory of a recursive listing
  *
- *  @returns error
+ *  Called once a directory is listed. It and then its parents are read
+ *  again for subdirectories, and the first one found is set up to be listed
+ *  next. Symbolic links are not followed, so the walk can't loop.
  *
- *  @note the output goes to session->buffer
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 once the whole tree is listed, and the walk is ended
  */
 static int
-build_path(ftp_session_t *session,
-           const char *cwd,
-           const char *args)
+list_tree_next(ftp_session_t *session)
 {
-  int rc;
-  char *p;
-
-  session->buffersize = 0;
-  memset(session->buffer, 0, sizeof(session->buffer));
-
-  /* make sure the input is a valid path */
-  if (validate_path(args) != 0)
-  {
-    errno = EINVAL;
-    return -1;
+  list_tree_t *tree = session->tree;
+  list_tree_frame_t *frame;
+  struct dirent *dent;
+  struct stat st;
+  char *path = session->worker->buffer;
+  size_t pathsize, len, pos;
+  bool isdir;
+
+  /* look for subdirectories of the directory just listed */
+  if (tree->depth < MAX_LIST_DEPTH)
+  {
+    frame = &tree->frames[tree->depth];
+    frame->len = strlen(session->lwd);
+    frame->dp = opendir(session->lwd);
+    if (frame->dp != NULL)
+      ++tree->depth;
+    else
+      console_print(RED "opendir '%s': %d %s\n" RESET, session->lwd, errno, strerror(errno));
   }
+  else
+    console_print(YELLOW "not listing below '%s'\n" RESET, session->lwd);
 
-  if (args[0] == '/')
+  while (tree->depth > 0)
   {
-    /* this is an absolute path */
-    size_t len = strlen(args);
-    if (len > sizeof(session->buffer) - 1)
+    frame = &tree->frames[tree->depth - 1];
+    session->lwd[frame->len] = 0;
+
+    dent = readdir(frame->dp);
+    if (dent == NULL)
     {
-      errno = ENAMETOOLONG;
-      return -1;
+      /* no more subdirectories here; go back up */
+      closedir(frame->dp);
+      --tree->depth;
+      continue;
     }
 
-    memcpy(session->buffer, args, len);
-    session->buffersize = len;
-  }
-  else
-  {
-    /* this is a relative path */
-    if (strcmp(cwd, "/") == 0)
-      rc = snprintf(session->buffer, sizeof(session->buffer), "/%s",
-                    args);
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+
+    if (dent->d_type != DT_UNKNOWN)
+      isdir = dent->d_type == DT_DIR;
+    else if (build_path_to(path, &pathsize, session->lwd, dent->d_name) == 0 &&
+             lstat(path, &st) == 0)
+      isdir = S_ISDIR(st.st_mode);
     else
-      rc = snprintf(session->buffer, sizeof(session->buffer), "%s/%s",
-                    cwd, args);
+      isdir = false;
+
+    if (!isdir)
+      continue;
 
-    if (rc >= sizeof(session->buffer))
+    /* make it the lwd */
+    len = strlen(dent->d_name);
+    pos = frame->len;
+    if (pos > 1)
+      session->lwd[pos++] = '/';
+    if (pos + len >= LWD_BUFFERSIZE)
     {
-      errno = ENAMETOOLONG;
-      return -1;
+      console_print(RED "'%s': %d %s\n" RESET, dent->d_name, ENAMETOOLONG, strerror(ENAMETOOLONG));
+      continue;
     }
+    memcpy(session->lwd + pos, dent->d_name, len + 1);
 
-    session->buffersize = rc;
-  }
+    if (!list_cached(session, session->lwd))
+    {
+      session->dp = opendir(session->lwd);
+      if (session->dp == NULL)
+      {
+        /* skip it, as ls -R would */
+        console_print(RED "opendir '%s': %d %s\n" RESET, session->lwd, errno, strerror(errno));
+        continue;
+      }
+    }
 
-  /* remove trailing / */
-  p = session->buffer + session->buffersize;
-  while (p > session->buffer && *--p == '/')
-  {
-    *p = 0;
-    --session->buffersize;
+    if (session->dir_mode == XFER_DIR_LIST)
+      list_tree_header(session);
+    list_start(session);
+    return 0;
   }
 
-  /* if we ended with an empty path, it is the root directory */
-  if (session->buffersize == 0)
-    session->buffer[session->buffersize++] = '/';
-
-  return 0;
+  list_tree_free(session);
+  return -1;
 }
 
 /*! transfer a directory listing
+ *
+ *  Formats as many entries as are sure to fit in the transfer buffer, then
+ *  sends them with as few calls as the socket allows. Entries come from the
+ *  listing cache if it had the directory, and are otherwise read from the
+ *  directory and recorded for next time. If the cache also has this
+ *  listing's output, it is sent as is.
  *
  *  @param[in] session ftp session
  *
@@ -2307,182 +6030,351 @@ build_path(ftp_session_t *session,
 static loop_status_t
 list_transfer(ftp_session_t *session)
 {
-  ssize_t rc;
-  size_t len;
-  char *buffer;
   struct stat st;
-  struct dirent *dent;
+  const char *name;
+  list_next_t next;
+  size_t start;
+
+  if (session->render != NULL)
+  {
+    /* the MLSD cdir entry goes first */
+    if (session->bufferpos < session->buffersize)
+      return list_send(session, session->buffer, &session->bufferpos, session->buffersize);
+
+    if (session->render_pos < session->render_size)
+      return list_send(session, session->render, &session->render_pos, session->render_size);
+
+    /* the directory is done; a recursive listing goes on below */
+    ftp_session_close_cwd(session);
+    session->bufferpos = 0;
+    session->buffersize = 0;
+  }
 
   /* check if we sent all available data */
   if (session->bufferpos == session->buffersize)
   {
-    /* check xfer dir type */
-    if (session->dir_mode == XFER_DIR_STAT)
-      rc = 213;
-    else
-      rc = 226;
+    session->bufferpos = 0;
+    session->buffersize = 0;
 
-    /* check if this was for a file */
-    if (session->dp == NULL)
+    /* stop while the longest possible entry could still overflow */
+    while (XFER_BUFFERSIZE - session->buffersize >= LIST_ENTRY_RESERVE)
     {
-      /* we already sent the file's listing */
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, rc, "OK\r\n");
-      return LOOP_EXIT;
-    }
+      if (session->dp == NULL && session->listing == NULL)
+      {
+        /* go on to the next directory of a recursive listing */
+        if (session->tree == NULL || list_tree_next(session) != 0)
+          break;
 
-    /* get the next directory entry */
-    dent = readdir(session->dp);
-    if (dent == NULL)
-    {
-      /* we have exhausted the directory listing */
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-      ftp_send_response(session, rc, "OK\r\n");
-      return LOOP_EXIT;
-    }
+        /* its output is cached; it goes out after what we have */
+        if (session->render != NULL)
+          break;
+      }
 
-    /* TODO I think we are supposed to return entries for . and .. */
-    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
-      return LOOP_CONTINUE;
+      start = session->buffersize;
 
-    /* check if this was a NLST */
-    if (session->dir_mode == XFER_DIR_NLST)
-    {
-      /* NLST gives the whole path name */
-      session->buffersize = 0;
-      if (build_path(session, session->lwd, dent->d_name) == 0)
+      if (session->listing != NULL)
       {
-        /* encode \n in path */
-        len = session->buffersize;
-        buffer = encode_path(session->buffer, &len, false);
-        if (buffer != NULL)
+        name = list_next_cached(session, &st);
+        if (name == NULL)
         {
-          /* copy to the session buffer to send */
-          memcpy(session->buffer, buffer, len);
-          free(buffer);
-          session->buffer[len++] = '\r';
-          session->buffer[len++] = '\n';
-          session->buffersize = len;
+          /* we have sent the whole cached listing */
+          list_keep(session);
+          ftp_session_close_cwd(session);
+          continue;
         }
-      }
-    }
-    else
-    {
-#ifdef _3DS
-      /* the sdmc directory entry already has the type and size, so no need to do a slow stat */
-      u32 magic = *(u32 *)session->dp->dirData->dirStruct;
-
-      if (magic == SDMC_DIRITER_MAGIC)
-      {
-        sdmc_dir_t *dir = (sdmc_dir_t *)session->dp->dirData->dirStruct;
-        FS_DirectoryEntry *entry = &dir->entry_data[dir->index];
 
-        if (entry->attributes & FS_ATTRIBUTE_DIRECTORY)
-          st.st_mode = S_IFDIR | S_IRUSR | S_IRGRP | S_IROTH;
-        else
-          st.st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+        if (list_entry(session, name, &st) != 0)
+          return LOOP_EXIT;
 
-        if (!(entry->attributes & FS_ATTRIBUTE_READ_ONLY))
-          st.st_mode |= S_IWUSR | S_IWGRP | S_IWOTH;
+        list_render_add(session, start, &st);
+        continue;
+      }
 
-        st.st_size = entry->fileSize;
-        st.st_mtime = 0;
+      /* get the next directory entry with its stat */
+      if (session->prefetch != NULL)
+        next = list_next_prefetched(session, &name, &st);
+      else
+        next = list_next_dir(session, &name, &st);
 
-        bool getmtime = true;
-        if (session->dir_mode == XFER_DIR_MLSD || session->dir_mode == XFER_DIR_MLST)
-        {
-          if (!(session->mlst_flags & SESSION_MLST_MODIFY))
-            getmtime = false;
-        }
-        else if (session->dir_mode == XFER_DIR_NLST)
-          getmtime = false;
+      if (next == LIST_END)
+        continue;
 
-        if ((rc = build_path(session, session->lwd, dent->d_name)) != 0)
-          console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
-        else if (getmtime)
-        {
-          uint64_t mtime = 0;
-          if ((rc = sdmc_getmtime(session->buffer, &mtime)) != 0)
-            console_print(RED "sdmc_getmtime '%s': 0x%x\n" RESET, session->buffer, rc);
-          else
-            st.st_mtime = mtime;
-        }
-      }
-      else
+      if (next == LIST_WAIT)
       {
-        /* lstat the entry */
-        if ((rc = build_path(session, session->lwd, dent->d_name)) != 0)
-          console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
-        else if ((rc = lstat(session->buffer, &st)) != 0)
-          console_print(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
+        /* send what we have; once that is out, wait for the I/O thread */
+        if (session->buffersize != 0)
+          break;
 
-        if (rc != 0)
-        {
-          /* an error occurred */
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 550, "unavailable\r\n");
-          return LOOP_EXIT;
-        }
+        session->flags |= SESSION_IO_WAIT;
+        return LOOP_EXIT;
       }
-#else
-      /* lstat the entry */
-      if ((rc = build_path(session, session->lwd, dent->d_name)) != 0)
-        console_print(RED "build_path: %d %s\n" RESET, errno, strerror(errno));
-      else if ((rc = lstat(session->buffer, &st)) != 0)
-        console_print(RED "stat '%s': %d %s\n" RESET, session->buffer, errno, strerror(errno));
 
-      if (rc != 0)
+      if (next == LIST_FAILED)
       {
         /* an error occurred */
         ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
         ftp_send_response(session, 550, "unavailable\r\n");
         return LOOP_EXIT;
       }
-#endif
-      /* encode \n in path */
-      len = strlen(dent->d_name);
-      buffer = encode_path(dent->d_name, &len, false);
-      if (buffer != NULL)
+
+      if (session->recording != NULL &&
+          dircache_add(session->recording, name,
+                       session->dir_mode != XFER_DIR_NLST ? &st : NULL) != 0)
       {
-        rc = ftp_session_fill_dirent(session, &st, buffer, len);
-        free(buffer);
-        if (rc != 0)
-        {
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 425, "%s\r\n", strerror(rc));
-          return LOOP_EXIT;
-        }
+        /* too big to cache, and so is its output */
+        dircache_put(session->recording);
+        session->recording = NULL;
+
+        if (session->render_rec != NULL)
+          dircache_render_discard(session->render_rec);
+        session->render_rec = NULL;
       }
-      else
-        session->buffersize = 0;
+
+      if (list_entry(session, name, &st) != 0)
+        return LOOP_EXIT;
+
+      list_render_add(session, start, &st);
     }
-    session->bufferpos = 0;
+
+    /* check if the listing is complete */
+    if (session->buffersize == 0)
+      return session->render != NULL ? LOOP_CONTINUE : list_done(session);
   }
 
   /* send any pending data */
-  rc = send(session->data_fd, session->buffer + session->bufferpos,
-            session->buffersize - session->bufferpos, 0);
+  return list_send(session, session->buffer, &session->bufferpos, session->buffersize);
+}
+
+/*! keep the RETR read-ahead going
+ *
+ *  Collects a finished read and starts the next one while there is a free
+ *  buffer. Reads are issued one at a time so the file is read in order.
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 if a read failed
+ */
+static int
+retrieve_read_ahead(ftp_session_t *session)
+{
+  ssize_t rc;
+
+  while (true)
+  {
+    if (ftp_io_state(&session->io) == IO_DONE)
+    {
+      /* collect the finished read */
+      rc = ftp_io_complete(&session->io);
+      if (rc < 0)
+        return -1;
+
+      if (rc == 0)
+        session->read_eof = true;
+      else
+        session->chunks[session->chunks_filled++].size = rc;
+    }
+
+    if (session->read_eof || session->io.state != IO_IDLE || session->chunks_filled == session->read_depth)
+      return 0;
+
+    /* read into the next free buffer */
+    ftp_io_submit(session, &session->io, IO_READ,
+                  session->chunks[session->chunks_filled].data, xfer_chunk_size);
+  }
+}
+
+/*! send a file to the client
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+retrieve_transfer(ftp_session_t *session)
+{
+  ssize_t rc;
+  xfer_chunk_t chunk;
+  unsigned i;
+
+  if (retrieve_read_ahead(session) != 0)
+  {
+    /* can't read any more data */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 451, "Failed to read file\r\n");
+    return LOOP_EXIT;
+  }
+
+  if (session->chunks_filled == 0)
+  {
+    if (session->read_eof)
+    {
+      /* we have sent the whole file */
+      if (ftp_data_send_eof(session) != 0)
+        return LOOP_EXIT;
+
+      console_print(CYAN "sent %" PRIu64 " bytes in %" PRIu64 "ms, read-ahead depth %u, %u underruns, "
+                         "%u sends (%" PRIu64 " per MiB)\n" RESET,
+                    session->xfer_bytes, ftp_time_ms() - session->xfer_start,
+                    session->read_depth, session->underruns, session->sends,
+                    session->xfer_bytes ? ((uint64_t)session->sends << 20) / session->xfer_bytes : 0);
+
+      ftp_session_end_transfer(session);
+      ftp_send_response(session, 226, "OK\r\n");
+      return LOOP_EXIT;
+    }
+
+    if (session->xfer_bytes != 0)
+    {
+      /* the socket drained the read-ahead; read further ahead from now on */
+      ++session->underruns;
+      if (session->read_depth < read_ahead_max)
+      {
+        session->chunks[session->read_depth].data = xfer_chunk_alloc();
+        if (session->chunks[session->read_depth].data != NULL)
+          ++session->read_depth;
+      }
+    }
+
+    /* an I/O thread is filling the buffer */
+    session->flags |= SESSION_IO_WAIT;
+    return LOOP_EXIT;
+  }
+
+  /* offer the whole buffer, up to what the socket can ever hold; the socket
+   * takes as much as it has room for */
+  size_t send_size = session->chunks[0].size - session->bufferpos;
+  if (send_size > (size_t)send_buffersize)
+    send_size = send_buffersize;
+  ++session->sends;
+  rc = ftp_data_send(session, session->chunks[0].data + session->bufferpos, send_size);
   if (rc <= 0)
   {
     /* error sending data */
     if (rc < 0)
     {
-      if (errno == EWOULDBLOCK)
-        return LOOP_EXIT;
-      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+      if (errno == EWOULDBLOCK)
+        return LOOP_EXIT;
+      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
+    }
+    else
+      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    return LOOP_EXIT;
+  }
+
+  /* we can try to send more data */
+  session->bufferpos += rc;
+  session->xfer_bytes += rc;
+
+  if (session->bufferpos == session->chunks[0].size)
+  {
+    /* this buffer is sent; recycle it behind the others */
+    chunk = session->chunks[0];
+    for (i = 1; i < session->read_depth; ++i)
+      session->chunks[i - 1] = session->chunks[i];
+    session->chunks[session->read_depth - 1] = chunk;
+
+    --session->chunks_filled;
+    session->bufferpos = 0;
+  }
+
+  /* a short send means the send buffer is full; wait for POLLOUT instead of
+   * spending another call on EWOULDBLOCK */
+  if ((size_t)rc < send_size)
+    return LOOP_EXIT;
+
+  return LOOP_CONTINUE;
+}
+
+/*! set up the buffered RETR engine
+ *
+ *  @param[in] session ftp session
+ */
+static void
+retrieve_setup(ftp_session_t *session)
+{
+  session->transfer = retrieve_transfer;
+
+  /* double buffer from the start; more are added if the disk falls behind */
+  if (read_ahead_max > 1)
+  {
+    session->chunks[1].data = xfer_chunk_alloc();
+    if (session->chunks[1].data != NULL)
+      session->read_depth = 2;
+  }
+  session->chunks_filled = 0;
+  session->read_eof = false;
+  session->underruns = 0;
+}
+
+#ifdef HAVE_SENDFILE
+/*! send a file to the client straight from the file descriptor
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns whether to call again
+ */
+static loop_status_t
+retrieve_sendfile(ftp_session_t *session)
+{
+  ssize_t rc;
+  off_t offset = session->filepos;
+  int size = MAX_SOCK_BUFFERSIZE;
+
+  if (session->sends == 0)
+  {
+    /* sendfile stalls on delayed acks with a small send buffer */
+    rc = setsockopt(session->data_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    if (rc != 0)
+      console_print(RED "setsockopt: SO_SNDBUF %d %s\n" RESET, errno, strerror(errno));
+  }
+
+  ++session->sends;
+  rc = sendfile(session->data_fd, session->fd, &offset, SENDFILE_SIZE);
+  if (rc < 0)
+  {
+    if (errno == EWOULDBLOCK)
+      return LOOP_EXIT;
+
+    if ((errno == EINVAL || errno == ENOSYS || errno == ESPIPE) && session->xfer_bytes == 0)
+    {
+      /* this file can't be sent directly; copy it through the buffers */
+      console_print(YELLOW "sendfile: %d %s, using buffered transfer\n" RESET, errno, strerror(errno));
+      retrieve_setup(session);
+      return LOOP_CONTINUE;
     }
-    else
-      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
 
+    console_print(RED "sendfile: %d %s\n" RESET, errno, strerror(errno));
     ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
     ftp_send_response(session, 426, "Connection broken during transfer\r\n");
     return LOOP_EXIT;
   }
 
-  /* we can try to send more data */
-  session->bufferpos += rc;
+  if (rc == 0)
+  {
+    /* we have sent the whole file */
+    console_print(CYAN "sent %" PRIu64 " bytes in %" PRIu64 "ms with sendfile, "
+                       "%u sends (%" PRIu64 " per MiB)\n" RESET,
+                  session->xfer_bytes, ftp_time_ms() - session->xfer_start, session->sends,
+                  session->xfer_bytes ? ((uint64_t)session->sends << 20) / session->xfer_bytes : 0);
+
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 226, "OK\r\n");
+    return LOOP_EXIT;
+  }
+
+  session->filepos = offset;
+  session->xfer_bytes += rc;
+
+  /* a short send before the end of the file means the send buffer is full */
+  if (rc < SENDFILE_SIZE && session->filepos < session->filesize)
+    return LOOP_EXIT;
+
   return LOOP_CONTINUE;
 }
+#endif
 
 /*! send a file to the client
  *
@@ -2491,110 +6383,178 @@ list_transfer(ftp_session_t *session)
  *  @returns whether to call again
  */
 static loop_status_t
-retrieve_transfer(ftp_session_t *session)
+store_transfer(ftp_session_t *session)
 {
   ssize_t rc;
 
   if (session->bufferpos == session->buffersize)
   {
-    /* we have sent all the data so read some more */
-    rc = ftp_session_read_file(session);
+    /* we have written all the received data, so try to get some more */
+    rc = ftp_data_recv(session, session->chunks[0].data, xfer_chunk_size);
     if (rc <= 0)
     {
       /* can't read any more data */
-      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
       if (rc < 0)
-        ftp_send_response(session, 451, "Failed to read file\r\n");
-      else
+      {
+        if (errno == EWOULDBLOCK)
+          return LOOP_EXIT;
+        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+      }
+
+      if (rc == 0 && session->zstream != NULL && !session->zstream->end)
+      {
+        /* the compressed stream stopped before its end */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 451, "Compressed data ended early\r\n");
+        return LOOP_EXIT;
+      }
+
+      if (rc == 0 && session->untar != NULL && !tar_reader_done(session->untar))
+      {
+        /* the archive stopped in the middle of an entry */
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 451, "Archive ended early\r\n");
+        return LOOP_EXIT;
+      }
+
+      if (rc == 0)
+      {
+        console_print(CYAN "received %" PRIu64 " bytes in %" PRIu64 "ms\n" RESET,
+                      session->xfer_bytes, ftp_time_ms() - session->xfer_start);
+        ftp_session_end_transfer(session);
         ftp_send_response(session, 226, "OK\r\n");
+      }
+      else
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+      }
       return LOOP_EXIT;
     }
 
-    /* we read some data so reset the session buffer to send */
+    /* we received some data so reset the session buffer to write */
     session->bufferpos = 0;
     session->buffersize = rc;
+    session->xfer_bytes += rc;
   }
 
-  /* send any pending data */
-  size_t send_size = session->buffersize - session->bufferpos;
-  if (send_size > 0x1000)
-    send_size = 0x1000;
-  rc = send(session->data_fd, session->buffer + session->bufferpos,
-            send_size, 0);
-  if (rc <= 0)
+  /* write the received data */
+  if (session->io.state == IO_IDLE)
+    ftp_io_submit(session, &session->io, IO_WRITE, session->chunks[0].data + session->bufferpos,
+                  session->buffersize - session->bufferpos);
+
+  if (ftp_io_state(&session->io) != IO_DONE)
   {
-    /* error sending data */
-    if (rc < 0)
-    {
-      if (errno == EWOULDBLOCK)
-        return LOOP_EXIT;
-      console_print(RED "send: %d %s\n" RESET, errno, strerror(errno));
-    }
-    else
-      console_print(YELLOW "send: %d %s\n" RESET, ECONNRESET, strerror(ECONNRESET));
+    /* an I/O thread is draining the buffer */
+    session->flags |= SESSION_IO_WAIT;
+    return LOOP_EXIT;
+  }
 
+  rc = ftp_io_complete(&session->io);
+  if (rc <= 0)
+  {
+    /* error writing data */
     ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 426, "Connection broken during transfer\r\n");
+    ftp_send_response(session, 451, "Failed to write file\r\n");
     return LOOP_EXIT;
   }
 
-  /* we can try to send more data */
+  /* we can try to receive more data */
   session->bufferpos += rc;
   return LOOP_CONTINUE;
 }
 
-/*! send a file to the client
+#ifdef HAVE_SPLICE
+/*! receive a file from the client through a pipe
  *
  *  @param[in] session ftp session
  *
  *  @returns whether to call again
+ *
+ *  @note session->buffersize counts the bytes waiting in the pipe
  */
 static loop_status_t
-store_transfer(ftp_session_t *session)
+store_splice(ftp_session_t *session)
 {
   ssize_t rc;
+  size_t size;
+  loff_t offset = session->filepos;
 
-  if (session->bufferpos == session->buffersize)
+  if (session->buffersize == 0)
   {
-    /* we have written all the received data, so try to get some more */
-    rc = recv(session->data_fd, session->buffer, sizeof(session->buffer), 0);
+    /* the first batch fits in the transfer buffer in case the file can't take it */
+    size = session->xfer_bytes == 0 ? xfer_chunk_size : SPLICE_SIZE;
+
+    rc = splice(session->data_fd, NULL, session->splice_pipe[1], NULL, size,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
     if (rc <= 0)
     {
-      /* can't read any more data */
       if (rc < 0)
       {
         if (errno == EWOULDBLOCK)
           return LOOP_EXIT;
-        console_print(RED "recv: %d %s\n" RESET, errno, strerror(errno));
+
+        if ((errno == EINVAL || errno == ENOSYS) && session->xfer_bytes == 0)
+        {
+          /* this socket can't be spliced; nothing has been consumed yet */
+          console_print(YELLOW "splice: %d %s, using buffered transfer\n" RESET, errno, strerror(errno));
+          session->transfer = store_transfer;
+          return LOOP_CONTINUE;
+        }
+
+        console_print(RED "splice: %d %s\n" RESET, errno, strerror(errno));
       }
 
       ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
 
       if (rc == 0)
+      {
+        console_print(CYAN "received %" PRIu64 " bytes in %" PRIu64 "ms with splice\n" RESET,
+                      session->xfer_bytes, ftp_time_ms() - session->xfer_start);
         ftp_send_response(session, 226, "OK\r\n");
+      }
       else
         ftp_send_response(session, 426, "Connection broken during transfer\r\n");
       return LOOP_EXIT;
     }
 
-    /* we received some data so reset the session buffer to write */
-    session->bufferpos = 0;
     session->buffersize = rc;
+    session->xfer_bytes += rc;
+  }
+
+  /* move the pipe contents into the file */
+  rc = splice(session->splice_pipe[0], NULL, session->fd, &offset,
+              session->buffersize, SPLICE_F_MOVE);
+  if (rc < 0 && errno == EINVAL && session->xfer_bytes == session->buffersize)
+  {
+    /* this file can't be spliced to; write the first batch the usual way */
+    console_print(YELLOW "splice: %d %s, using buffered transfer\n" RESET, errno, strerror(errno));
+    rc = read(session->splice_pipe[0], session->chunks[0].data, session->buffersize);
+    if (rc == (ssize_t)session->buffersize)
+    {
+      session->bufferpos = 0;
+      session->transfer = store_transfer;
+      return LOOP_CONTINUE;
+    }
   }
 
-  rc = ftp_session_write_file(session);
   if (rc <= 0)
   {
     /* error writing data */
+    if (rc < 0)
+      console_print(RED "splice: %d %s\n" RESET, errno, strerror(errno));
     ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
     ftp_send_response(session, 451, "Failed to write file\r\n");
     return LOOP_EXIT;
   }
 
-  /* we can try to receive more data */
-  session->bufferpos += rc;
+  session->filepos += rc;
+  session->buffersize -= rc;
+  ftp_session_grow_file(session);
+
   return LOOP_CONTINUE;
 }
+#endif
 
 /*! ftp_xfer_file mode */
 typedef enum
@@ -2602,8 +6562,63 @@ typedef enum
   XFER_FILE_RETR, /*!< Retrieve a file */
   XFER_FILE_STOR, /*!< Store a file */
   XFER_FILE_APPE, /*!< Append a file */
+  XFER_FILE_UNTAR, /*!< Extract a tar archive into a directory */
 } xfer_file_mode_t;
 
+/*! get the data connection for a transfer
+ *
+ *  In MODE B the connection kept from the last transfer is used again;
+ *  otherwise one is made from the preceding PORT or PASV.
+ *
+ *  @param[in] session ftp session
+ *
+ *  @returns -1 for failure, which ends the transfer
+ */
+static int
+ftp_session_open_data(ftp_session_t *session)
+{
+  int rc;
+
+  memset(&session->block, 0, sizeof(session->block));
+  session->block.on = session->mode_b;
+
+  if (session->block_fd >= 0)
+  {
+    session->data_fd = session->block_fd;
+    session->block_fd = -1;
+
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV);
+    ftp_send_response(session, 125, "Using open data connection\r\n");
+    return 0;
+  }
+
+  if (!(session->flags & (SESSION_PORT | SESSION_PASV)))
+  {
+    /* we must have got a transfer command without a preceding PORT or PASV */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+    return -1;
+  }
+
+  ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
+  session->connect_deadline = ftp_time_ms() + DATA_CONNECT_TIMEOUT;
+
+  if (session->flags & SESSION_PORT)
+  {
+    /* setup connection */
+    rc = ftp_session_connect(session);
+    if (rc != 0)
+    {
+      /* error connecting */
+      ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+      ftp_send_response(session, 425, "can't open data connection\r\n");
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
 /*! Transfer a file
  *
  *  @param[in] session ftp session
@@ -2619,6 +6634,10 @@ ftp_xfer_file(ftp_session_t *session,
 {
   int rc;
 
+  /* wait for a transfer buffer if they are all in use */
+  if (!ftp_session_lease(session))
+    return;
+
   /* build the path of the file to transfer */
   if (build_path(session, session->cwd, args) != 0)
   {
@@ -2631,6 +6650,8 @@ ftp_xfer_file(ftp_session_t *session,
   /* open the file for retrieving or storing */
   if (mode == XFER_FILE_RETR)
     rc = ftp_session_open_file_read(session);
+  else if (mode == XFER_FILE_UNTAR)
+    rc = ftp_session_open_untar(session);
   else
     rc = ftp_session_open_file_write(session, mode == XFER_FILE_APPE);
 
@@ -2642,44 +6663,60 @@ ftp_xfer_file(ftp_session_t *session,
     return;
   }
 
-  if (session->flags & (SESSION_PORT | SESSION_PASV))
+  if (ftp_session_zstream_start(session, mode == XFER_FILE_RETR) != 0)
   {
-    ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 451, "Insufficient memory\r\n");
+    return;
+  }
 
-    if (session->flags & SESSION_PORT)
-    {
-      /* setup connection */
-      rc = ftp_session_connect(session);
-      if (rc != 0)
-      {
-        /* error connecting */
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 425, "can't open data connection\r\n");
-        return;
-      }
-    }
+  /* the leased buffer is the first transfer buffer */
+  session->chunks[0].data = session->lease;
+  session->read_depth = 1;
 
-    /* set up the transfer */
-    session->flags &= ~(SESSION_RECV | SESSION_SEND);
-    if (mode == XFER_FILE_RETR)
-    {
-      session->flags |= SESSION_SEND;
-      session->transfer = retrieve_transfer;
-    }
-    else
+  if (ftp_session_open_data(session) != 0)
+    return;
+
+  /* set up the transfer */
+  session->flags &= ~(SESSION_RECV | SESSION_SEND);
+  if (mode == XFER_FILE_RETR)
+  {
+    session->flags |= SESSION_SEND;
+    session->sends = 0;
+
+    /* MODE B marks where a plain file can be resumed from */
+    if (session->block.on && session->tar == NULL && session->zstream == NULL)
     {
-      session->flags |= SESSION_RECV;
-      session->transfer = store_transfer;
+      session->block.base = session->filepos;
+      session->block.next_mark = BLOCK_MARK_INTERVAL;
     }
 
-    session->bufferpos = 0;
-    session->buffersize = 0;
-
-    return;
+#ifdef HAVE_SENDFILE
+    /* archives, compressed data and blocks are made in the transfer buffers */
+    if (session->tar == NULL && session->zstream == NULL && !session->block.on)
+      session->transfer = retrieve_sendfile;
+    else
+      retrieve_setup(session);
+#else
+    retrieve_setup(session);
+#endif
+  }
+  else
+  {
+    session->flags |= SESSION_RECV;
+    session->transfer = store_transfer;
+#ifdef HAVE_SPLICE
+    /* archives, compressed data and blocks are taken apart in the transfer buffers */
+    if (session->untar == NULL && session->zstream == NULL && !session->block.on &&
+        pipe(session->splice_pipe) == 0)
+      session->transfer = store_splice;
+#endif
   }
 
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-  ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+  session->bufferpos = 0;
+  session->buffersize = 0;
+  session->xfer_bytes = 0;
+  session->xfer_start = ftp_time_ms();
 }
 
 /*! Transfer a directory
@@ -2693,13 +6730,20 @@ static void
 ftp_xfer_dir(ftp_session_t *session,
              const char *args,
              xfer_dir_mode_t mode,
-             bool workaround)
+             bool workaround,
+             bool recursive)
 {
   ssize_t rc;
   size_t len;
   struct stat st;
   char *buffer;
 
+  /* wait for a listing buffer if they are all in use */
+  if (!ftp_session_lease(session))
+    return;
+  session->buffer = session->lease;
+  session->lwd = session->lease + XFER_BUFFERSIZE;
+
   /* set up the transfer */
   session->dir_mode = mode;
   session->flags &= ~SESSION_RECV;
@@ -2721,8 +6765,9 @@ ftp_xfer_dir(ftp_session_t *session,
     }
 
     /* check if this is a directory */
-    session->dp = opendir(session->buffer);
-    if (session->dp == NULL)
+    if (!list_cached(session, session->buffer))
+      session->dp = opendir(session->buffer);
+    if (session->dp == NULL && session->listing == NULL)
     {
       /* not a directory; check if it is a file */
       rc = stat(session->buffer, &st);
@@ -2737,14 +6782,14 @@ ftp_xfer_dir(ftp_session_t *session,
           if (args[0] == '-' && (args[1] == 'a' || args[1] == 'l'))
           {
             if (args[2] == 0)
-              buffer = strdup(args + 2);
+              buffer = path_dup(args + 2);
             else
-              buffer = strdup(args + 3);
+              buffer = path_dup(args + 3);
 
             if (buffer != NULL)
             {
-              ftp_xfer_dir(session, buffer, mode, false);
-              free(buffer);
+              ftp_xfer_dir(session, buffer, mode, false, recursive);
+              path_free(buffer);
               return;
             }
 
@@ -2780,8 +6825,9 @@ ftp_xfer_dir(ftp_session_t *session,
 
       if (buffer)
       {
+        session->buffersize = 0;
         rc = ftp_session_fill_dirent(session, &st, buffer, len);
-        free(buffer);
+        path_free(buffer);
       }
       else
         rc = ENOMEM;
@@ -2796,80 +6842,317 @@ ftp_xfer_dir(ftp_session_t *session,
     else
     {
       /* it was a directory, so set it as the lwd */
+      if (session->buffersize >= LWD_BUFFERSIZE)
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 550, "%s\r\n", strerror(ENAMETOOLONG));
+        return;
+      }
       memcpy(session->lwd, session->buffer, session->buffersize);
       session->lwd[session->buffersize] = 0;
       session->buffersize = 0;
 
       if (session->dir_mode == XFER_DIR_MLSD && (session->mlst_flags & SESSION_MLST_TYPE))
       {
-        /* send this directory as type=cdir */
-        rc = ftp_session_fill_dirent_cdir(session, session->lwd);
-        if (rc != 0)
-        {
-          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-          ftp_send_response(session, 550, "%s\r\n", strerror(rc));
-          return;
-        }
+        /* send this directory as type=cdir */
+        rc = ftp_session_fill_dirent_cdir(session, session->lwd);
+        if (rc != 0)
+        {
+          ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+          ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+          return;
+        }
+      }
+    }
+  }
+  else if (!list_cached(session, session->cwd) && ftp_session_open_cwd(session) != 0)
+  {
+    /* no argument, but opening cwd failed */
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    return;
+  }
+  else
+  {
+    /* set the cwd as the lwd */
+    strcpy(session->lwd, session->cwd);
+    session->buffersize = 0;
+
+    if (session->dir_mode == XFER_DIR_MLSD && (session->mlst_flags & SESSION_MLST_TYPE))
+    {
+      /* send this directory as type=cdir */
+      rc = ftp_session_fill_dirent_cdir(session, session->lwd);
+      if (rc != 0)
+      {
+        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
+        return;
+      }
+    }
+  }
+
+  /* list the tree below a directory; a file is listed on its own */
+  if (recursive && (session->dp != NULL || session->listing != NULL) &&
+      list_tree_start(session) != 0)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 451, "Insufficient memory\r\n");
+    return;
+  }
+
+  list_start(session);
+
+  if (mode == XFER_DIR_MLST || mode == XFER_DIR_STAT)
+  {
+    /* this is a little different; we have to send the data over the command socket */
+    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV | CLOSE_DATA);
+    session->data_fd = session->cmd_fd;
+    session->flags |= SESSION_SEND;
+    ftp_send_response(session, -213, "Status\r\n");
+    return;
+  }
+
+  if (ftp_session_zstream_start(session, true) != 0)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+    ftp_send_response(session, 451, "Insufficient memory\r\n");
+    return;
+  }
+
+  ftp_session_open_data(session);
+}
+
+/*! checksum a file
+ *
+ *  The I/O threads read and hash the file a buffer at a time; nothing goes
+ *  over the data connection. The session stays in COMMAND_STATE, with
+ *  SESSION_HASH holding back further commands until the reply is sent.
+ *
+ *  @param[in] session ftp session
+ */
+static void
+ftp_session_hash(ftp_session_t *session)
+{
+  ssize_t rc;
+  size_t len;
+  uint64_t start;
+  char hex[HASH_HEX_SIZE], *path;
+
+  session->flags &= ~SESSION_IO_WAIT;
+
+  while (ftp_io_state(&session->io) == IO_DONE)
+  {
+    rc = ftp_io_complete(&session->io);
+    if (rc < 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, 0);
+      ftp_send_response(session, 451, "Failed to read file\r\n");
+      return;
+    }
+
+    if (rc == 0)
+    {
+      /* the whole range is hashed */
+      start = session->filepos - session->hash.length;
+      console_print(CYAN "hashed %" PRIu64 " bytes in %" PRIu64 "ms\n" RESET,
+                    session->hash.length, ftp_time_ms() - session->xfer_start);
+
+      hash_final(&session->hash, hex);
+      if (session->hash_path == NULL)
+        ftp_send_response(session, 250, "%s\r\n", hex);
+      else
+      {
+        /* HASH names the algorithm, the range and the file too */
+        ftp_send_response(session, 213, "%s %" PRIu64 "-%" PRIu64 " %s ",
+                          hash_name(session->hash.algo), start,
+                          session->filepos - (session->hash.length != 0), hex);
+
+        len = strlen(session->hash_path);
+        path = encode_path(session->hash_path, &len, false);
+        if (path != NULL)
+          ftp_send_response_buffer(session, path, len);
+        else
+          ftp_send_response_buffer(session, session->hash_path, len);
+        path_free(path);
+
+        ftp_send_response_buffer(session, "\r\n", 2);
       }
+
+      ftp_session_set_state(session, COMMAND_STATE, 0);
+      return;
     }
+
+    /* without I/O threads the next read is done right away */
+    ftp_io_submit(session, &session->io, IO_HASH, session->chunks[0].data, xfer_chunk_size);
   }
-  else if (ftp_session_open_cwd(session) != 0)
+
+  session->flags |= SESSION_IO_WAIT;
+}
+
+/*! checksum a file, or part of it
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    path of the file
+ *  @param[in] algo    algorithm
+ *  @param[in] start   first byte
+ *  @param[in] end     where to stop, or 0 for the end of the file
+ *  @param[in] name    name to show in a HASH reply, or NULL for an XCRC style
+ *                     one
+ */
+static void
+ftp_xfer_hash(ftp_session_t *session,
+              const char *args,
+              hash_algo_t algo,
+              uint64_t start,
+              uint64_t end,
+              const char *name)
+{
+  int rc;
+
+  /* wait for a transfer buffer if they are all in use */
+  if (!ftp_session_lease(session))
+    return;
+
+  /* build the path of the file to hash */
+  if (build_path(session, session->cwd, args) != 0)
   {
-    /* no argument, but opening cwd failed */
-    ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-    ftp_send_response(session, 550, "%s\r\n", strerror(errno));
+    rc = errno;
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 553, "%s\r\n", strerror(rc));
     return;
   }
-  else
+
+  /* a directory would be opened as an archive; that can't be hashed */
+  if (ftp_session_open_file_read(session) != 0 || session->tar != NULL)
   {
-    /* set the cwd as the lwd */
-    strcpy(session->lwd, session->cwd);
-    session->buffersize = 0;
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 550, "failed to open file\r\n");
+    return;
+  }
 
-    if (session->dir_mode == XFER_DIR_MLSD && (session->mlst_flags & SESSION_MLST_TYPE))
+  if (end == 0 || end > session->filesize)
+    end = session->filesize;
+  if (start > end)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 554, "Invalid range\r\n");
+    return;
+  }
+
+  if (name != NULL)
+  {
+    session->hash_path = path_dup(name);
+    if (session->hash_path == NULL)
     {
-      /* send this directory as type=cdir */
-      rc = ftp_session_fill_dirent_cdir(session, session->lwd);
-      if (rc != 0)
-      {
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 550, "%s\r\n", strerror(rc));
-        return;
-      }
+      ftp_session_set_state(session, COMMAND_STATE, 0);
+      ftp_send_response(session, 451, "Insufficient memory\r\n");
+      return;
     }
   }
 
-  if (mode == XFER_DIR_MLST || mode == XFER_DIR_STAT)
+  /* the leased buffer is the read buffer */
+  session->chunks[0].data = session->lease;
+  session->read_depth = 1;
+
+  hash_init(&session->hash, algo);
+  session->filepos = start;
+  session->hash_end = end;
+  session->xfer_start = ftp_time_ms();
+
+  /* a PASV or PORT made for a later transfer is kept */
+  session->flags |= SESSION_HASH;
+  ftp_io_submit(session, &session->io, IO_HASH, session->chunks[0].data, xfer_chunk_size);
+  ftp_session_hash(session);
+}
+
+/*! checksum a file for XCRC and friends
+ *
+ *  They take a path, then optionally where to start and where to stop, e.g.
+ *  XCRC "name with spaces" 0 1048576. An unquoted path ends before the
+ *  trailing numbers.
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ *  @param[in] algo    algorithm
+ */
+static void
+ftp_xfer_xhash(ftp_session_t *session,
+               const char *args,
+               hash_algo_t algo)
+{
+  uint64_t range[2] = {0, 0};
+  const char *p, *q, *end;
+  char *path;
+  unsigned count = 0, i;
+
+  if (args[0] == '"')
   {
-    /* this is a little different; we have to send the data over the command socket */
-    ftp_session_set_state(session, DATA_TRANSFER_STATE, CLOSE_PASV | CLOSE_DATA);
-    session->data_fd = session->cmd_fd;
-    session->flags |= SESSION_SEND;
-    ftp_send_response(session, -213, "Status\r\n");
-    return;
+    /* the path is quoted; only numbers may follow it */
+    end = strchr(args + 1, '"');
+    if (end == NULL)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, 0);
+      ftp_send_response(session, 501, "Syntax error in arguments\r\n");
+      return;
+    }
+
+    for (p = end + 1; *p == ' '; ++p)
+      ;
+    while (*p != 0 && count < 2)
+    {
+      for (q = p; isdigit((int)*q); ++q)
+        ;
+      if (q == p || (*q != 0 && *q != ' '))
+        break;
+      range[count++] = strtoull(p, NULL, 10);
+      for (p = q; *p == ' '; ++p)
+        ;
+    }
+
+    if (*p != 0)
+    {
+      ftp_session_set_state(session, COMMAND_STATE, 0);
+      ftp_send_response(session, 501, "Syntax error in arguments\r\n");
+      return;
+    }
+
+    ++args;
   }
-  else if (session->flags & (SESSION_PORT | SESSION_PASV))
+  else
   {
-    ftp_session_set_state(session, DATA_CONNECT_STATE, CLOSE_DATA);
+    /* take up to two numbers off the end */
+    end = args + strlen(args);
+    while (count < 2)
+    {
+      for (q = end; q > args && isdigit((int)q[-1]); --q)
+        ;
+      if (q == end || q - 1 <= args || q[-1] != ' ')
+        break;
+      ++count;
+      end = q - 1;
+    }
 
-    if (session->flags & SESSION_PORT)
+    /* they were taken off last first */
+    for (p = end, i = 0; i < count; ++i)
     {
-      /* setup connection */
-      rc = ftp_session_connect(session);
-      if (rc != 0)
-      {
-        /* error connecting */
-        ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-        ftp_send_response(session, 425, "can't open data connection\r\n");
-      }
+      while (*p == ' ')
+        ++p;
+      range[i] = strtoull(p, (char **)&p, 10);
     }
+  }
 
+  path = path_alloc(end - args + 1);
+  if (path == NULL)
+  {
+    ftp_session_set_state(session, COMMAND_STATE, 0);
+    ftp_send_response(session, 451, "Insufficient memory\r\n");
     return;
   }
+  memcpy(path, args, end - args);
+  path[end - args] = 0;
 
-  /* we must have got LIST/MLSD/MLST/NLST without a preceding PORT or PASV */
-  ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
-  ftp_send_response(session, 503, "Bad sequence of commands\r\n");
+  ftp_xfer_hash(session, path, algo, range[0], range[1], NULL);
+  path_free(path);
 }
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
@@ -2889,13 +7172,13 @@ FTP_DECLARE(ABOR)
 {
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  if (session->state == COMMAND_STATE)
+  if (session->state == COMMAND_STATE && !(session->flags & (SESSION_LEASE_WAIT | SESSION_HASH)))
   {
     ftp_send_response(session, 225, "No transfer to abort\r\n");
     return;
   }
 
-  /* abort the transfer */
+  /* abort the transfer or checksum, or leave the lease queue */
   ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
 
   /* send response for this request */
@@ -2938,6 +7221,34 @@ FTP_DECLARE(APPE)
   ftp_xfer_file(session, args, XFER_FILE_APPE);
 }
 
+/*! @fn static void AVBL(ftp_session_t *session, const char *args)
+ *
+ *  @brief get the available space
+ *
+ *  @note The value is tracked from uploads and deletes, and checked with
+ *        statvfs after transfers and periodically while it changes.
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(AVBL)
+{
+  int64_t bytes;
+
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  bytes = get_free_space();
+  if (bytes < 0)
+  {
+    ftp_send_response(session, 550, "Could not get free space.\r\n");
+    return;
+  }
+
+  ftp_send_response(session, 213, "%" PRId64 "\r\n", bytes);
+}
+
 /*! @fn static void CDUP(ftp_session_t *session, const char *args)
  *
  *  @brief CWD to parent directory
@@ -2967,6 +7278,7 @@ FTP_DECLARE(CDUP)
 FTP_DECLARE(CWD)
 {
   struct stat st;
+  char *cwd;
   int rc;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
@@ -3004,8 +7316,22 @@ FTP_DECLARE(CWD)
     return;
   }
 
+  /* listings copy the cwd into the lwd */
+  if (session->buffersize >= LWD_BUFFERSIZE)
+  {
+    ftp_send_response(session, 553, "%s\r\n", strerror(ENAMETOOLONG));
+    return;
+  }
+
   /* copy the path into the cwd */
-  strncpy(session->cwd, session->buffer, sizeof(session->cwd));
+  cwd = path_dup(session->buffer);
+  if (cwd == NULL)
+  {
+    ftp_send_response(session, 451, "Insufficient memory\r\n");
+    return;
+  }
+  path_free(session->cwd);
+  session->cwd = cwd;
 
   ftp_send_response(session, 200, "OK\r\n");
 }
@@ -3020,6 +7346,7 @@ FTP_DECLARE(CWD)
 FTP_DECLARE(DELE)
 {
   int rc;
+  struct stat st;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
@@ -3032,6 +7359,10 @@ FTP_DECLARE(DELE)
     return;
   }
 
+  /* remember how much space the file gives back */
+  if (lstat(session->buffer, &st) != 0)
+    st.st_size = 0;
+
   /* try to unlink the path */
   rc = unlink(session->buffer);
   if (rc != 0)
@@ -3042,7 +7373,8 @@ FTP_DECLARE(DELE)
     return;
   }
 
-  update_free_space();
+  adjust_free_space(-(int64_t)st.st_size);
+  dircache_invalidate(session->buffer);
   ftp_send_response(session, 250, "OK\r\n");
 }
 
@@ -3061,19 +7393,47 @@ FTP_DECLARE(FEAT)
 
   /* list our features */
   ftp_send_response(session, -211, "\r\n"
+                                   " AVBL\r\n"
+                                   " HASH SHA-1%s;SHA-256%s;MD5%s;CRC32%s\r\n"
                                    " MDTM\r\n"
                                    " MLST Type%s;Size%s;Modify%s;Perm%s;UNIX.mode%s;\r\n"
+                                   "%s"
                                    " PASV\r\n"
+                                   " SITE MLSDR\r\n"
+                                   " SITE UNTAR\r\n"
                                    " SIZE\r\n"
                                    " TVFS\r\n"
                                    " UTF8\r\n"
+                                   " XCRC\r\n"
+                                   " XMD5\r\n"
+                                   " XSHA1\r\n"
+                                   " XSHA256\r\n"
                                    "\r\n"
                                    "211 End\r\n",
+                    session->hash_algo == HASH_SHA1 ? "*" : "",
+                    session->hash_algo == HASH_SHA256 ? "*" : "",
+                    session->hash_algo == HASH_MD5 ? "*" : "",
+                    session->hash_algo == HASH_CRC32 ? "*" : "",
                     session->mlst_flags & SESSION_MLST_TYPE ? "*" : "",
                     session->mlst_flags & SESSION_MLST_SIZE ? "*" : "",
                     session->mlst_flags & SESSION_MLST_MODIFY ? "*" : "",
                     session->mlst_flags & SESSION_MLST_PERM ? "*" : "",
-                    session->mlst_flags & SESSION_MLST_UNIX_MODE ? "*" : "");
+                    session->mlst_flags & SESSION_MLST_UNIX_MODE ? "*" : "",
+                    deflate_level != 0 ? " MODE Z\r\n" : "");
+}
+
+/*! @fn static void HASH(ftp_session_t *session, const char *args)
+ *
+ *  @brief checksum a file with the algorithm chosen by OPTS HASH
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(HASH)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_xfer_hash(session, args, session->hash_algo, 0, 0, args);
 }
 
 /*! @fn static void HELP(ftp_session_t *session, const char *args)
@@ -3092,9 +7452,10 @@ FTP_DECLARE(HELP)
   /* list our accepted commands */
   ftp_send_response(session, -214,
                     "The following commands are recognized\r\n"
-                    " ABOR ALLO APPE CDUP CWD DELE FEAT HELP LIST MDTM MKD MLSD MLST MODE\r\n"
-                    " NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR RNTO STAT\r\n"
-                    " STOR STOU STRU SYST TYPE USER XCUP XCWD XMKD XPWD XRMD\r\n"
+                    " ABOR ALLO APPE AVBL CDUP CWD DELE FEAT HASH HELP LIST MDTM MKD MLSD\r\n"
+                    " MLST MODE NLST NOOP OPTS PASS PASV PORT PWD QUIT REST RETR RMD RNFR\r\n"
+                    " RNTO SITE STAT STOR STOU STRU SYST TYPE USER XCRC XCUP XCWD XMD5 XMKD\r\n"
+                    " XPWD XRMD XSHA1 XSHA256\r\n"
                     "214 End\r\n");
 }
 
@@ -3109,10 +7470,30 @@ FTP_DECLARE(HELP)
  */
 FTP_DECLARE(LIST)
 {
+  const char *p;
+  bool recursive = false;
+
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
+  /* LIST -R lists the whole tree; the other ls options are ignored */
+  if (args[0] == '-')
+  {
+    for (p = args + 1; *p != 0 && *p != ' '; ++p)
+    {
+      if (*p == 'R')
+        recursive = true;
+    }
+
+    if (recursive)
+    {
+      while (*p == ' ')
+        ++p;
+      args = p;
+    }
+  }
+
   /* open the path in LIST mode */
-  ftp_xfer_dir(session, args, XFER_DIR_LIST, true);
+  ftp_xfer_dir(session, args, XFER_DIR_LIST, true, recursive);
 }
 
 /*! @fn static void MDTM(ftp_session_t *session, const char *args)
@@ -3131,7 +7512,7 @@ FTP_DECLARE(MDTM)
   struct stat st;
 #endif
   time_t t_mtime;
-  struct tm *tm;
+  struct tm tm_buf, *tm;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
@@ -3162,14 +7543,14 @@ FTP_DECLARE(MDTM)
   t_mtime = st.st_mtime;
 #endif
 
-  tm = gmtime(&t_mtime);
+  tm = gmtime_r(&t_mtime, &tm_buf);
   if (tm == NULL)
   {
     ftp_send_response(session, 550, "Error getting mtime\r\n");
     return;
   }
 
-  session->buffersize = strftime(session->buffer, sizeof(session->buffer), "%Y%m%d%H%M%S", tm);
+  session->buffersize = strftime(session->buffer, XFER_BUFFERSIZE, "%Y%m%d%H%M%S", tm);
   if (session->buffersize == 0)
   {
     ftp_send_response(session, 550, "Error getting mtime\r\n");
@@ -3212,7 +7593,8 @@ FTP_DECLARE(MKD)
     return;
   }
 
-  update_free_space();
+  dircache_invalidate(session->buffer);
+
   ftp_send_response(session, 250, "OK\r\n");
 }
 
@@ -3228,7 +7610,7 @@ FTP_DECLARE(MLSD)
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   /* open the path in MLSD mode */
-  ftp_xfer_dir(session, args, XFER_DIR_MLSD, true);
+  ftp_xfer_dir(session, args, XFER_DIR_MLSD, true, false);
 }
 
 /*! @fn static void MLST(ftp_session_t *session, const char *args)
@@ -3274,15 +7656,16 @@ FTP_DECLARE(MLST)
   }
 
   session->dir_mode = XFER_DIR_MLST;
+  session->buffersize = 0;
   rc = ftp_session_fill_dirent(session, &st, path, len);
-  free(path);
+  path_free(path);
   if (rc != 0)
   {
     ftp_send_response(session, 550, "%s\r\n", strerror(errno));
     return;
   }
 
-  path = malloc(session->buffersize + 1);
+  path = path_alloc(session->buffersize + 1);
   if (!path)
   {
     ftp_send_response(session, 550, "%s\r\n", strerror(ENOMEM));
@@ -3292,7 +7675,7 @@ FTP_DECLARE(MLST)
   memcpy(path, session->buffer, session->buffersize);
   path[session->buffersize] = 0;
   ftp_send_response(session, -250, "Status\r\n%s250 End\r\n", path);
-  free(path);
+  path_free(path);
 }
 
 /*! @fn static void MODE(ftp_session_t *session, const char *args)
@@ -3308,9 +7691,31 @@ FTP_DECLARE(MODE)
 
   ftp_session_set_state(session, COMMAND_STATE, 0);
 
-  /* we only accept S (stream) mode */
+  /* we accept S (stream) mode, B (block) mode, and Z (deflate) mode unless
+   * it is off; only block mode keeps the data connection between transfers
+   */
   if (strcasecmp(args, "S") == 0)
   {
+    session->mode_z = false;
+    session->mode_b = false;
+    ftp_session_close_block(session);
+    ftp_send_response(session, 200, "OK\r\n");
+    return;
+  }
+
+  if (strcasecmp(args, "B") == 0)
+  {
+    session->mode_z = false;
+    session->mode_b = true;
+    ftp_send_response(session, 200, "OK\r\n");
+    return;
+  }
+
+  if (strcasecmp(args, "Z") == 0 && deflate_level != 0)
+  {
+    session->mode_z = true;
+    session->mode_b = false;
+    ftp_session_close_block(session);
     ftp_send_response(session, 200, "OK\r\n");
     return;
   }
@@ -3332,7 +7737,7 @@ FTP_DECLARE(NLST)
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
   /* open the path in NLST mode */
-  return ftp_xfer_dir(session, args, XFER_DIR_NLST, false);
+  return ftp_xfer_dir(session, args, XFER_DIR_NLST, false, false);
 }
 
 /*! @fn static void NOOP(ftp_session_t *session, const char *args)
@@ -3370,6 +7775,25 @@ FTP_DECLARE(OPTS)
     return;
   }
 
+  /* HASH shows or picks its algorithm */
+  if (strcasecmp(args, "HASH") == 0)
+  {
+    ftp_send_response(session, 200, "%s\r\n", hash_name(session->hash_algo));
+    return;
+  }
+
+  if (strncasecmp(args, "HASH ", 5) == 0)
+  {
+    if (!hash_lookup(args + 5, &session->hash_algo))
+    {
+      ftp_send_response(session, 501, "Unknown algorithm\r\n");
+      return;
+    }
+
+    ftp_send_response(session, 200, "%s\r\n", hash_name(session->hash_algo));
+    return;
+  }
+
   /* check MLST options */
   if (strncasecmp(args, "MLST ", 5) == 0)
   {
@@ -3469,8 +7893,9 @@ FTP_DECLARE(PASV)
 
   memset(buffer, 0, sizeof(buffer));
 
-  /* reset the state */
+  /* reset the state; a new data connection replaces a kept one */
   ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  ftp_session_close_block(session);
   session->flags &= ~(SESSION_PASV | SESSION_PORT);
 
   /* create a socket to listen on */
@@ -3578,12 +8003,13 @@ FTP_DECLARE(PORT)
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
 
-  /* reset the state */
+  /* reset the state; a new data connection replaces a kept one */
   ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
+  ftp_session_close_block(session);
   session->flags &= ~(SESSION_PASV | SESSION_PORT);
 
   /* dup the args since they are const and we need to change it */
-  addrstr = strdup(args);
+  addrstr = path_dup(args);
   if (addrstr == NULL)
   {
     ftp_send_response(session, 425, "%s\r\n", strerror(ENOMEM));
@@ -3609,7 +8035,7 @@ FTP_DECLARE(PORT)
   /* make sure we got the right number of values */
   if (commas != 5)
   {
-    free(addrstr);
+    path_free(addrstr);
     ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
     return;
   }
@@ -3618,7 +8044,7 @@ FTP_DECLARE(PORT)
   rc = inet_aton(addrstr, &addr.sin_addr);
   if (rc == 0)
   {
-    free(addrstr);
+    path_free(addrstr);
     ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
     return;
   }
@@ -3632,7 +8058,7 @@ FTP_DECLARE(PORT)
     {
       if (p == portstr || *p != '.' || val > 0xFF)
       {
-        free(addrstr);
+        path_free(addrstr);
         ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
         return;
       }
@@ -3650,7 +8076,7 @@ FTP_DECLARE(PORT)
   /* validate the port */
   if (val > 0xFF || port > 0xFF)
   {
-    free(addrstr);
+    path_free(addrstr);
     ftp_send_response(session, 501, "%s\r\n", strerror(EINVAL));
     return;
   }
@@ -3661,7 +8087,7 @@ FTP_DECLARE(PORT)
   addr.sin_family = AF_INET;
   addr.sin_port = htons(port);
 
-  free(addrstr);
+  path_free(addrstr);
 
   memcpy(&session->peer_addr, &addr, sizeof(addr));
 
@@ -3679,8 +8105,8 @@ FTP_DECLARE(PORT)
  */
 FTP_DECLARE(PWD)
 {
-  static char buffer[CMD_BUFFERSIZE];
-  size_t len = sizeof(buffer), i;
+  char *buffer = session->worker->response;
+  size_t len, i;
   char *path;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
@@ -3693,17 +8119,17 @@ FTP_DECLARE(PWD)
   if (path != NULL)
   {
     i = sprintf(buffer, "257 \"");
-    if (i + len + 3 > sizeof(buffer))
+    if (i + len + 3 > sizeof(session->worker->response))
     {
       /* buffer will overflow */
-      free(path);
+      path_free(path);
       ftp_session_set_state(session, COMMAND_STATE, CLOSE_PASV | CLOSE_DATA);
       ftp_send_response(session, 550, "unavailable\r\n");
       ftp_send_response(session, 425, "%s\r\n", strerror(EOVERFLOW));
       return;
     }
     memcpy(buffer + i, path, len);
-    free(path);
+    path_free(path);
     len += i;
     buffer[len++] = '"';
     buffer[len++] = '\r';
@@ -3837,7 +8263,8 @@ FTP_DECLARE(RMD)
     return;
   }
 
-  update_free_space();
+  dircache_invalidate_tree(session->buffer);
+
   ftp_send_response(session, 250, "OK\r\n");
 }
 
@@ -3875,6 +8302,15 @@ FTP_DECLARE(RNFR)
     return;
   }
 
+  /* keep the path for RNTO */
+  path_free(session->rnfr);
+  session->rnfr = path_dup(session->buffer);
+  if (session->rnfr == NULL)
+  {
+    ftp_send_response(session, 451, "%s\r\n", strerror(ENOMEM));
+    return;
+  }
+
   /* we are ready for RNTO */
   session->flags |= SESSION_RENAME;
   ftp_send_response(session, 350, "OK\r\n");
@@ -3891,7 +8327,7 @@ FTP_DECLARE(RNFR)
  */
 FTP_DECLARE(RNTO)
 {
-  static char rnfr[XFER_BUFFERSIZE]; // rename-from buffer
+  char *rnfr; // rename-from path
   int rc;
 
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
@@ -3908,12 +8344,14 @@ FTP_DECLARE(RNTO)
   /* clear the rename state */
   session->flags &= ~SESSION_RENAME;
 
-  /* copy the RNFR path */
-  memcpy(rnfr, session->buffer, XFER_BUFFERSIZE);
+  /* take over the RNFR path */
+  rnfr = session->rnfr;
+  session->rnfr = NULL;
 
   /* build the path to rename to */
   if (build_path(session, session->cwd, args) != 0)
   {
+    path_free(rnfr);
     ftp_send_response(session, 554, "%s\r\n", strerror(errno));
     return;
   }
@@ -3923,15 +8361,77 @@ FTP_DECLARE(RNTO)
   if (rc != 0)
   {
     /* rename failure */
+    path_free(rnfr);
     console_print(RED "rename: %d %s\n" RESET, errno, strerror(errno));
     ftp_send_response(session, 550, "failed to rename file/directory\r\n");
     return;
   }
 
-  update_free_space();
+  /* a renamed directory takes its subdirectories along */
+  dircache_invalidate_tree(rnfr);
+  dircache_invalidate_tree(session->buffer);
+  path_free(rnfr);
+
   ftp_send_response(session, 250, "OK\r\n");
 }
 
+/*! @fn static void SITE(ftp_session_t *session, const char *args)
+ *
+ *  @brief site-specific commands
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(SITE)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  /* MLSD of the whole tree, with entries named from its top */
+  if (strncasecmp(args, "MLSDR", 5) == 0 && (args[5] == 0 || args[5] == ' '))
+  {
+    args += 5;
+    while (*args == ' ')
+      ++args;
+
+    ftp_xfer_dir(session, args, XFER_DIR_MLSD, false, true);
+    return;
+  }
+
+  /* STOR of a tar archive, extracted into a directory as it arrives */
+  if (strncasecmp(args, "UNTAR", 5) == 0 && (args[5] == 0 || args[5] == ' '))
+  {
+    args += 5;
+    while (*args == ' ')
+      ++args;
+
+    ftp_xfer_file(session, args, XFER_FILE_UNTAR);
+    return;
+  }
+
+  ftp_session_set_state(session, COMMAND_STATE, 0);
+
+  /* memory usage by category */
+  if (strcasecmp(args, "MEM") == 0)
+  {
+    memstat_print(session->buffer, XFER_BUFFERSIZE);
+    ftp_send_response(session, -211, "Memory usage\r\n"
+                                     "%s"
+                                     "211 End\r\n",
+                      session->buffer);
+    return;
+  }
+
+  if (strlen(args) == 0 || strcasecmp(args, "HELP") == 0)
+  {
+    ftp_send_response(session, -214, "The following SITE commands are recognized\r\n"
+                                     " HELP MEM MLSDR UNTAR\r\n"
+                                     "214 End\r\n");
+    return;
+  }
+
+  ftp_send_response(session, 504, "unavailable\r\n");
+}
+
 /*! @fn static void SIZE(ftp_session_t *session, const char *args)
  *
  *  @brief get file size
@@ -4017,7 +8517,7 @@ FTP_DECLARE(STAT)
   }
 
   /* argument provided, open the path in STAT mode */
-  ftp_xfer_dir(session, args, XFER_DIR_STAT, false);
+  ftp_xfer_dir(session, args, XFER_DIR_STAT, false, false);
 }
 
 /*! @fn static void STOR(ftp_session_t *session, const char *args)
@@ -4125,3 +8625,59 @@ FTP_DECLARE(USER)
   console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
   ftp_auth_check(session, args, NULL);
 }
+
+/*! @fn static void XCRC(ftp_session_t *session, const char *args)
+ *
+ *  @brief get the CRC-32 of a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(XCRC)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_xfer_xhash(session, args, HASH_CRC32);
+}
+
+/*! @fn static void XMD5(ftp_session_t *session, const char *args)
+ *
+ *  @brief get the MD5 of a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(XMD5)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_xfer_xhash(session, args, HASH_MD5);
+}
+
+/*! @fn static void XSHA1(ftp_session_t *session, const char *args)
+ *
+ *  @brief get the SHA-1 of a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(XSHA1)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_xfer_xhash(session, args, HASH_SHA1);
+}
+
+/*! @fn static void XSHA256(ftp_session_t *session, const char *args)
+ *
+ *  @brief get the SHA-256 of a file
+ *
+ *  @param[in] session ftp session
+ *  @param[in] args    arguments
+ */
+FTP_DECLARE(XSHA256)
+{
+  console_print(CYAN "%s %s\n" RESET, __func__, args ? args : "");
+
+  ftp_xfer_xhash(session, args, HASH_SHA256);
+}
@@ -0,0 +1,620 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#include "hash.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <zlib.h>
+
+/* The Switch build targets armv8-a+crc+crypto, which turns on the kernels
+ * using the CRC32 and SHA instructions; other CPUs get the portable ones.
+ * MD5 has no instructions of its own.
+ */
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#if defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO)
+#include <arm_neon.h>
+#define HASH_ARM_SHA
+#endif
+
+/*! rotate left */
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+/*! rotate right */
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+/*! algorithm names, as HASH shows them */
+static const char *const hash_names[HASH_ALGOS] = {
+    "SHA-1",
+    "SHA-256",
+    "MD5",
+    "CRC32",
+};
+
+/*! digest sizes in bytes */
+static const size_t hash_sizes[HASH_ALGOS] = {20, 32, 16, 4};
+
+/*! SHA-256 round constants */
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+/*! load a big-endian word */
+static inline uint32_t
+load_be32(const uint8_t *p)
+{
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+/*! load a little-endian word */
+static inline uint32_t
+load_le32(const uint8_t *p)
+{
+  return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 | (uint32_t)p[1] << 8 | p[0];
+}
+
+/*! update a CRC-32
+ *
+ *  @param[in] crc  CRC so far, 0 to start
+ *  @param[in] p    data
+ *  @param[in] size data size
+ *
+ *  @returns new CRC
+ */
+static uint32_t
+crc32_update(uint32_t crc,
+             const uint8_t *p,
+             size_t size)
+{
+#if defined(__ARM_FEATURE_CRC32)
+  uint64_t word;
+
+  crc = ~crc;
+
+  /* a byte at a time up to a word boundary, then a word per instruction */
+  for (; size > 0 && ((uintptr_t)p & 7) != 0; --size)
+    crc = __crc32b(crc, *p++);
+
+  for (; size >= 8; size -= 8, p += 8)
+  {
+    memcpy(&word, p, sizeof(word));
+    crc = __crc32d(crc, word);
+  }
+
+  for (; size > 0; --size)
+    crc = __crc32b(crc, *p++);
+
+  return ~crc;
+#else
+  /* zlib's is as quick as it gets without the instructions */
+  return crc32_z(crc, p, size);
+#endif
+}
+
+/*! MD5 round functions */
+#define MD5_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | ~(z)))
+/*! MD5 step */
+#define MD5_STEP(f, a, b, c, d, x, t, s) ((a) = (b) + ROL((a) + f((b), (c), (d)) + (x) + (t), (s)))
+
+/*! hash MD5 blocks
+ *
+ *  @param[in] state  chaining value
+ *  @param[in] data   data
+ *  @param[in] blocks number of 64-byte blocks
+ */
+static void
+md5_blocks(uint32_t *state,
+           const uint8_t *data,
+           size_t blocks)
+{
+  uint32_t a, b, c, d, m[16];
+  unsigned i;
+
+  for (; blocks > 0; --blocks, data += 64)
+  {
+    for (i = 0; i < 16; ++i)
+      m[i] = load_le32(data + 4 * i);
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+
+    MD5_STEP(MD5_F, a, b, c, d, m[ 0], 0xd76aa478,  7);
+    MD5_STEP(MD5_F, d, a, b, c, m[ 1], 0xe8c7b756, 12);
+    MD5_STEP(MD5_F, c, d, a, b, m[ 2], 0x242070db, 17);
+    MD5_STEP(MD5_F, b, c, d, a, m[ 3], 0xc1bdceee, 22);
+    MD5_STEP(MD5_F, a, b, c, d, m[ 4], 0xf57c0faf,  7);
+    MD5_STEP(MD5_F, d, a, b, c, m[ 5], 0x4787c62a, 12);
+    MD5_STEP(MD5_F, c, d, a, b, m[ 6], 0xa8304613, 17);
+    MD5_STEP(MD5_F, b, c, d, a, m[ 7], 0xfd469501, 22);
+    MD5_STEP(MD5_F, a, b, c, d, m[ 8], 0x698098d8,  7);
+    MD5_STEP(MD5_F, d, a, b, c, m[ 9], 0x8b44f7af, 12);
+    MD5_STEP(MD5_F, c, d, a, b, m[10], 0xffff5bb1, 17);
+    MD5_STEP(MD5_F, b, c, d, a, m[11], 0x895cd7be, 22);
+    MD5_STEP(MD5_F, a, b, c, d, m[12], 0x6b901122,  7);
+    MD5_STEP(MD5_F, d, a, b, c, m[13], 0xfd987193, 12);
+    MD5_STEP(MD5_F, c, d, a, b, m[14], 0xa679438e, 17);
+    MD5_STEP(MD5_F, b, c, d, a, m[15], 0x49b40821, 22);
+    MD5_STEP(MD5_G, a, b, c, d, m[ 1], 0xf61e2562,  5);
+    MD5_STEP(MD5_G, d, a, b, c, m[ 6], 0xc040b340,  9);
+    MD5_STEP(MD5_G, c, d, a, b, m[11], 0x265e5a51, 14);
+    MD5_STEP(MD5_G, b, c, d, a, m[ 0], 0xe9b6c7aa, 20);
+    MD5_STEP(MD5_G, a, b, c, d, m[ 5], 0xd62f105d,  5);
+    MD5_STEP(MD5_G, d, a, b, c, m[10], 0x02441453,  9);
+    MD5_STEP(MD5_G, c, d, a, b, m[15], 0xd8a1e681, 14);
+    MD5_STEP(MD5_G, b, c, d, a, m[ 4], 0xe7d3fbc8, 20);
+    MD5_STEP(MD5_G, a, b, c, d, m[ 9], 0x21e1cde6,  5);
+    MD5_STEP(MD5_G, d, a, b, c, m[14], 0xc33707d6,  9);
+    MD5_STEP(MD5_G, c, d, a, b, m[ 3], 0xf4d50d87, 14);
+    MD5_STEP(MD5_G, b, c, d, a, m[ 8], 0x455a14ed, 20);
+    MD5_STEP(MD5_G, a, b, c, d, m[13], 0xa9e3e905,  5);
+    MD5_STEP(MD5_G, d, a, b, c, m[ 2], 0xfcefa3f8,  9);
+    MD5_STEP(MD5_G, c, d, a, b, m[ 7], 0x676f02d9, 14);
+    MD5_STEP(MD5_G, b, c, d, a, m[12], 0x8d2a4c8a, 20);
+    MD5_STEP(MD5_H, a, b, c, d, m[ 5], 0xfffa3942,  4);
+    MD5_STEP(MD5_H, d, a, b, c, m[ 8], 0x8771f681, 11);
+    MD5_STEP(MD5_H, c, d, a, b, m[11], 0x6d9d6122, 16);
+    MD5_STEP(MD5_H, b, c, d, a, m[14], 0xfde5380c, 23);
+    MD5_STEP(MD5_H, a, b, c, d, m[ 1], 0xa4beea44,  4);
+    MD5_STEP(MD5_H, d, a, b, c, m[ 4], 0x4bdecfa9, 11);
+    MD5_STEP(MD5_H, c, d, a, b, m[ 7], 0xf6bb4b60, 16);
+    MD5_STEP(MD5_H, b, c, d, a, m[10], 0xbebfbc70, 23);
+    MD5_STEP(MD5_H, a, b, c, d, m[13], 0x289b7ec6,  4);
+    MD5_STEP(MD5_H, d, a, b, c, m[ 0], 0xeaa127fa, 11);
+    MD5_STEP(MD5_H, c, d, a, b, m[ 3], 0xd4ef3085, 16);
+    MD5_STEP(MD5_H, b, c, d, a, m[ 6], 0x04881d05, 23);
+    MD5_STEP(MD5_H, a, b, c, d, m[ 9], 0xd9d4d039,  4);
+    MD5_STEP(MD5_H, d, a, b, c, m[12], 0xe6db99e5, 11);
+    MD5_STEP(MD5_H, c, d, a, b, m[15], 0x1fa27cf8, 16);
+    MD5_STEP(MD5_H, b, c, d, a, m[ 2], 0xc4ac5665, 23);
+    MD5_STEP(MD5_I, a, b, c, d, m[ 0], 0xf4292244,  6);
+    MD5_STEP(MD5_I, d, a, b, c, m[ 7], 0x432aff97, 10);
+    MD5_STEP(MD5_I, c, d, a, b, m[14], 0xab9423a7, 15);
+    MD5_STEP(MD5_I, b, c, d, a, m[ 5], 0xfc93a039, 21);
+    MD5_STEP(MD5_I, a, b, c, d, m[12], 0x655b59c3,  6);
+    MD5_STEP(MD5_I, d, a, b, c, m[ 3], 0x8f0ccc92, 10);
+    MD5_STEP(MD5_I, c, d, a, b, m[10], 0xffeff47d, 15);
+    MD5_STEP(MD5_I, b, c, d, a, m[ 1], 0x85845dd1, 21);
+    MD5_STEP(MD5_I, a, b, c, d, m[ 8], 0x6fa87e4f,  6);
+    MD5_STEP(MD5_I, d, a, b, c, m[15], 0xfe2ce6e0, 10);
+    MD5_STEP(MD5_I, c, d, a, b, m[ 6], 0xa3014314, 15);
+    MD5_STEP(MD5_I, b, c, d, a, m[13], 0x4e0811a1, 21);
+    MD5_STEP(MD5_I, a, b, c, d, m[ 4], 0xf7537e82,  6);
+    MD5_STEP(MD5_I, d, a, b, c, m[11], 0xbd3af235, 10);
+    MD5_STEP(MD5_I, c, d, a, b, m[ 2], 0x2ad7d2bb, 15);
+    MD5_STEP(MD5_I, b, c, d, a, m[ 9], 0xeb86d391, 21);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+  }
+}
+
+#ifdef HASH_ARM_SHA
+/*! hash SHA-1 blocks
+ *
+ *  Each step does four rounds; the message schedule is kept four steps deep.
+ *
+ *  @param[in] state  chaining value
+ *  @param[in] data   data
+ *  @param[in] blocks number of 64-byte blocks
+ */
+static void
+sha1_blocks(uint32_t *state,
+            const uint8_t *data,
+            size_t blocks)
+{
+  static const uint32_t k[4] = {0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6};
+  uint32x4_t abcd, abcd_saved, w[4], wk;
+  uint32_t e, e_saved, e_next;
+  unsigned i;
+
+  abcd = vld1q_u32(state);
+  e = state[4];
+
+  for (; blocks > 0; --blocks, data += 64)
+  {
+    abcd_saved = abcd;
+    e_saved = e;
+
+    for (i = 0; i < 4; ++i)
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+    for (i = 0; i < 20; ++i)
+    {
+      if (i >= 4)
+        w[i % 4] = vsha1su1q_u32(vsha1su0q_u32(w[i % 4], w[(i + 1) % 4], w[(i + 2) % 4]),
+                                 w[(i + 3) % 4]);
+
+      wk = vaddq_u32(w[i % 4], vdupq_n_u32(k[i / 5]));
+      e_next = vsha1h_u32(vgetq_lane_u32(abcd, 0));
+      if (i < 5)
+        abcd = vsha1cq_u32(abcd, e, wk);
+      else if (i >= 10 && i < 15)
+        abcd = vsha1mq_u32(abcd, e, wk);
+      else
+        abcd = vsha1pq_u32(abcd, e, wk);
+      e = e_next;
+    }
+
+    abcd = vaddq_u32(abcd, abcd_saved);
+    e += e_saved;
+  }
+
+  vst1q_u32(state, abcd);
+  state[4] = e;
+}
+
+/*! hash SHA-256 blocks
+ *
+ *  Each step does four rounds; the message schedule is kept four steps deep.
+ *
+ *  @param[in] state  chaining value
+ *  @param[in] data   data
+ *  @param[in] blocks number of 64-byte blocks
+ */
+static void
+sha256_blocks(uint32_t *state,
+              const uint8_t *data,
+              size_t blocks)
+{
+  uint32x4_t abcd, efgh, abcd_saved, efgh_saved, abcd_prev, w[4], wk;
+  unsigned i;
+
+  abcd = vld1q_u32(state);
+  efgh = vld1q_u32(state + 4);
+
+  for (; blocks > 0; --blocks, data += 64)
+  {
+    abcd_saved = abcd;
+    efgh_saved = efgh;
+
+    for (i = 0; i < 4; ++i)
+      w[i] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(data + 16 * i)));
+
+    for (i = 0; i < 16; ++i)
+    {
+      if (i >= 4)
+        w[i % 4] = vsha256su1q_u32(vsha256su0q_u32(w[i % 4], w[(i + 1) % 4]),
+                                   w[(i + 2) % 4], w[(i + 3) % 4]);
+
+      wk = vaddq_u32(w[i % 4], vld1q_u32(sha256_k + 4 * i));
+      abcd_prev = abcd;
+      abcd = vsha256hq_u32(abcd, efgh, wk);
+      efgh = vsha256h2q_u32(efgh, abcd_prev, wk);
+    }
+
+    abcd = vaddq_u32(abcd, abcd_saved);
+    efgh = vaddq_u32(efgh, efgh_saved);
+  }
+
+  vst1q_u32(state, abcd);
+  vst1q_u32(state + 4, efgh);
+}
+#else
+/*! SHA-1 message word, worked out in a ring of the last 16 */
+#define SHA1_W(i) \
+  (w[(i) & 15] = ROL(w[((i) + 13) & 15] ^ w[((i) + 8) & 15] ^ w[((i) + 2) & 15] ^ w[(i) & 15], 1))
+
+/*! SHA-1 round */
+#define SHA1_ROUND(f, k, x)              \
+  do                                     \
+  {                                      \
+    t = ROL(a, 5) + (f) + e + (k) + (x); \
+    e = d;                               \
+    d = c;                               \
+    c = ROL(b, 30);                      \
+    b = a;                               \
+    a = t;                               \
+  } while (0)
+
+/*! SHA-256 round; the caller renames the working variables instead of
+ *  moving them, so eight rounds make a cycle
+ */
+#define SHA256_ROUND(a, b, c, d, e, f, g, h, i)                                            \
+  do                                                                                       \
+  {                                                                                        \
+    t = (h) + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) + ((g) ^ ((e) & ((f) ^ (g)))) +        \
+        sha256_k[i] + w[i];                                                                \
+    (d) += t;                                                                              \
+    (h) = t + (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) + (((a) & (b)) | ((c) & ((a) | (b)))); \
+  } while (0)
+
+/*! eight SHA-256 rounds */
+#define SHA256_ROUNDS(i)                         \
+  do                                             \
+  {                                              \
+    SHA256_ROUND(a, b, c, d, e, f, g, h, i);     \
+    SHA256_ROUND(h, a, b, c, d, e, f, g, i + 1); \
+    SHA256_ROUND(g, h, a, b, c, d, e, f, i + 2); \
+    SHA256_ROUND(f, g, h, a, b, c, d, e, i + 3); \
+    SHA256_ROUND(e, f, g, h, a, b, c, d, i + 4); \
+    SHA256_ROUND(d, e, f, g, h, a, b, c, i + 5); \
+    SHA256_ROUND(c, d, e, f, g, h, a, b, i + 6); \
+    SHA256_ROUND(b, c, d, e, f, g, h, a, i + 7); \
+  } while (0)
+
+/*! hash SHA-1 blocks
+ *
+ *  @param[in] state  chaining value
+ *  @param[in] data   data
+ *  @param[in] blocks number of 64-byte blocks
+ */
+static void
+sha1_blocks(uint32_t *state,
+            const uint8_t *data,
+            size_t blocks)
+{
+  uint32_t a, b, c, d, e, t, w[16];
+  unsigned i;
+
+  for (; blocks > 0; --blocks, data += 64)
+  {
+    for (i = 0; i < 16; ++i)
+      w[i] = load_be32(data + 4 * i);
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+
+    for (i = 0; i < 16; ++i)
+      SHA1_ROUND(d ^ (b & (c ^ d)), 0x5a827999, w[i]);
+    for (; i < 20; ++i)
+      SHA1_ROUND(d ^ (b & (c ^ d)), 0x5a827999, SHA1_W(i));
+    for (; i < 40; ++i)
+      SHA1_ROUND(b ^ c ^ d, 0x6ed9eba1, SHA1_W(i));
+    for (; i < 60; ++i)
+      SHA1_ROUND((b & c) | (d & (b | c)), 0x8f1bbcdc, SHA1_W(i));
+    for (; i < 80; ++i)
+      SHA1_ROUND(b ^ c ^ d, 0xca62c1d6, SHA1_W(i));
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+  }
+}
+
+/*! hash SHA-256 blocks
+ *
+ *  @param[in] state  chaining value
+ *  @param[in] data   data
+ *  @param[in] blocks number of 64-byte blocks
+ */
+static void
+sha256_blocks(uint32_t *state,
+              const uint8_t *data,
+              size_t blocks)
+{
+  uint32_t a, b, c, d, e, f, g, h, t, w[64];
+  unsigned i;
+
+  for (; blocks > 0; --blocks, data += 64)
+  {
+    for (i = 0; i < 16; ++i)
+      w[i] = load_be32(data + 4 * i);
+    for (; i < 64; ++i)
+      w[i] = w[i - 16] + w[i - 7] +
+             (ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+             (ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10));
+
+    a = state[0];
+    b = state[1];
+    c = state[2];
+    d = state[3];
+    e = state[4];
+    f = state[5];
+    g = state[6];
+    h = state[7];
+
+    for (i = 0; i < 64; i += 8)
+      SHA256_ROUNDS(i);
+
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+  }
+}
+#endif
+
+/*! hash whole blocks
+ *
+ *  @param[in] ctx    checksum
+ *  @param[in] data   data
+ *  @param[in] blocks number of 64-byte blocks
+ */
+static void
+hash_blocks(hash_ctx_t *ctx,
+            const uint8_t *data,
+            size_t blocks)
+{
+  switch (ctx->algo)
+  {
+  case HASH_SHA1:
+    sha1_blocks(ctx->state, data, blocks);
+    break;
+
+  case HASH_SHA256:
+    sha256_blocks(ctx->state, data, blocks);
+    break;
+
+  case HASH_MD5:
+    md5_blocks(ctx->state, data, blocks);
+    break;
+
+  default:
+    break;
+  }
+}
+
+const char *
+hash_name(hash_algo_t algo)
+{
+  return hash_names[algo];
+}
+
+bool
+hash_lookup(const char *name,
+            hash_algo_t *algo)
+{
+  unsigned i;
+
+  for (i = 0; i < HASH_ALGOS; ++i)
+  {
+    if (strcasecmp(name, hash_names[i]) == 0)
+    {
+      *algo = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void
+hash_init(hash_ctx_t *ctx,
+          hash_algo_t algo)
+{
+  static const uint32_t sha1_iv[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+  static const uint32_t sha256_iv[8] = {
+      0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+  };
+
+  memset(ctx, 0, sizeof(*ctx));
+  ctx->algo = algo;
+
+  /* MD5 starts from the first four words of SHA-1; CRC-32 from 0 */
+  if (algo == HASH_SHA1 || algo == HASH_MD5)
+    memcpy(ctx->state, sha1_iv, sizeof(sha1_iv));
+  else if (algo == HASH_SHA256)
+    memcpy(ctx->state, sha256_iv, sizeof(sha256_iv));
+}
+
+void
+hash_update(hash_ctx_t *ctx,
+            const void *data,
+            size_t size)
+{
+  const uint8_t *p = data;
+  size_t len;
+
+  ctx->length += size;
+
+  if (ctx->algo == HASH_CRC32)
+  {
+    ctx->state[0] = crc32_update(ctx->state[0], p, size);
+    return;
+  }
+
+  /* top up a partial block first */
+  if (ctx->fill != 0)
+  {
+    len = sizeof(ctx->block) - ctx->fill;
+    if (len > size)
+      len = size;
+    memcpy(ctx->block + ctx->fill, p, len);
+    ctx->fill += len;
+    p += len;
+    size -= len;
+
+    if (ctx->fill < sizeof(ctx->block))
+      return;
+    hash_blocks(ctx, ctx->block, 1);
+    ctx->fill = 0;
+  }
+
+  /* whole blocks straight from the data */
+  len = size / sizeof(ctx->block);
+  if (len != 0)
+  {
+    hash_blocks(ctx, p, len);
+    p += len * sizeof(ctx->block);
+    size -= len * sizeof(ctx->block);
+  }
+
+  memcpy(ctx->block, p, size);
+  ctx->fill = size;
+}
+
+void
+hash_final(hash_ctx_t *ctx,
+           char *hex)
+{
+  static const char digits[] = "0123456789abcdef";
+  uint8_t digest[32];
+  uint64_t bits = ctx->length * 8;
+  size_t i, size = hash_sizes[ctx->algo];
+
+  if (ctx->algo == HASH_CRC32)
+  {
+    for (i = 0; i < 4; ++i)
+      digest[i] = ctx->state[0] >> (24 - 8 * i);
+  }
+  else
+  {
+    /* pad with 0x80 and zeros, leaving room for the bit length */
+    ctx->block[ctx->fill++] = 0x80;
+    if (ctx->fill > sizeof(ctx->block) - 8)
+    {
+      memset(ctx->block + ctx->fill, 0, sizeof(ctx->block) - ctx->fill);
+      hash_blocks(ctx, ctx->block, 1);
+      ctx->fill = 0;
+    }
+    memset(ctx->block + ctx->fill, 0, sizeof(ctx->block) - 8 - ctx->fill);
+
+    /* MD5 is little-endian throughout, SHA big-endian */
+    for (i = 0; i < 8; ++i)
+    {
+      if (ctx->algo == HASH_MD5)
+        ctx->block[56 + i] = bits >> (8 * i);
+      else
+        ctx->block[63 - i] = bits >> (8 * i);
+    }
+    hash_blocks(ctx, ctx->block, 1);
+
+    for (i = 0; i < size; ++i)
+    {
+      if (ctx->algo == HASH_MD5)
+        digest[i] = ctx->state[i / 4] >> (8 * (i % 4));
+      else
+        digest[i] = ctx->state[i / 4] >> (24 - 8 * (i % 4));
+    }
+  }
+
+  for (i = 0; i < size; ++i)
+  {
+    hex[2 * i] = digits[digest[i] >> 4];
+    hex[2 * i + 1] = digits[digest[i] & 0xf];
+  }
+  hex[2 * size] = 0;
+}
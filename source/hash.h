@@ -0,0 +1,69 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*! checksum algorithm, in the order HASH lists them */
+typedef enum
+{
+  HASH_SHA1,   /*!< SHA-1, the HASH default */
+  HASH_SHA256, /*!< SHA-256 */
+  HASH_MD5,    /*!< MD5 */
+  HASH_CRC32,  /*!< CRC-32 as used by zip and XCRC */
+  HASH_ALGOS,
+} hash_algo_t;
+
+/*! longest checksum in hex, with the terminator */
+#define HASH_HEX_SIZE 65
+
+/*! checksum being computed */
+typedef struct
+{
+  hash_algo_t algo;   /*!< algorithm */
+  uint32_t state[8];  /*!< chaining value, or the CRC in state[0] */
+  uint64_t length;    /*!< bytes hashed */
+  uint8_t block[64];  /*!< partial block */
+  size_t fill;        /*!< bytes in block */
+} hash_ctx_t;
+
+/*! get the name of an algorithm
+ *
+ *  @param[in] algo algorithm
+ *
+ *  @returns name as HASH shows it, e.g. SHA-256
+ */
+const char *hash_name(hash_algo_t algo);
+
+/*! look up an algorithm by name
+ *
+ *  @param[in]  name name as HASH shows it, in any case
+ *  @param[out] algo algorithm
+ *
+ *  @returns whether it was found
+ */
+bool hash_lookup(const char *name, hash_algo_t *algo);
+
+/*! start a checksum
+ *
+ *  @param[out] ctx  checksum
+ *  @param[in]  algo algorithm
+ */
+void hash_init(hash_ctx_t *ctx, hash_algo_t algo);
+
+/*! add data to a checksum
+ *
+ *  @param[in] ctx  checksum
+ *  @param[in] data data
+ *  @param[in] size data size
+ */
+void hash_update(hash_ctx_t *ctx, const void *data, size_t size);
+
+/*! finish a checksum
+ *
+ *  @param[in]  ctx checksum
+ *  @param[out] hex lowercase hex digest, HASH_HEX_SIZE bytes
+ */
+void hash_final(hash_ctx_t *ctx, char *hex);
@@ -18,8 +18,7 @@
 #include "util.h"
 
 #include "minIni.h"
-
-#define HEAP_SIZE 0xA7000
+#include "memstat.h"
 
 // we aren't an applet
 u32 __nx_applet_type = AppletType_None;
@@ -86,7 +85,7 @@ static loop_status_t loop(loop_status_t (*callback)(void))
 
     while (true)
     {
-        svcSleepThread(1e+7);
+        // the callback blocks in poll until there is work to do
         status = callback();
         console_render();
         if (status != LOOP_CONTINUE)
@@ -110,8 +109,9 @@ int main(int argc, char **argv)
         fclose(should_log_file);
 
         mkdir("/config/sys-ftpd/logs", 0700);
-        unlink("/config/sys-ftpd/logs/ftpd.log");
+        unlink(LOG_PATH);
     }
+    console_init();
 
     char buffer[100];
     ini_gets("Pause", "disabled:", "0", buffer, 100, CONFIGPATH);
@@ -149,6 +149,7 @@ int main(int argc, char **argv)
     ftp_post_exit();
 
     pauseExit();
+    console_exit();
 
     return 0;
 }
@@ -0,0 +1,117 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#include "memstat.h"
+#include <malloc.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include "console.h"
+
+/*! usage of one category */
+typedef struct
+{
+  atomic_size_t current; /*!< bytes in use */
+  atomic_size_t peak;    /*!< most bytes ever in use */
+  atomic_uint failures;  /*!< allocations that failed */
+} mem_counter_t;
+
+/* updated from every worker and I/O thread, so they are kept lock-free */
+static mem_counter_t counters[MEM_CATEGORIES];
+
+static const char *const category_names[MEM_CATEGORIES] = {
+    "sessions",
+    "paths",
+    "transfer",
+    "ini",
+    "cache",
+};
+
+void
+memstat_add(mem_category_t category, size_t bytes)
+{
+  mem_counter_t *counter = &counters[category];
+  size_t current, peak;
+
+  current = atomic_fetch_add_explicit(&counter->current, bytes, memory_order_relaxed) + bytes;
+
+  /* raise the high-water mark */
+  peak = atomic_load_explicit(&counter->peak, memory_order_relaxed);
+  while (current > peak &&
+         !atomic_compare_exchange_weak_explicit(&counter->peak, &peak, current,
+                                                memory_order_relaxed, memory_order_relaxed))
+    ;
+}
+
+void
+memstat_sub(mem_category_t category, size_t bytes)
+{
+  atomic_fetch_sub_explicit(&counters[category].current, bytes, memory_order_relaxed);
+}
+
+void
+memstat_fail(mem_category_t category)
+{
+  atomic_fetch_add_explicit(&counters[category].failures, 1, memory_order_relaxed);
+}
+
+size_t
+memstat_print(char *buffer, size_t size)
+{
+  struct mallinfo info = mallinfo();
+  size_t len = 0, i;
+  int rc;
+
+  /* mallinfo only reads the allocator's bookkeeping; the free space is
+   * split into ordblks chunks, and keepcost of it is at the top of the heap,
+   * where a block of any size up to that still fits
+   */
+  rc = snprintf(buffer, size, " heap: %zu used, %zu free in %zu chunks, %zu at the top, %zu arena of %u\r\n",
+                (size_t)info.uordblks, (size_t)info.fordblks, (size_t)info.ordblks,
+                (size_t)info.keepcost, (size_t)info.arena, HEAP_SIZE);
+  if (rc < 0 || (size_t)rc >= size)
+    return 0;
+  len = rc;
+
+  for (i = 0; i < MEM_CATEGORIES; ++i)
+  {
+    rc = snprintf(buffer + len, size - len, " %s: %zu bytes, %zu peak, %u failed\r\n",
+                  category_names[i],
+                  atomic_load_explicit(&counters[i].current, memory_order_relaxed),
+                  atomic_load_explicit(&counters[i].peak, memory_order_relaxed),
+                  atomic_load_explicit(&counters[i].failures, memory_order_relaxed));
+    if (rc < 0 || (size_t)rc >= size - len)
+      break;
+    len += rc;
+  }
+
+  return len;
+}
+
+void
+memstat_log(void)
+{
+  struct mallinfo info;
+  char line[190];
+  size_t len, i;
+  int rc;
+
+  if (!should_log)
+    return;
+
+  /* current/peak/failed per category */
+  info = mallinfo();
+  rc = snprintf(line, sizeof(line), "mem: heap %zu used, %zu free/%zu chunks, %zu top;",
+                (size_t)info.uordblks, (size_t)info.fordblks, (size_t)info.ordblks,
+                (size_t)info.keepcost);
+  for (i = 0; i < MEM_CATEGORIES && rc >= 0 && (size_t)rc < sizeof(line); ++i)
+  {
+    len = rc;
+    rc = snprintf(line + len, sizeof(line) - len, " %s %zu/%zu/%u", category_names[i],
+                  atomic_load_explicit(&counters[i].current, memory_order_relaxed),
+                  atomic_load_explicit(&counters[i].peak, memory_order_relaxed),
+                  atomic_load_explicit(&counters[i].failures, memory_order_relaxed));
+    if (rc >= 0)
+      rc += len;
+  }
+
+  console_print("%s\n", line);
+}
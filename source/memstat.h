@@ -0,0 +1,78 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+/*! size of the fake heap set up in main.c */
+#define HEAP_SIZE 0xA7000
+
+/*! memory usage categories */
+typedef enum
+{
+  MEM_SESSIONS, /*!< session slots in use and worker scratch */
+  MEM_PATHS,    /*!< pooled and heap path strings, e.g. from encode_path */
+  MEM_XFER,     /*!< leased and read-ahead transfer buffers */
+  MEM_INI,      /*!< minIni line buffers and stdio buffers of open ini files */
+  MEM_CACHE,    /*!< cached directory listings */
+  MEM_CATEGORIES,
+} mem_category_t;
+
+/*! account for memory taken
+ *
+ *  @param[in] category category
+ *  @param[in] bytes    bytes taken
+ */
+void memstat_add(mem_category_t category, size_t bytes);
+
+/*! account for memory given back
+ *
+ *  @param[in] category category
+ *  @param[in] bytes    bytes given back
+ */
+void memstat_sub(mem_category_t category, size_t bytes);
+
+/*! count an allocation that failed
+ *
+ *  @param[in] category category
+ */
+void memstat_fail(mem_category_t category);
+
+/*! describe memory usage, one line per category
+ *
+ *  @param[out] buffer where to write
+ *  @param[in]  size   buffer size
+ *
+ *  @returns length written
+ */
+size_t memstat_print(char *buffer, size_t size);
+
+/*! log memory usage on a single line */
+void memstat_log(void);
+
+/*! account for minIni opening a file
+ *
+ *  @param[in] opened whether the file was opened
+ *  @param[in] line   minIni line buffer size
+ *
+ *  @returns opened
+ */
+static inline bool
+memstat_ini_open(bool opened, size_t line)
+{
+  if (opened)
+    memstat_add(MEM_INI, line + BUFSIZ);
+  return opened;
+}
+
+/*! account for minIni closing a file
+ *
+ *  @param[in] line minIni line buffer size
+ */
+static inline void
+memstat_ini_close(size_t line)
+{
+  memstat_sub(MEM_INI, line + BUFSIZ);
+}
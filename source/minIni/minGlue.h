@@ -10,12 +10,14 @@
 
 /* map required file I/O types and functions to the standard C library */
 #include <stdio.h>
+#include "../memstat.h"
 
+/* open files are counted in the memory statistics */
 #define INI_FILETYPE                    FILE*
-#define ini_openread(filename,file)     ((*(file) = fopen((filename),"rb")) != NULL)
-#define ini_openwrite(filename,file)    ((*(file) = fopen((filename),"wb")) != NULL)
-#define ini_openrewrite(filename,file)  ((*(file) = fopen((filename),"r+b")) != NULL)
-#define ini_close(file)                 (fclose(*(file)) == 0)
+#define ini_openread(filename,file)     memstat_ini_open((*(file) = fopen((filename),"rb")) != NULL, INI_BUFFERSIZE)
+#define ini_openwrite(filename,file)    memstat_ini_open((*(file) = fopen((filename),"wb")) != NULL, INI_BUFFERSIZE)
+#define ini_openrewrite(filename,file)  memstat_ini_open((*(file) = fopen((filename),"r+b")) != NULL, INI_BUFFERSIZE)
+#define ini_close(file)                 (memstat_ini_close(INI_BUFFERSIZE), fclose(*(file)) == 0)
 #define ini_read(buffer,size,file)      (fgets((buffer),(size),*(file)) != NULL)
 #define ini_write(buffer,file)          (fputs((buffer),*(file)) >= 0)
 #define ini_rename(source,dest)         (rename((source), (dest)) == 0)
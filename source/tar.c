@@ -0,0 +1,988 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#include "tar.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "console.h"
+#include "memstat.h"
+
+#if defined(_3DS) || defined(__SWITCH__)
+#define lstat stat
+#endif
+
+/*! tar block size */
+#define TAR_BLOCK 512
+/*! longest path that is archived */
+#define TAR_PATH_MAX 0x1000
+/*! most directories held open at once, counting the top one */
+#define TAR_MAX_DEPTH 16
+/*! room for a GNU long name entry with its name, and the real header */
+#define TAR_STAGE_SIZE (2 * TAR_BLOCK + (TAR_PATH_MAX + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK)
+/*! most of a GNU long name or pax header that is kept */
+#define TAR_LONG_MAX (TAR_PATH_MAX + TAR_BLOCK)
+
+/*! ustar header block */
+typedef struct
+{
+  char name[100];     /*!< name, or the part after prefix */
+  char mode[8];       /*!< permissions, octal */
+  char uid[8];        /*!< owner, octal */
+  char gid[8];        /*!< group, octal */
+  char size[12];      /*!< data size, octal or base-256 */
+  char mtime[12];     /*!< modification time, octal */
+  char chksum[8];     /*!< header checksum, octal */
+  char typeflag;      /*!< entry type */
+  char linkname[100]; /*!< link target */
+  char magic[6];      /*!< "ustar" */
+  char version[2];    /*!< "00" */
+  char uname[32];     /*!< owner name */
+  char gname[32];     /*!< group name */
+  char devmajor[8];   /*!< device major number */
+  char devminor[8];   /*!< device minor number */
+  char prefix[155];   /*!< leading directories of a long name */
+  char pad[12];       /*!< up to the block size */
+} tar_header_t;
+
+/*! directory being archived */
+typedef struct
+{
+  DIR *dp;    /*!< open directory */
+  size_t len; /*!< length of its path */
+} tar_frame_t;
+
+/*! where the data of an entry being extracted goes */
+typedef enum
+{
+  TAR_DATA_SKIP, /*!< nowhere */
+  TAR_DATA_FILE, /*!< to the file being extracted */
+  TAR_DATA_LONG, /*!< GNU long name of the next entry */
+  TAR_DATA_PAX,  /*!< pax header of the next entry */
+} tar_data_t;
+
+struct tar_writer
+{
+  tar_frame_t frames[TAR_MAX_DEPTH]; /*!< directories being archived, top first */
+  unsigned depth;                    /*!< frames in use */
+  size_t name_off;                   /*!< where entry names start in path */
+  int fd;                            /*!< file being archived, or -1 */
+  uint64_t remaining;                /*!< bytes of the file still to archive */
+  size_t pad;                        /*!< zeros to put after the file */
+  bool done;                         /*!< the end of the archive is staged */
+  size_t stage_pos;                  /*!< bytes of stage read */
+  size_t stage_len;                  /*!< bytes in stage */
+  char path[TAR_PATH_MAX];           /*!< path of the current entry */
+  char stage[TAR_STAGE_SIZE];        /*!< headers and padding to read next */
+};
+
+struct tar_reader
+{
+  tar_data_t data;                  /*!< where the entry data goes */
+  uint64_t remaining;               /*!< entry data still to come */
+  size_t pad;                       /*!< padding still to come */
+  size_t header_len;                /*!< bytes of header collected */
+  size_t long_len;                  /*!< bytes of long name or pax header seen */
+  bool named;                       /*!< long_data names the next entry */
+  bool end;                         /*!< the end of the archive was seen */
+  int fd;                           /*!< file being extracted, or -1 */
+  int64_t used;                     /*!< space taken since tar_reader_used */
+  size_t base_len;                  /*!< length of the directory path */
+  char path[TAR_PATH_MAX];          /*!< path of the current entry */
+  char long_data[TAR_LONG_MAX + 1]; /*!< long name or pax header */
+  char header[TAR_BLOCK];           /*!< header being collected */
+};
+
+/*! fill in a numeric header field
+ *
+ *  Values too big for octal are stored base-256, as GNU tar does.
+ *
+ *  @param[out] field field
+ *  @param[in]  width field width
+ *  @param[in]  value value
+ */
+static void
+tar_number(char *field,
+           size_t width,
+           uint64_t value)
+{
+  size_t i;
+
+  if (value >> (3 * (width - 1)) == 0)
+  {
+    /* octal digits and a nul */
+    field[width - 1] = 0;
+    for (i = width - 1; i > 0; --i)
+    {
+      field[i - 1] = '0' + (value & 7);
+      value >>= 3;
+    }
+    return;
+  }
+
+  for (i = width - 1; i > 0; --i)
+  {
+    field[i] = value & 0xFF;
+    value >>= 8;
+  }
+  field[0] = (char)0x80;
+}
+
+/*! fill in a header block
+ *
+ *  @param[out] header header
+ *  @param[in]  name   entry name
+ *  @param[in]  len    name length; up to 100 after the split
+ *  @param[in]  split  where the name is split into prefix and name, or 0
+ *  @param[in]  st     entry stat, or NULL
+ *  @param[in]  type   entry type
+ *  @param[in]  size   data size
+ */
+static void
+tar_header(tar_header_t *header,
+           const char *name,
+           size_t len,
+           size_t split,
+           const struct stat *st,
+           char type,
+           uint64_t size)
+{
+  unsigned sum = 0;
+  size_t i;
+
+  memset(header, 0, sizeof(*header));
+
+  if (split != 0)
+  {
+    memcpy(header->prefix, name, split);
+    memcpy(header->name, name + split + 1, len - split - 1);
+  }
+  else
+    memcpy(header->name, name, len);
+
+  tar_number(header->mode, sizeof(header->mode), st != NULL ? st->st_mode & 07777 : 0644);
+  tar_number(header->uid, sizeof(header->uid), 0);
+  tar_number(header->gid, sizeof(header->gid), 0);
+  tar_number(header->size, sizeof(header->size), size);
+  tar_number(header->mtime, sizeof(header->mtime),
+             st != NULL && st->st_mtime > 0 ? st->st_mtime : 0);
+  header->typeflag = type;
+  memcpy(header->magic, "ustar", sizeof(header->magic));
+  memcpy(header->version, "00", sizeof(header->version));
+
+  /* the checksum is taken with its own field as spaces */
+  memset(header->chksum, ' ', sizeof(header->chksum));
+  for (i = 0; i < sizeof(*header); ++i)
+    sum += ((unsigned char *)header)[i];
+  tar_number(header->chksum, sizeof(header->chksum) - 1, sum);
+}
+
+/*! find where to split a name that is too long for the name field
+ *
+ *  @param[in]  name  entry name
+ *  @param[in]  len   name length
+ *  @param[out] split slash that ends the prefix
+ *
+ *  @returns whether it can be split
+ */
+static bool
+tar_split(const char *name,
+          size_t len,
+          size_t *split)
+{
+  size_t i;
+
+  for (i = len - 2 < 155 ? len - 2 : 155; i > 0 && len - i - 1 <= 100; --i)
+  {
+    if (name[i] == '/')
+    {
+      *split = i;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*! stage the header of the current entry
+ *
+ *  @param[in] tar  archive
+ *  @param[in] st   entry stat
+ *  @param[in] type entry type
+ *  @param[in] size data size
+ */
+static void
+tar_stage_entry(tar_writer_t *tar,
+                const struct stat *st,
+                char type,
+                uint64_t size)
+{
+  char *name = tar->path + tar->name_off;
+  size_t len = strlen(name), split = 0;
+  size_t blocks;
+
+  tar->stage_pos = 0;
+  tar->stage_len = 0;
+
+  /* directories are named with a trailing slash */
+  if (type == '5')
+  {
+    name[len++] = '/';
+    name[len] = 0;
+  }
+
+  if (len > sizeof(((tar_header_t *)0)->name) && !tar_split(name, len, &split))
+  {
+    /* too long for ustar; a GNU long name entry goes first */
+    blocks = (len + TAR_BLOCK) / TAR_BLOCK;
+    tar_header((tar_header_t *)tar->stage, "././@LongLink", 13, 0, NULL, 'L', len + 1);
+    memset(tar->stage + TAR_BLOCK, 0, blocks * TAR_BLOCK);
+    memcpy(tar->stage + TAR_BLOCK, name, len);
+    tar->stage_len = TAR_BLOCK + blocks * TAR_BLOCK;
+
+    len = sizeof(((tar_header_t *)0)->name);
+  }
+
+  tar_header((tar_header_t *)(tar->stage + tar->stage_len), name, len, split, st, type, size);
+  tar->stage_len += TAR_BLOCK;
+
+  if (type == '5')
+    name[strlen(name) - 1] = 0;
+}
+
+/*! go on to the next entry
+ *
+ *  @param[in] tar archive
+ *
+ *  @returns -1 once every entry is archived
+ */
+static int
+tar_next(tar_writer_t *tar)
+{
+  tar_frame_t *frame;
+  struct dirent *dent;
+  struct stat st, fst;
+  size_t len, pos;
+
+  while (tar->depth > 0)
+  {
+    frame = &tar->frames[tar->depth - 1];
+    tar->path[frame->len] = 0;
+
+    dent = readdir(frame->dp);
+    if (dent == NULL)
+    {
+      /* this directory is done; go back up */
+      closedir(frame->dp);
+      --tar->depth;
+      continue;
+    }
+
+    if (strcmp(dent->d_name, ".") == 0 || strcmp(dent->d_name, "..") == 0)
+      continue;
+
+    /* leave room for the slash after a directory name */
+    len = strlen(dent->d_name);
+    pos = frame->len;
+    if (pos > 1)
+      tar->path[pos++] = '/';
+    if (pos + len + 2 > TAR_PATH_MAX)
+    {
+      console_print(RED "'%s': %d %s\n" RESET, dent->d_name, ENAMETOOLONG, strerror(ENAMETOOLONG));
+      continue;
+    }
+    memcpy(tar->path + pos, dent->d_name, len + 1);
+
+    if (lstat(tar->path, &st) != 0)
+    {
+      console_print(RED "stat '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+      continue;
+    }
+
+    if (S_ISDIR(st.st_mode))
+    {
+      if (tar->depth < TAR_MAX_DEPTH)
+      {
+        frame = &tar->frames[tar->depth];
+        frame->dp = opendir(tar->path);
+        if (frame->dp == NULL)
+        {
+          console_print(RED "opendir '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+          continue;
+        }
+        frame->len = pos + len;
+        ++tar->depth;
+      }
+      else
+        console_print(YELLOW "not archiving below '%s'\n" RESET, tar->path);
+
+      tar_stage_entry(tar, &st, '5', 0);
+      return 0;
+    }
+
+    /* links and devices are left out */
+    if (!S_ISREG(st.st_mode))
+      continue;
+
+    /* the log is not for reading */
+    if (strcmp(tar->path, LOG_PATH) == 0)
+      continue;
+
+    tar->fd = open(tar->path, O_RDONLY);
+    if (tar->fd < 0)
+    {
+      console_print(RED "open '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+      continue;
+    }
+
+    /* the size of the file as opened is what goes in the header */
+    if (fstat(tar->fd, &fst) == 0)
+      st.st_size = fst.st_size;
+
+    tar->remaining = st.st_size;
+    tar->pad = (TAR_BLOCK - st.st_size % TAR_BLOCK) % TAR_BLOCK;
+    tar_stage_entry(tar, &st, '0', st.st_size);
+    return 0;
+  }
+
+  return -1;
+}
+
+tar_writer_t *
+tar_writer_open(const char *path)
+{
+  tar_writer_t *tar;
+  struct stat st;
+  const char *base;
+  size_t len = strlen(path);
+
+  if (len + 2 > TAR_PATH_MAX)
+  {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  if (lstat(path, &st) != 0)
+    return NULL;
+
+  tar = (tar_writer_t *)malloc(sizeof(*tar));
+  if (tar == NULL)
+  {
+    memstat_fail(MEM_XFER);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memstat_add(MEM_XFER, sizeof(*tar));
+
+  tar->frames[0].dp = opendir(path);
+  if (tar->frames[0].dp == NULL)
+  {
+    free(tar);
+    memstat_sub(MEM_XFER, sizeof(*tar));
+    return NULL;
+  }
+  tar->frames[0].len = len;
+  tar->depth = 1;
+  tar->fd = -1;
+  tar->remaining = 0;
+  tar->pad = 0;
+  tar->done = false;
+  tar->stage_pos = 0;
+  tar->stage_len = 0;
+  memcpy(tar->path, path, len + 1);
+
+  /* entries are named from the directory itself; the root has no name */
+  base = strrchr(path, '/');
+  tar->name_off = base != NULL ? base + 1 - path : 0;
+  if (tar->path[tar->name_off] != 0)
+    tar_stage_entry(tar, &st, '5', 0);
+
+  return tar;
+}
+
+ssize_t
+tar_writer_read(tar_writer_t *tar,
+                char *buffer,
+                size_t size)
+{
+  size_t done = 0, len;
+  ssize_t rc;
+
+  while (done < size)
+  {
+    /* headers and padding go first */
+    if (tar->stage_pos < tar->stage_len)
+    {
+      len = tar->stage_len - tar->stage_pos;
+      if (len > size - done)
+        len = size - done;
+
+      memcpy(buffer + done, tar->stage + tar->stage_pos, len);
+      tar->stage_pos += len;
+      done += len;
+      continue;
+    }
+
+    if (tar->fd != -1)
+    {
+      if (tar->remaining == 0)
+      {
+        /* the file is done; pad it to a whole block */
+        close(tar->fd);
+        tar->fd = -1;
+
+        memset(tar->stage, 0, tar->pad);
+        tar->stage_pos = 0;
+        tar->stage_len = tar->pad;
+        continue;
+      }
+
+      len = size - done;
+      if (len > tar->remaining)
+        len = tar->remaining;
+
+      rc = read(tar->fd, buffer + done, len);
+      if (rc < 0)
+      {
+        console_print(RED "read '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+        return -1;
+      }
+
+      if (rc == 0)
+      {
+        /* the file got shorter; make up the size the header has */
+        console_print(YELLOW "'%s' shrank while being archived\n" RESET, tar->path);
+        memset(buffer + done, 0, len);
+        rc = len;
+      }
+
+      tar->remaining -= rc;
+      done += rc;
+      continue;
+    }
+
+    if (tar->done)
+      break;
+
+    if (tar_next(tar) != 0)
+    {
+      /* two zero blocks end the archive */
+      memset(tar->stage, 0, 2 * TAR_BLOCK);
+      tar->stage_pos = 0;
+      tar->stage_len = 2 * TAR_BLOCK;
+      tar->done = true;
+    }
+  }
+
+  return done;
+}
+
+void
+tar_writer_close(tar_writer_t *tar)
+{
+  if (tar->fd != -1)
+    close(tar->fd);
+
+  while (tar->depth > 0)
+    closedir(tar->frames[--tar->depth].dp);
+
+  free(tar);
+  memstat_sub(MEM_XFER, sizeof(*tar));
+}
+
+/*! parse a numeric header field
+ *
+ *  @param[in]  field field
+ *  @param[in]  width field width
+ *  @param[out] value value
+ *
+ *  @returns whether it is a number
+ */
+static bool
+tar_parse_number(const char *field,
+                 size_t width,
+                 uint64_t *value)
+{
+  size_t i = 0;
+
+  *value = 0;
+
+  if ((unsigned char)field[0] == 0x80)
+  {
+    /* GNU base-256 */
+    for (i = 1; i < width; ++i)
+      *value = (*value << 8) | (unsigned char)field[i];
+    return true;
+  }
+
+  while (i < width && field[i] == ' ')
+    ++i;
+
+  for (; i < width && field[i] >= '0' && field[i] <= '7'; ++i)
+    *value = (*value << 3) | (field[i] - '0');
+
+  return i == width || field[i] == 0 || field[i] == ' ';
+}
+
+/*! make the path of an entry
+ *
+ *  @param[in] tar  archive
+ *  @param[in] name entry name
+ *  @param[in] len  name length
+ *
+ *  @returns 0 if it names the top directory, 1 if it names something in it,
+ *           or -1 if it can't be extracted
+ */
+static int
+tar_reader_path(tar_reader_t *tar,
+                const char *name,
+                size_t len)
+{
+  const char *end = name + len, *next;
+  size_t pos = tar->base_len, n;
+
+  tar->path[pos] = 0;
+
+  while (name < end)
+  {
+    next = memchr(name, '/', end - name);
+    if (next == NULL)
+      next = end;
+    n = next - name;
+
+    if (n == 2 && name[0] == '.' && name[1] == '.')
+    {
+      /* it would land outside the directory */
+      errno = EACCES;
+      return -1;
+    }
+
+    /* leading, doubled, and trailing slashes and . go away */
+    if (n != 0 && !(n == 1 && name[0] == '.'))
+    {
+      if (pos + n + 2 > TAR_PATH_MAX)
+      {
+        errno = ENAMETOOLONG;
+        return -1;
+      }
+
+      if (pos > 1)
+        tar->path[pos++] = '/';
+      memcpy(tar->path + pos, name, n);
+      pos += n;
+      tar->path[pos] = 0;
+    }
+
+    if (next == end)
+      break;
+    name = next + 1;
+  }
+
+  return pos > tar->base_len;
+}
+
+/*! make the missing directories above the current entry
+ *
+ *  @param[in] tar archive
+ *
+ *  @returns -1 for failure
+ */
+static int
+tar_reader_mkdirs(tar_reader_t *tar)
+{
+  char *p;
+  int rc;
+
+  for (p = tar->path + tar->base_len + 1; (p = strchr(p, '/')) != NULL; ++p)
+  {
+    *p = 0;
+    rc = mkdir(tar->path, 0755);
+    if (rc != 0 && errno != EEXIST)
+    {
+      console_print(RED "mkdir '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+      *p = '/';
+      return -1;
+    }
+    *p = '/';
+  }
+
+  return 0;
+}
+
+/*! take the path out of a pax header
+ *
+ *  @param[in] tar archive
+ */
+static void
+tar_reader_pax(tar_reader_t *tar)
+{
+  char *p = tar->long_data, *key, *value;
+  char *end = p + (tar->long_len < TAR_LONG_MAX ? tar->long_len : TAR_LONG_MAX);
+  unsigned long len;
+
+  *end = 0;
+
+  /* records are "<length> <key>=<value>\n" */
+  while (p < end)
+  {
+    len = strtoul(p, &key, 10);
+    if (len == 0 || *key != ' ' || len > (size_t)(end - p) || p[len - 1] != '\n')
+      return;
+
+    if (strncmp(key + 1, "path=", 5) == 0)
+    {
+      value = key + 6;
+      len = p + len - 1 - value;
+      memmove(tar->long_data, value, len);
+      tar->long_data[len] = 0;
+      tar->named = true;
+      return;
+    }
+
+    p += len;
+  }
+}
+
+/*! finish the data of the current entry
+ *
+ *  @param[in] tar archive
+ *
+ *  @returns -1 for failure
+ */
+static int
+tar_reader_data_end(tar_reader_t *tar)
+{
+  tar_data_t data = tar->data;
+
+  tar->data = TAR_DATA_SKIP;
+
+  switch (data)
+  {
+  case TAR_DATA_FILE:
+    if (close(tar->fd) != 0)
+    {
+      console_print(RED "close '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+      tar->fd = -1;
+      return -1;
+    }
+    tar->fd = -1;
+    break;
+
+  case TAR_DATA_LONG:
+    if (tar->long_len > TAR_PATH_MAX)
+    {
+      console_print(RED "tar: %d %s\n" RESET, ENAMETOOLONG, strerror(ENAMETOOLONG));
+      errno = ENAMETOOLONG;
+      return -1;
+    }
+    tar->long_data[tar->long_len] = 0;
+    tar->named = true;
+    break;
+
+  case TAR_DATA_PAX:
+    tar_reader_pax(tar);
+    break;
+
+  case TAR_DATA_SKIP:
+    break;
+  }
+
+  return 0;
+}
+
+/*! start the entry whose header was collected
+ *
+ *  @param[in] tar archive
+ *
+ *  @returns -1 for failure
+ */
+static int
+tar_reader_entry(tar_reader_t *tar)
+{
+  const tar_header_t *header = (const tar_header_t *)tar->header;
+  const char *name;
+  uint64_t size, sum;
+  unsigned check = 0;
+  size_t i, len;
+  char type = header->typeflag;
+  struct stat st;
+  bool replaced;
+  int rc;
+
+  /* a zero block ends the archive */
+  for (i = 0; i < TAR_BLOCK && tar->header[i] == 0; ++i)
+    ;
+  if (i == TAR_BLOCK)
+  {
+    tar->end = true;
+    return 0;
+  }
+
+  /* the checksum is taken with its own field as spaces */
+  for (i = 0; i < TAR_BLOCK; ++i)
+  {
+    if (i >= offsetof(tar_header_t, chksum) && i < offsetof(tar_header_t, typeflag))
+      check += ' ';
+    else
+      check += (unsigned char)tar->header[i];
+  }
+
+  if (!tar_parse_number(header->chksum, sizeof(header->chksum), &sum) || sum != check
+   || !tar_parse_number(header->size, sizeof(header->size), &size))
+  {
+    console_print(RED "tar: bad header\n" RESET);
+    errno = EINVAL;
+    return -1;
+  }
+
+  tar->remaining = size;
+  tar->pad = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+  tar->data = TAR_DATA_SKIP;
+
+  if (type == 'L' || type == 'x')
+  {
+    /* names the next entry */
+    tar->data = type == 'L' ? TAR_DATA_LONG : TAR_DATA_PAX;
+    tar->long_len = 0;
+  }
+  else if (type == '0' || type == 0 || type == '7' || type == '5')
+  {
+    if (tar->named)
+      name = tar->long_data;
+    else if (memcmp(header->magic, "ustar", sizeof(header->magic)) == 0 && header->prefix[0] != 0)
+    {
+      /* ustar splits long names in two */
+      len = strnlen(header->prefix, sizeof(header->prefix));
+      memcpy(tar->long_data, header->prefix, len);
+      tar->long_data[len++] = '/';
+      i = strnlen(header->name, sizeof(header->name));
+      memcpy(tar->long_data + len, header->name, i);
+      tar->long_data[len + i] = 0;
+      name = tar->long_data;
+    }
+    else
+    {
+      memcpy(tar->long_data, header->name, sizeof(header->name));
+      tar->long_data[strnlen(header->name, sizeof(header->name))] = 0;
+      name = tar->long_data;
+    }
+    tar->named = false;
+
+    len = strlen(name);
+    rc = tar_reader_path(tar, name, len);
+    if (rc < 0)
+    {
+      console_print(RED "tar '%s': %d %s\n" RESET, name, errno, strerror(errno));
+      return -1;
+    }
+
+    if (rc == 0)
+    {
+      /* the directory being extracted into */
+    }
+    else if (type == '5' || name[len - 1] == '/')
+    {
+      /* old archives mark directories with a trailing slash only */
+      if (tar_reader_mkdirs(tar) != 0)
+        return -1;
+
+      if (mkdir(tar->path, 0755) != 0 && errno != EEXIST)
+      {
+        console_print(RED "mkdir '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+        return -1;
+      }
+    }
+    else if (strcmp(tar->path, LOG_PATH) == 0)
+      console_print(RED "not extracting over ftpd.log\n" RESET);
+    else
+    {
+      /* rewrite rather than overwrite, as STOR does; the old file's space
+       * comes back once the unlink or the truncate has worked */
+      replaced = stat(tar->path, &st) == 0 && S_ISREG(st.st_mode);
+      if (replaced && unlink(tar->path) == 0)
+      {
+        tar->used -= st.st_size;
+        replaced = false;
+      }
+
+      tar->fd = open(tar->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (tar->fd < 0 && errno == ENOENT && tar_reader_mkdirs(tar) == 0)
+        tar->fd = open(tar->path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (tar->fd < 0)
+      {
+        console_print(RED "open '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+        return -1;
+      }
+      if (replaced)
+        tar->used -= st.st_size;
+      tar->data = TAR_DATA_FILE;
+    }
+  }
+  else
+  {
+    /* links, devices, and extensions we don't know */
+    console_print(YELLOW "tar: skipping '%.100s' of type '%c'\n" RESET, header->name, type);
+    tar->named = false;
+  }
+
+  if (tar->remaining == 0)
+    return tar_reader_data_end(tar);
+
+  return 0;
+}
+
+tar_reader_t *
+tar_reader_open(const char *path)
+{
+  tar_reader_t *tar;
+  struct stat st;
+  size_t len = strlen(path);
+
+  if (len + 2 > TAR_PATH_MAX)
+  {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  if (stat(path, &st) != 0)
+    return NULL;
+
+  if (!S_ISDIR(st.st_mode))
+  {
+    errno = ENOTDIR;
+    return NULL;
+  }
+
+  tar = (tar_reader_t *)malloc(sizeof(*tar));
+  if (tar == NULL)
+  {
+    memstat_fail(MEM_XFER);
+    errno = ENOMEM;
+    return NULL;
+  }
+  memstat_add(MEM_XFER, sizeof(*tar));
+
+  tar->data = TAR_DATA_SKIP;
+  tar->remaining = 0;
+  tar->pad = 0;
+  tar->header_len = 0;
+  tar->long_len = 0;
+  tar->named = false;
+  tar->end = false;
+  tar->fd = -1;
+  tar->used = 0;
+  tar->base_len = len;
+  memcpy(tar->path, path, len + 1);
+
+  return tar;
+}
+
+ssize_t
+tar_reader_write(tar_reader_t *tar,
+                 const char *buffer,
+                 size_t size)
+{
+  size_t done = 0, len;
+  ssize_t rc;
+
+  while (done < size)
+  {
+    if (tar->remaining > 0)
+    {
+      len = size - done;
+      if (len > tar->remaining)
+        len = tar->remaining;
+
+      if (tar->data == TAR_DATA_FILE)
+      {
+        rc = write(tar->fd, buffer + done, len);
+        if (rc <= 0)
+        {
+          console_print(RED "write '%s': %d %s\n" RESET, tar->path, errno, strerror(errno));
+          return -1;
+        }
+        len = rc;
+        tar->used += rc;
+      }
+      else if (tar->data != TAR_DATA_SKIP)
+      {
+        /* keep what fits; a long name that doesn't fit fails at the end */
+        if (tar->long_len < TAR_LONG_MAX)
+          memcpy(tar->long_data + tar->long_len, buffer + done,
+                 len < TAR_LONG_MAX - tar->long_len ? len : TAR_LONG_MAX - tar->long_len);
+        tar->long_len += len;
+      }
+
+      tar->remaining -= len;
+      done += len;
+
+      if (tar->remaining == 0 && tar_reader_data_end(tar) != 0)
+        return -1;
+      continue;
+    }
+
+    if (tar->pad > 0)
+    {
+      len = size - done;
+      if (len > tar->pad)
+        len = tar->pad;
+
+      tar->pad -= len;
+      done += len;
+      continue;
+    }
+
+    /* anything after the end of the archive is ignored */
+    if (tar->end)
+      break;
+
+    len = TAR_BLOCK - tar->header_len;
+    if (len > size - done)
+      len = size - done;
+
+    memcpy(tar->header + tar->header_len, buffer + done, len);
+    tar->header_len += len;
+    done += len;
+
+    if (tar->header_len == TAR_BLOCK)
+    {
+      tar->header_len = 0;
+      if (tar_reader_entry(tar) != 0)
+        return -1;
+    }
+  }
+
+  return size;
+}
+
+int64_t
+tar_reader_used(tar_reader_t *tar)
+{
+  int64_t used = tar->used;
+
+  tar->used = 0;
+  return used;
+}
+
+bool
+tar_reader_done(const tar_reader_t *tar)
+{
+  return tar->end
+      || (tar->remaining == 0 && tar->pad == 0 && tar->header_len == 0 && !tar->named);
+}
+
+void
+tar_reader_close(tar_reader_t *tar)
+{
+  if (tar->fd != -1)
+    close(tar->fd);
+
+  free(tar);
+  memstat_sub(MEM_XFER, sizeof(*tar));
+}
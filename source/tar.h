@@ -0,0 +1,90 @@
+// This file is under the terms of the unlicense (https://github.com/DavidBuchanan314/ftpd/blob/master/LICENSE)
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*! tar archive of a directory tree, made while it is read */
+typedef struct tar_writer tar_writer_t;
+
+/*! start archiving a directory
+ *
+ *  Entries are named from the directory itself, e.g. archiving /a/saves
+ *  gives saves/, saves/file and so on.
+ *
+ *  @param[in] path directory path
+ *
+ *  @returns archive to read with tar_writer_read, or NULL for failure
+ */
+tar_writer_t *tar_writer_open(const char *path);
+
+/*! read the next part of the archive
+ *
+ *  Entries that vanish or can't be opened on the way are left out.
+ *
+ *  @param[in] tar    archive
+ *  @param[in] buffer where to put it
+ *  @param[in] size   buffer size
+ *
+ *  @returns bytes read, 0 at the end of the archive, or -1 for failure
+ */
+ssize_t tar_writer_read(tar_writer_t *tar, char *buffer, size_t size);
+
+/*! end archiving
+ *
+ *  @param[in] tar archive
+ */
+void tar_writer_close(tar_writer_t *tar);
+
+/*! tar archive being extracted as it is written */
+typedef struct tar_reader tar_reader_t;
+
+/*! start extracting into a directory
+ *
+ *  Entry names are taken relative to the directory; leading slashes are
+ *  dropped and names with .. are refused. Missing directories are made.
+ *
+ *  @param[in] path directory path
+ *
+ *  @returns archive to write with tar_reader_write, or NULL for failure
+ */
+tar_reader_t *tar_reader_open(const char *path);
+
+/*! write the next part of the archive
+ *
+ *  Links and devices are skipped.
+ *
+ *  @param[in] tar    archive
+ *  @param[in] buffer archive data
+ *  @param[in] size   data size
+ *
+ *  @returns size, or -1 for failure
+ */
+ssize_t tar_reader_write(tar_reader_t *tar, const char *buffer, size_t size);
+
+/*! take the change in used space since the last call
+ *
+ *  Extracted data counts as used; files that entries replace count as freed.
+ *
+ *  @param[in] tar archive
+ *
+ *  @returns bytes used; negative for bytes freed
+ */
+int64_t tar_reader_used(tar_reader_t *tar);
+
+/*! check whether the archive ended between entries
+ *
+ *  @param[in] tar archive
+ *
+ *  @returns false if the data stopped in the middle of an entry
+ */
+bool tar_reader_done(const tar_reader_t *tar);
+
+/*! end extracting
+ *
+ *  @param[in] tar archive
+ */
+void tar_reader_close(tar_reader_t *tar);